@@ -0,0 +1,943 @@
+// Benchmarks for value.h in the style of Google Benchmark: every benchmark runs for at least
+// --benchmark_min_time seconds (doubling its iterations until it does) and reports the time per
+// iteration. --benchmark_out=file.json writes the results in Google Benchmark's JSON layout, so two
+// runs can be compared with its tools/compare.py, --benchmark_filter=text runs the ones whose name
+// contains text and --benchmark_threads=n lets the ones taking a number of threads (with USE_THREADS)
+// go up to n of them instead of the number of cores
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <ctime>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+#include <thread>
+#include <value.h>
+
+class State {
+public:
+	size_t iterations;
+	long range;
+	std::map<std::string, double> counters;
+
+	State(size_t iterations, long range) : iterations(iterations), range(range) {}
+
+	struct Iterator {
+		State* state;
+		size_t left;
+		bool operator!= (const Iterator&) {
+			if (left != 0) return true;
+			state->stop();
+			return false;
+		}
+		void operator++ () { left--; }
+		struct __attribute__((unused)) Tick {};
+		Tick operator* () const { return Tick(); }
+	};
+
+	Iterator begin() {
+		start();
+		return Iterator { this, iterations };
+	}
+
+	Iterator end() {
+		return Iterator { this, 0 };
+	}
+
+	// leaves the setup done inside the loop out of the time
+	void pauseTiming() {
+		pausedAt = std::chrono::steady_clock::now();
+		pausedCpuAt = std::clock();
+	}
+
+	void resumeTiming() {
+		paused += std::chrono::steady_clock::now() - pausedAt;
+		pausedCpu += std::clock() - pausedCpuAt;
+	}
+
+	double realTime() const { return std::chrono::duration<double>(stopped - started - paused).count(); }
+	double cpuTime() const { return double(stoppedCpu - startedCpu - pausedCpu) / CLOCKS_PER_SEC; }
+
+private:
+	std::chrono::steady_clock::time_point started, stopped, pausedAt;
+	std::chrono::steady_clock::duration paused = std::chrono::steady_clock::duration::zero();
+	std::clock_t startedCpu = 0, stoppedCpu = 0, pausedCpuAt = 0, pausedCpu = 0;
+
+	void start() {
+		startedCpu = std::clock();
+		started = std::chrono::steady_clock::now();
+	}
+
+	void stop() {
+		stopped = std::chrono::steady_clock::now();
+		stoppedCpu = std::clock();
+	}
+};
+
+struct Benchmark {
+	std::string name;
+	std::function<void(State&)> fn;
+	std::vector<long> args;
+
+	Benchmark& arg(long a) {
+		args.push_back(a);
+		return *this;
+	}
+};
+
+static std::vector<Benchmark>& benchmarks() {
+	static std::vector<Benchmark> all;
+	return all;
+}
+
+static Benchmark& add(const std::string& name, std::function<void(State&)> fn) {
+	benchmarks().push_back(Benchmark { name, fn, {} });
+	return benchmarks().back();
+}
+
+// the thread counts taken by benchmarks double from 1 up to this
+static long& maxThreads() {
+	static long n = std::thread::hardware_concurrency() ? std::thread::hardware_concurrency() : 1;
+	return n;
+}
+
+template <class T>
+static void keep(const T& v) {
+	asm volatile("" : : "g"(&v) : "memory");
+}
+
+// inputs
+
+static Value numbers(long n, bool shuffled = true) {
+	Value res = Types::Array;
+	res.reserve(n);
+	unsigned x = 12345;
+	for (long i = 0; i < n; i++) {
+		x = x * 1103515245 + 12345;
+		res.append(shuffled ? double(x % 1000000) / 7 : double(i));
+	}
+	return res;
+}
+
+static Value texts(long n) {
+	Value res = Types::Array;
+	unsigned x = 54321;
+	for (long i = 0; i < n; i++) {
+		x = x * 1103515245 + 12345;
+		res.append(Value(("item-" + std::to_string(x % 100000)).c_str()));
+	}
+	return res;
+}
+
+// records have symbol keys, that puts them in a shape
+static Value record(long i) {
+	static const Value id = Value::symbol(Value("id")), name = Value::symbol(Value("name"));
+	static const Value city = Value::symbol(Value("city")), score = Value::symbol(Value("score"));
+	Value r = Types::Map;
+	r.put(id, (int) i);
+	r.put(name, Value(("name-" + std::to_string(i % 100)).c_str()));
+	r.put(city, Value(i % 2 ? "Lisbon" : "Porto"));
+	r.put(score, (int) (i * 7 % 100));
+	return r;
+}
+
+static Value wideMap(long n) {
+	Value m = Types::Map;
+	for (long i = 0; i < n; i++) m.put(Value(("key-" + std::to_string(i)).c_str()), (int) i);
+	return m;
+}
+
+static Value chain(long depth) {
+	Value cur = 1;
+	for (long i = 0; i < depth; i++) {
+		Value next = Types::Array;
+		next.append(cur);
+		next.append((int) i);
+		cur = next;
+	}
+	return cur;
+}
+
+static Value operand(const std::string& type, bool second) {
+	if (type == "Small") return second ? Value(678) : Value(12345);
+	if (type == "Big") return Value(NUMBER(second ? "987654321098765432109876543210" : "123456789012345678901234567890"));
+	return second ? Value("world") : Value("hello world");
+}
+
+// construction, copies and copy-on-write
+
+static void registerConstruction() {
+	add("BM_ConstructNumber", [] (State& state) {
+		for (auto _ : state) keep(Value(42.5));
+	});
+	add("BM_ConstructText", [] (State& state) {
+		for (auto _ : state) keep(Value("a text that doesn't fit in the small string buffer"));
+	});
+	add("BM_ConstructBig", [] (State& state) {
+		for (auto _ : state) keep(Value(NUMBER("123456789012345678901234567890")));
+	});
+	add("BM_ConstructArray", [] (State& state) {
+		for (auto _ : state) keep(numbers(state.range));
+	}).arg(1000);
+	add("BM_ConstructMap", [] (State& state) {
+		long i = 0;
+		for (auto _ : state) keep(record(i++));
+	});
+	add("BM_Copy", [] (State& state) {
+		Value a = texts(state.range);
+		for (auto _ : state) {
+			Value copy = a;
+			keep(copy);
+		}
+	}).arg(1000);
+	add("BM_CopyAndModify", [] (State& state) {
+		Value a = texts(state.range);
+		for (auto _ : state) {
+			Value copy = a;
+			copy.append(1);
+			keep(copy);
+		}
+	}).arg(1000);
+}
+
+// arithmetic
+
+static void registerArithmetic() {
+	const char* types[] = { "Small", "Big", "Text" };
+	const char* names[] = { "Add", "Sub", "Mul", "Div", "Mod" };
+	for (const char* type : types) {
+		for (int op = 0; op < 5; op++) {
+			std::string t = type;
+			add(std::string("BM_") + names[op] + "/" + type, [t, op] (State& state) {
+				Value a = operand(t, false), b = t == "Text" && op == 2 ? Value(3) : operand(t, true);
+				for (auto _ : state) {
+					switch (op) {
+						case 0: keep(a + b); break;
+						case 1: keep(a - b); break;
+						case 2: keep(a * b); break;
+						case 3: keep(a / b); break;
+						default: keep(a % b); break;
+					}
+				}
+			});
+		}
+	}
+	// temporaries reused by the rvalue operators
+	for (std::string t : { "Small", "Big" }) {
+		add("BM_Chained/" + t, [t] (State& state) {
+			Value a = operand(t, false), b = operand(t, true);
+			for (auto _ : state) keep(a + b + a + b + a);
+		});
+		// a*x^3 + b*x^2 + c*x + d, every product but the leaves is a temporary
+		add("BM_Polynomial/" + t, [t] (State& state) {
+			Value x = operand(t, false), a = operand(t, true), b = 3, c = 5, d = 7;
+			for (auto _ : state) keep(a * x * x * x + b * x * x + c * x + d);
+		});
+	}
+	add("BM_Pow/Small", [] (State& state) {
+		for (auto _ : state) {
+			Value v = 3;
+			v.pow(Value(30));
+			keep(v);
+		}
+	});
+	add("BM_Pow/Big", [] (State& state) {
+		for (auto _ : state) {
+			Value v = operand("Big", false);
+			v.pow(Value(20));
+			keep(v);
+		}
+	});
+	add("BM_PowMod", [] (State& state) {
+		for (auto _ : state) {
+			Value v = 7;
+			v.powMod(Value(1000003), Value(998244353));
+			keep(v);
+		}
+	});
+}
+
+// packed numeric arrays and element-wise arithmetic
+
+static void registerNumeric() {
+	add("BM_PackedBytesPerElement", [] (State& state) {
+		Value a;
+		for (auto _ : state) a = numbers(state.range);
+		state.counters["bytes_per_element"] = double(ValueInternTable::payloadSize(a)) / state.range;
+	}).arg(1000000);
+	add("BM_ElementWiseAdd", [] (State& state) {
+		Value a = numbers(state.range), b = numbers(state.range);
+		for (auto _ : state) {
+			a += b;
+			keep(a);
+		}
+		state.counters["flops"] = double(state.range) * state.iterations;
+	}).arg(1000000);
+	add("BM_Sum", [] (State& state) {
+		Value a = numbers(state.range);
+		for (auto _ : state) keep(a.sum());
+		state.counters["flops"] = double(state.range) * state.iterations;
+	}).arg(1000000);
+	add("BM_Dot", [] (State& state) {
+		Value a = numbers(state.range), b = numbers(state.range);
+		for (auto _ : state) keep(a.dot(b));
+		state.counters["flops"] = 2.0 * state.range * state.iterations;
+	}).arg(1000000);
+}
+
+// text, hashing and lookups
+
+static void registerLookups() {
+	add("BM_ToString/Number", [] (State& state) {
+		Value v = 3.14159;
+		for (auto _ : state) keep(v.toString());
+	});
+	add("BM_ToString/Array", [] (State& state) {
+		Value v = texts(state.range);
+		for (auto _ : state) keep(v.toString());
+	}).arg(1000);
+	add("BM_ToString/Map", [] (State& state) {
+		Value v = wideMap(state.range);
+		for (auto _ : state) keep(v.toString());
+	}).arg(1000);
+	// range records, one of them gets a field changed in place before they are all written again
+	for (bool cached : { false, true }) {
+		add(cached ? "BM_ToString/PointEdit/Cached" : "BM_ToString/PointEdit/Plain", [cached] (State& state) {
+			Value records = Types::Array;
+			for (long i = 0; i < state.range; i++) records.append(record(i));
+			long n = 0;
+			for (auto _ : state) {
+				records[(int) (n % state.range)].put(Value("score"), (int) n);
+				n++;
+				keep(cached ? records.toCachedString() : records.toString());
+			}
+		}).arg(100000);
+	}
+	add("BM_Hash/Text", [] (State& state) {
+		Value v = "some key of a map";
+		HashFunction h;
+		for (auto _ : state) keep(h(v));
+	});
+	add("BM_Hash/Array", [] (State& state) {
+		Value v = texts(state.range);
+		HashFunction h;
+		for (auto _ : state) keep(h(v));
+	}).arg(1000);
+	add("BM_Hash/Map", [] (State& state) {
+		Value v = wideMap(state.range);
+		HashFunction h;
+		for (auto _ : state) keep(h(v));
+	}).arg(1000);
+	// wide maps aren't shaped, the same key as a new text, as a symbol and through a cache on records
+	add("BM_MapGet/Text", [] (State& state) {
+		Value m = wideMap(state.range);
+		for (auto _ : state) keep(m.get(Value("key-7")));
+	}).arg(100);
+	add("BM_MapGet/Symbol", [] (State& state) {
+		Value m = wideMap(state.range), k = Value::symbol(Value("key-7"));
+		for (auto _ : state) keep(m.get(k));
+	}).arg(100);
+	add("BM_MapGet/Shaped", [] (State& state) {
+		Value r = record(1), k = Value::symbol(Value("score"));
+		for (auto _ : state) keep(r.get(k));
+	});
+	add("BM_MapGet/Cached", [] (State& state) {
+		Value r = record(1), k = Value::symbol(Value("score"));
+		ValueKeyCache cache;
+		for (auto _ : state) keep(r.get(k, cache));
+	});
+	// a dictionary of range keys is filled and then read 10 times with every key as a plain text, Shaped
+	// has the keys as symbols (shaped up to MAX_SHAPE_SIZE of them, the rest hashed) and Hashed as texts
+	for (int shaped = 0; shaped < 2; shaped++) {
+		Benchmark& dictionary = add(shaped ? "BM_Dictionary/Shaped" : "BM_Dictionary/Hashed", [shaped] (State& state) {
+			Value keys = Types::Array, plain = Types::Array;
+			for (long i = 0; i < state.range; i++) {
+				Value k = ("field-" + std::to_string(i)).c_str();
+				keys.append(shaped ? Value::symbol(k) : k);
+				plain.append(Value(("field-" + std::to_string(i)).c_str()));
+			}
+			const ARRAY& k = *keys.getData().array;
+			const ARRAY& t = *plain.getData().array;
+			for (auto _ : state) {
+				Value m = Types::Map;
+				for (long i = 0; i < state.range; i++) m.put(k.item(i), (int) i);
+				double sum = 0;
+				for (int round = 0; round < 10; round++) {
+					for (long i = 0; i < state.range; i++) sum += m.get(t.item(i)).toDouble();
+				}
+				keep(sum);
+			}
+			state.counters["items"] = 11.0 * state.range * state.iterations;
+		});
+		for (long n : { 4, 16, 32, 64 }) dictionary.arg(n);
+	}
+	add("BM_Split", [] (State& state) {
+		std::string s;
+		for (long i = 0; i < state.range; i++) s += "word" + std::to_string(i) + " ";
+		Value text = s.c_str();
+		for (auto _ : state) keep(text.split(Value(" ")));
+	}).arg(1000);
+	add("BM_IndexOf/Text", [] (State& state) {
+		Value a = texts(state.range);
+		a.append(Value("needle"));
+		for (auto _ : state) keep(a.indexOf(Value("needle")));
+	}).arg(10000);
+	add("BM_IndexOf/Number", [] (State& state) {
+		Value a = numbers(state.range);
+		for (auto _ : state) keep(a.indexOf(Value(-1)));
+	}).arg(10000);
+}
+
+// sorting (radix paths for numbers and texts)
+
+static void registerSorting() {
+	for (long n : { 1000L, 100000L }) {
+		add("BM_Sort/Text", [] (State& state) {
+			Value source = texts(state.range);
+			for (auto _ : state) {
+				state.pauseTiming();
+				Value a = source;
+				a.append(0);
+				a._pop();
+				state.resumeTiming();
+				a.sort();
+				keep(a);
+			}
+		}).arg(n);
+		add("BM_Sort/Number", [] (State& state) {
+			Value source = numbers(state.range);
+			for (auto _ : state) {
+				state.pauseTiming();
+				Value a = source;
+				a.append(0);
+				a._pop();
+				state.resumeTiming();
+				a.sort();
+				keep(a);
+			}
+		}).arg(n);
+		add("BM_NumericSort", [] (State& state) {
+			Value source = numbers(state.range);
+			for (auto _ : state) {
+				state.pauseTiming();
+				Value a = source;
+				a.append(0);
+				a._pop();
+				state.resumeTiming();
+				a.numericSort();
+				keep(a);
+			}
+		}).arg(n);
+	}
+}
+
+// persistent snapshots, interning, symbols and shapes
+
+static void registerSharing() {
+	for (int persistent = 0; persistent < 2; persistent++) {
+		add(persistent ? "BM_SnapshotAndSet/Persistent" : "BM_SnapshotAndSet/Vector", [persistent] (State& state) {
+			Value a = texts(state.range);
+			if (persistent) a.persist();
+			long i = 0;
+			for (auto _ : state) {
+				Value snapshot = a;
+				snapshot.set((int) (i++ % state.range), Value("changed"));
+				keep(snapshot);
+			}
+		}).arg(100000);
+	}
+	add("BM_Intern", [] (State& state) {
+		size_t saved = 0;
+		for (auto _ : state) {
+			state.pauseTiming();
+			ValueInternTable table;
+			Value rows = Types::Array;
+			for (long i = 0; i < state.range; i++) rows.append(record(i));
+			state.resumeTiming();
+			rows.intern(table);
+			saved = table.bytesSaved;
+		}
+		state.counters["bytes_saved"] = saved;
+	}).arg(10000);
+	for (int sharedOnce = 0; sharedOnce < 2; sharedOnce++) {
+		add(sharedOnce ? "BM_MemoryUsage/SharedOnce" : "BM_MemoryUsage/Deep", [sharedOnce] (State& state) {
+			Value rows = Types::Array;
+			for (long i = 0; i < state.range; i++) rows.append(record(i));
+			size_t bytes = 0;
+			for (auto _ : state) bytes = rows.memoryUsage(sharedOnce);
+			state.counters["bytes"] = bytes;
+		}).arg(10000);
+	}
+	add("BM_RecordBytes", [] (State& state) {
+		size_t shaped = 0, hashed = 0;
+		for (auto _ : state) {
+			Value r = record(1);
+			shaped = ValueInternTable::payloadSize(r);
+			r.remove(Value("score")); // removing a key of the shape leaves it
+			r.put(Value("score"), 7);
+			hashed = ValueInternTable::payloadSize(r);
+		}
+		state.counters["shaped_bytes"] = shaped;
+		state.counters["hashed_bytes"] = hashed;
+	});
+}
+
+// deep trees, cycles, bulk building, iteration and slices
+
+static void registerStructure() {
+	add("BM_DeepTree/Destroy", [] (State& state) {
+		for (auto _ : state) {
+			state.pauseTiming();
+			Value* tree = new Value(chain(state.range));
+			state.resumeTiming();
+			delete tree;
+		}
+	}).arg(100000);
+	add("BM_DeepTree/Equal", [] (State& state) {
+		Value a = chain(state.range), b = chain(state.range);
+		for (auto _ : state) keep(a == b);
+	}).arg(100000);
+	add("BM_DeepTree/Hash", [] (State& state) {
+		Value a = chain(state.range);
+		HashFunction h;
+		for (auto _ : state) keep(h(a));
+	}).arg(100000);
+	add("BM_DeepTree/ToString", [] (State& state) {
+		Value a = chain(state.range);
+		for (auto _ : state) keep(a.toString());
+	}).arg(100000);
+	// the pause of a collection with range live records and range / 10 garbage cycles
+	add("BM_CollectCycles", [] (State& state) {
+		Value::detectCycles();
+		Value live = Types::Array;
+		for (long i = 0; i < state.range; i++) live.append(record(i));
+		size_t freed = 0;
+		for (auto _ : state) {
+			state.pauseTiming();
+			for (long i = 0; i < state.range / 10; i++) {
+				Value a = Types::Array, b = Types::Array;
+				a.append(b, false);
+				b.append(a, false);
+				Value copy = live[(int) i];
+			}
+			state.resumeTiming();
+			freed = Value::collectCycles();
+		}
+		Value::detectCycles(false);
+		state.counters["freed"] = freed;
+	}).arg(10000).arg(100000);
+	add("BM_Build/Append", [] (State& state) {
+		for (auto _ : state) {
+			Value a = Types::Array;
+			for (long i = 0; i < state.range; i++) a.append(Value("v"));
+			keep(a);
+		}
+		state.counters["items"] = double(state.range) * state.iterations;
+	}).arg(1000000);
+	add("BM_Build/Extend", [] (State& state) {
+		for (auto _ : state) {
+			state.pauseTiming();
+			std::vector<Value> source(state.range, Value("v"));
+			state.resumeTiming();
+			Value a = Types::Array;
+			a.extend(std::make_move_iterator(source.begin()), std::make_move_iterator(source.end()));
+			keep(a);
+		}
+		state.counters["items"] = double(state.range) * state.iterations;
+	}).arg(1000000);
+	add("BM_Build/AppendNumbers", [] (State& state) {
+		for (auto _ : state) {
+			Value a = Types::Array;
+			for (long i = 0; i < state.range; i++) a.append((int) i);
+			keep(a);
+		}
+		state.counters["items"] = double(state.range) * state.iterations;
+	}).arg(10000000);
+	add("BM_Build/ExtendNumbers", [] (State& state) {
+		Value source = numbers(state.range, false);
+		for (auto _ : state) {
+			Value a = Types::Array;
+			a.extend(source);
+			keep(a);
+		}
+		state.counters["items"] = double(state.range) * state.iterations;
+	}).arg(10000000);
+	add("BM_MapWalk/Entries", [] (State& state) {
+		Value m = wideMap(state.range);
+		m.put(Value(0), 0); // a hash map
+		for (auto _ : state) {
+			double sum = 0;
+			for (auto e : m.entries()) sum += e.value.toDouble();
+			keep(sum);
+		}
+	}).arg(5000);
+	add("BM_MapWalk/GetValueAt", [] (State& state) {
+		Value m = wideMap(state.range);
+		m.put(Value(0), 0);
+		for (auto _ : state) {
+			double sum = 0;
+			for (int i = 0; i < m.length(); i++) sum += m.getValueAt(i).toDouble();
+			keep(sum);
+		}
+	}).arg(5000);
+	add("BM_Pages/Slice", [] (State& state) {
+		Value a = texts(state.range);
+		for (auto _ : state) {
+			for (long page = 0; page < state.range; page += 1000) keep(a.slice(page, page + 1000));
+		}
+	}).arg(1000000);
+	add("BM_Pages/Copy", [] (State& state) {
+		Value a = texts(state.range);
+		for (auto _ : state) {
+			for (long page = 0; page < state.range; page += 1000) {
+				Value p = Types::Array;
+				for (long i = page; i < page + 1000; i++) p.append(a.getData().array->item(i));
+				keep(p);
+			}
+		}
+	}).arg(1000000);
+	// range records and a copy with one of them changed: Shared diffs the copy (the other records are
+	// the same payloads), DeepCopy a deep copy changed the same way (every record gets compared)
+	auto edited = [] (const Value& records) {
+		Value res = records;
+		Value r = records.getData().array->item(records.length() / 2);
+		r.put(Value("score"), -1);
+		res.set(records.length() / 2, r);
+		return res;
+	};
+	add("BM_Diff/Shared", [edited] (State& state) {
+		Value a = Types::Array;
+		for (long i = 0; i < state.range; i++) a.append(record(i));
+		Value b = edited(a);
+		for (auto _ : state) keep(Value::diff(a, b));
+	}).arg(100000);
+	add("BM_Diff/DeepCopy", [edited] (State& state) {
+		Value a = Types::Array;
+		for (long i = 0; i < state.range; i++) a.append(record(i));
+		Value b = edited(a.deepCopy());
+		for (auto _ : state) keep(Value::diff(a, b));
+	}).arg(100000);
+	add("BM_Diff/Apply", [edited] (State& state) {
+		Value a = Types::Array;
+		for (long i = 0; i < state.range; i++) a.append(record(i));
+		Value patch = Value::diff(a, edited(a));
+		for (auto _ : state) {
+			Value c = a;
+			c.apply(patch);
+			keep(c);
+		}
+	}).arg(100000);
+}
+
+// parallel map, filter and reduce over 10M elements, the argument is the number of threads. They have
+// only been run on a single core (up to 4 threads with --benchmark_threads), where more threads take
+// about as long as one: that bounds the cost of splitting the work up but says nothing about scaling
+
+static void parallelBenchmark(const std::string& name, std::function<void(State&, const Value&)> fn) {
+	Benchmark& b = add(name, [fn] (State& state) {
+#ifdef USE_THREADS
+		ValueThreadPool::setThreads(state.range);
+#endif
+		Value a = numbers(10000000);
+		fn(state, a);
+		state.counters["items"] = 1e7 * state.iterations;
+#ifdef USE_THREADS
+		ValueThreadPool::setThreads(std::thread::hardware_concurrency());
+#endif
+	});
+#ifdef USE_THREADS
+	for (long threads = 1; threads <= maxThreads(); threads *= 2) b.arg(threads);
+#else
+	b.arg(1);
+#endif
+}
+
+static void registerParallel() {
+	parallelBenchmark("BM_ParallelMap", [] (State& state, const Value& a) {
+		for (auto _ : state) keep(a.parallelMap([] (const Value& v) { return Value(sqrt(v.toDouble()) * 3 + 1); }));
+	});
+	parallelBenchmark("BM_ParallelFilter", [] (State& state, const Value& a) {
+		for (auto _ : state) keep(a.parallelFilter([] (const Value& v) { return sqrt(v.toDouble()) > 100; }));
+	});
+	parallelBenchmark("BM_ParallelReduce", [] (State& state, const Value& a) {
+		for (auto _ : state) keep(a.parallelReduce(Value(0), [] (const Value& x, const Value& y) { return x < y ? y : x; }));
+	});
+	// a copy of the same numbers as texts, so the elements get compared and hashed one by one
+	parallelBenchmark("BM_ParallelEquals", [] (State& state, const Value& a) {
+		Value x = a.parallelMap([] (const Value& v) { return Value(v.toString().c_str()); });
+		Value y = x;
+		y.append(0);
+		y._pop();
+		for (auto _ : state) keep(x.parallelEquals(y));
+	});
+	parallelBenchmark("BM_ParallelHash", [] (State& state, const Value& a) {
+		Value x = a.parallelMap([] (const Value& v) { return Value(v.toString().c_str()); });
+		for (auto _ : state) keep(x.parallelHash());
+	});
+	parallelBenchmark("BM_ParallelHash/Unordered", [] (State& state, const Value& a) {
+		for (auto _ : state) keep(a.parallelHash(false));
+	});
+}
+
+// a map shared by threads, the argument is the number of threads and every one of them does 100000
+// operations, a tenth of them (or half of them) puts and the rest gets. Sharded is ValueConcurrentMap,
+// Locked is a Types::Map behind a single mutex. They have only been run on a single core (up to 4
+// threads with --benchmark_threads), where the threads take turns: that compares the maps more than
+// the locking and says nothing about scaling
+
+template <class Map>
+static void mapThroughput(State& state, Map& map, int writePercent) {
+	Value keys = Types::Array;
+	for (int i = 0; i < 10000; i++) keys.append(Value(("key-" + std::to_string(i)).c_str()));
+	for (int i = 0; i < 10000; i++) map.put(keys[i], Value(i));
+	long threads = state.range;
+	for (auto _ : state) {
+		auto work = [&map, &keys, writePercent] (long t) {
+			unsigned x = (unsigned) t * 7919 + 1;
+			for (int i = 0; i < 100000; i++) {
+				x = x * 1103515245 + 12345;
+				const Value& k = keys.getData().array->item((x >> 8) % 10000);
+				if ((int) (x % 100) < writePercent) map.put(k, Value(i));
+				else keep(map.get(k));
+			}
+		};
+#ifdef USE_THREADS
+		std::vector<std::thread> workers;
+		for (long t = 1; t < threads; t++) workers.emplace_back(work, t);
+		work(0);
+		for (size_t t = 0; t < workers.size(); t++) workers[t].join();
+#else
+		work(0);
+#endif
+	}
+	state.counters["items"] = 100000.0 * threads * state.iterations;
+}
+
+// what a Types::Map shared by threads takes without ValueConcurrentMap
+struct LockedMap {
+	std::mutex lock;
+	Value map = Types::Map;
+
+	void put(const Value& k, const Value& v) {
+		Value key = k.deepCopy(), value = v.deepCopy();
+		std::lock_guard<std::mutex> guard(lock);
+		map.put(key, value);
+	}
+
+	Value get(const Value& k) {
+		std::lock_guard<std::mutex> guard(lock);
+		return map.get(k).deepCopy();
+	}
+};
+
+// a table every thread (the argument) reads and that gets replaced once in a while: every thread looks
+// up 100000 keys and the first one also publishes a new version every 10000 of them. Snapshot reads a
+// ValueSnapshot going through a quiescent state after each lookup, Locked a Types::Map behind a shared
+// mutex
+
+template <class Table>
+static void tableReads(State& state, Table& table) {
+	Value keys = Types::Array, versions[2] = { Types::Map, Types::Map };
+	for (int i = 0; i < 10000; i++) {
+		keys.append(Value(("route-" + std::to_string(i)).c_str()));
+		versions[0].put(keys[i], Value(i));
+		versions[1].put(keys[i], Value(-i));
+	}
+	table.publish(versions[0]);
+	long threads = state.range;
+	for (auto _ : state) {
+		auto work = [&table, &keys, &versions] (long t) {
+			unsigned x = (unsigned) t * 7919 + 1;
+			for (int i = 0; i < 100000; i++) {
+				x = x * 1103515245 + 12345;
+				keep(table.read(keys.getData().array->item((x >> 8) % 10000)));
+				if (t == 0 && i % 50000 == 0) table.publish(versions[(i / 10000) % 2]);
+			}
+		};
+#ifdef USE_THREADS
+		std::vector<std::thread> workers;
+		for (long t = 1; t < threads; t++) workers.emplace_back(work, t);
+		work(0);
+		for (size_t t = 0; t < workers.size(); t++) workers[t].join();
+#else
+		work(0);
+#endif
+	}
+	state.counters["items"] = 100000.0 * threads * state.iterations;
+}
+
+struct SnapshotTable {
+	ValueSnapshot<> snapshot;
+
+	long read(const Value& k) {
+		long res = snapshot.read().get(k);
+		ValueRcu::quiescent();
+		return res;
+	}
+
+	void publish(const Value& v) {
+		snapshot.publish(v);
+	}
+};
+
+struct LockedTable {
+	std::shared_timed_mutex lock;
+	Value map = Types::Map;
+
+	long read(const Value& k) {
+		std::shared_lock<std::shared_timed_mutex> guard(lock);
+		return map.get(k);
+	}
+
+	void publish(const Value& v) {
+		Value next = v.deepCopy();
+		std::unique_lock<std::shared_timed_mutex> guard(lock);
+		std::swap(map, next); // the old version gets freed once the lock is released
+	}
+};
+
+static void registerConcurrent() {
+	for (int writes : { 10, 50 }) {
+		std::string mix = writes == 10 ? "/ReadHeavy" : "/WriteHeavy";
+		Benchmark& sharded = add("BM_ConcurrentMap/Sharded" + mix, [writes] (State& state) {
+			ValueConcurrentMap map;
+			mapThroughput(state, map, writes);
+		});
+		Benchmark& locked = add("BM_ConcurrentMap/Locked" + mix, [writes] (State& state) {
+			LockedMap map;
+			mapThroughput(state, map, writes);
+		});
+#ifdef USE_THREADS
+		for (long threads = 1; threads <= maxThreads(); threads *= 2) {
+			sharded.arg(threads);
+			locked.arg(threads);
+		}
+#else
+		sharded.arg(1);
+		locked.arg(1);
+#endif
+	}
+	Benchmark& snapshot = add("BM_TableReads/Snapshot", [] (State& state) {
+		SnapshotTable table;
+		tableReads(state, table);
+	});
+	Benchmark& locked = add("BM_TableReads/Locked", [] (State& state) {
+		LockedTable table;
+		tableReads(state, table);
+	});
+#ifdef USE_THREADS
+	for (long threads = 1; threads <= maxThreads(); threads *= 2) {
+		snapshot.arg(threads);
+		locked.arg(threads);
+	}
+#else
+	snapshot.arg(1);
+	locked.arg(1);
+#endif
+}
+
+static std::string escape(const std::string& s) {
+	std::string res;
+	for (char c : s) {
+		if (c == '"' || c == '\\') res += '\\';
+		res += c;
+	}
+	return res;
+}
+
+int main(int argc, char** argv) {
+	std::string out, filter;
+	double minTime = 0.5;
+	for (int i = 1; i < argc; i++) {
+		std::string a = argv[i];
+		if (a.find("--benchmark_out=") == 0) out = a.substr(16);
+		else if (a.find("--benchmark_filter=") == 0) filter = a.substr(19);
+		else if (a.find("--benchmark_min_time=") == 0) minTime = atof(a.substr(21).c_str());
+		else if (a.find("--benchmark_threads=") == 0 && atol(a.substr(20).c_str()) > 0) maxThreads() = atol(a.substr(20).c_str());
+		else {
+			std::cerr << "usage: " << argv[0] << " [--benchmark_filter=text] [--benchmark_min_time=seconds] [--benchmark_out=file.json]"
+				<< " [--benchmark_threads=n]" << std::endl;
+			return 1;
+		}
+	}
+	registerConstruction();
+	registerArithmetic();
+	registerNumeric();
+	registerLookups();
+	registerSorting();
+	registerSharing();
+	registerStructure();
+	registerParallel();
+	registerConcurrent();
+
+	std::ostringstream json;
+	bool first = true;
+	std::cout << "Benchmark                                        Time (ns)        CPU (ns)  Iterations" << std::endl;
+	for (Benchmark& b : benchmarks()) {
+		std::vector<long> args = b.args.empty() ? std::vector<long>(1, 0) : b.args;
+		for (long arg : args) {
+			std::string name = b.args.empty() ? b.name : b.name + "/" + std::to_string(arg);
+			if (name.find(filter) == std::string::npos) continue;
+			size_t iterations = 1;
+			while (true) {
+				State state(iterations, arg);
+				b.fn(state);
+				double t = state.realTime();
+				if (t >= minTime || iterations >= 1000000000) {
+					double real = t * 1e9 / iterations, cpu = state.cpuTime() * 1e9 / iterations;
+					std::cout << name;
+					for (size_t i = name.size(); i < 44; i++) std::cout << ' ';
+					std::cout << std::setw(15) << std::fixed << std::setprecision(1) << real << ' ' << std::setw(15) << cpu
+						<< ' ' << std::setw(11) << iterations;
+					for (auto& c : state.counters) {
+						// totals over the iterations are reported per second
+						bool rate = c.first == "flops" || c.first == "items";
+						std::cout << ' ' << c.first << (rate ? "/s" : "") << '=' << std::setprecision(rate ? 0 : 2) << (rate ? c.second / t : c.second);
+					}
+					std::cout << std::endl;
+					json << (first ? "" : ",") << "\n    {\n      \"name\": \"" << escape(name) << "\",\n      \"run_name\": \"" << escape(name)
+						<< "\",\n      \"run_type\": \"iteration\",\n      \"iterations\": " << iterations
+						<< ",\n      \"real_time\": " << std::fixed << std::setprecision(3) << real << ",\n      \"cpu_time\": " << cpu
+						<< ",\n      \"time_unit\": \"ns\"";
+					for (auto& c : state.counters) {
+						bool rate = c.first == "flops" || c.first == "items";
+						json << ",\n      \"" << escape(c.first) << (rate ? "_per_second" : "") << "\": " << (rate ? c.second / t : c.second);
+					}
+					json << "\n    }";
+					first = false;
+					break;
+				}
+				// like Google Benchmark, aim a bit past the minimum time but grow by 10x at most
+				double multiplier = t > 0 ? minTime * 1.4 / t : 10;
+				iterations = (size_t) (iterations * (multiplier > 10 ? 10 : multiplier < 2 ? 2 : multiplier));
+			}
+		}
+	}
+
+	if (!out.empty()) {
+		std::ofstream file(out);
+		std::time_t now = std::time(0);
+		char date[32];
+		std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+		file << "{\n  \"context\": {\n    \"date\": \"" << date << "\",\n    \"executable\": \"" << escape(argv[0])
+			<< "\",\n    \"num_cpus\": " << std::thread::hardware_concurrency()
+#ifdef USE_BIG_NUMBER
+			<< ",\n    \"big_numbers\": \"BigNumber\""
+#else
+			<< ",\n    \"big_numbers\": \"GMP\""
+#endif
+#ifdef USE_THREADS
+			<< ",\n    \"threads\": " << ValueThreadPool::instance().size()
+#endif
+			<< ",\n    \"library_build_type\": \"release\"\n  },\n  \"benchmarks\": [" << json.str() << "\n  ]\n}\n";
+		if (!file) {
+			std::cerr << "could not write " << out << std::endl;
+			return 1;
+		}
+	}
+}
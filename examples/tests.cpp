@@ -0,0 +1,569 @@
+#include <algorithm>
+#include <iostream>
+#include <thread>
+#include <utility>
+#include <value.h>
+
+// every check that fails is printed, and the exit status is the number of failures
+
+static int failures = 0;
+
+#define CHECK(x) check(x, #x, __LINE__)
+
+static void check(bool ok, const char* what, int line) {
+	if (ok) return;
+	std::cout << "tests.cpp:" << line << ": " << what << std::endl;
+	failures++;
+}
+
+// a value assigned from a linked temporary is a copy, like after assigning the linked value itself
+static void testMoveAssignment() {
+	Value original = Types::Array;
+	original.append(1);
+	Value link;
+	link.be(&original);
+	Value target;
+	target = std::move(link);
+	target.append(2);
+	CHECK(original.length() == 1);
+	CHECK(target.length() == 2);
+	Value linked;
+	linked.be(&original);
+	linked.append(3);
+	CHECK(original.length() == 2);
+}
+
+// reading an element of a const array doesn't unpack it, writing through operator[] does
+static void testPackedReads() {
+	Value a = Types::Array;
+	a.append(1);
+	a.append(2.5);
+	const Value& c = a;
+	CHECK(c[1] == Value(2.5));
+	CHECK(c[Value(0)] == Value(1));
+	CHECK(a.getData().array->isPacked);
+	a[0] = "one";
+	CHECK(!a.getData().array->isPacked);
+	CHECK(a.toString() == "[one, 2.5]");
+}
+
+// the packed kernels (vectorized with USE_AVX2) against the same loops over Values, 11 elements so
+// that there is a remainder after the 4 wide steps
+static void testPackedKernels() {
+	Value a = Types::Array, b = Types::Array;
+	double sum = 0, dot = 0;
+	for (int i = 0; i < 11; i++) {
+		a.append(i * 1.5 - 4);
+		b.append(10 - i);
+		sum += i * 1.5 - 4;
+		dot += (i * 1.5 - 4) * (10 - i);
+	}
+	CHECK(a.sum() == Value(sum));
+	CHECK(a.dot(b) == Value(dot));
+	CHECK((a.min)() == Value(-4));
+	CHECK((a.max)() == Value(11));
+	Value c = a;
+	c += b;
+	c *= Value(2);
+	bool same = true;
+	for (int i = 0; i < 11; i++) {
+		if (c.getData().array->element(i) != Value(((i * 1.5 - 4) + (10 - i)) * 2)) same = false;
+	}
+	CHECK(same);
+	CHECK(c.getData().array->isPacked);
+}
+
+// an unpacked array of numbers (Types::Number and Types::SmallNumber) and text is sorted by the radix
+// sort, BigNumbers make it fall back to comparisons
+static void testNumericSort() {
+	Value a = Types::Array;
+	a.append(3.5);
+	a.append("x");
+	a.append(1);
+	a.append(-2.25);
+	a.append(10);
+	a.append("a");
+	a.append(0.5);
+	a.numericSort();
+	CHECK(a.toString() == "[-2.25, 0.5, 1, 3.5, 10, x, a]");
+	Value b = a, big = NUMBER("-123456789012345678901234567890");
+	b.append(big);
+	b.numericSort();
+	const Value& sorted = b;
+	CHECK(sorted[0] == big);
+	CHECK(sorted[1] == Value(-2.25));
+	CHECK(sorted[7] == Value("a"));
+}
+
+// elements of a persistent array are read and searched in the trie, without going back to a vector
+static void testPersistentReads() {
+	Value a = Types::Array;
+	for (int i = 0; i < 100; i++) a.append(Value("item") + Value(i));
+	a.persist();
+	Value copy = a;
+	copy.set(3, "three");
+	const Value& c = a;
+	CHECK(c[70] == Value("item70"));
+	CHECK(a.indexOf(Value("item42")) == 42);
+	CHECK(a.isPersistent());
+	CHECK(copy.isPersistent());
+	CHECK(c[3] == Value("item3"));
+	CHECK(copy[3] == Value("three"));
+}
+
+// interning a copy gives it a payload of its own instead of changing the elements of the shared one
+static void testInternCopy() {
+	const char* text = "a text long enough to have a payload of its own";
+	Value first = text;
+	first.intern();
+	Value a = Types::Array;
+	a.append(text);
+	Value b = a;
+	const Value &ca = a, &cb = b;
+	const void* before = ca[0].getData().text;
+	b.intern();
+	CHECK(ca[0].getData().text == before);
+	CHECK(cb[0].getData().text == first.getData().text);
+	CHECK(a == b);
+}
+
+// types added after __ADDITIONAL_TYPES__ keep their numbers, and text keys added to maps don't
+// become symbols (which are never freed)
+static void testSymbolKeys() {
+	CHECK((int) Types::__ADDITIONAL_TYPES__ == (int) Types::SmallNumber + 1);
+#ifndef USE_SYMBOL_KEYS
+	size_t before = ValueSymbolTable::instance().symbols.size();
+#endif
+	Value m = Types::Map;
+	for (int i = 0; i < 1000; i++) m.put(Value("unique key ") + Value(i), i);
+#ifndef USE_SYMBOL_KEYS
+	CHECK(ValueSymbolTable::instance().symbols.size() == before);
+#endif
+	CHECK(m.get(Value("unique key 999")) == Value(999));
+	CHECK(m.get(Value::symbol(Value("unique key 5"))) == Value(5));
+	CHECK(m.get(Value::symbol(Value("unique key 500"))) == Value(500));
+}
+
+static Value symbol(const char* text) {
+	return Value::symbol(Value(text));
+}
+
+// putting a value of a shaped map into the same map, and references to values kept while keys get
+// added (also past what a shape can take and with keys that aren't symbols)
+static void testShapedMapReferences() {
+	Value m = Types::Map;
+	m.put(symbol("a"), "a text long enough to have a payload of its own");
+	m.put(symbol("b"), m.get("a"));
+	CHECK(m.get("b") == m.get("a"));
+	Value r = Types::Map;
+	r.put(symbol("x"), 1);
+	Value& x = r.get("x");
+	for (int i = 0; i < 40; i++) r.put(Value::symbol(Value("k") + Value(i)), i);
+	r.put(7, "seven");
+	x = 5;
+	CHECK(r.getData().map->slots.size() == MAX_SHAPE_SIZE);
+	CHECK(r.get("x") == Value(5));
+	CHECK(r.length() == 42);
+	CHECK(r.get("k39") == Value(39));
+	CHECK(r.get(7) == Value("seven"));
+	Value copy = r;
+	copy.put("k0", "zero");
+	CHECK(copy != r);
+	r.put("k0", "zero");
+	CHECK(copy == r);
+	r.remove("k1");
+	CHECK(r.length() == 41);
+	CHECK(r.get("x") == Value(5));
+}
+
+// maps with text keys are plain hash maps, only symbol keys get a shape
+static void testShapesAreOptIn() {
+	Value d = Types::Map;
+	d.put("a", 1);
+	d.put("b", 2);
+#ifndef USE_SYMBOL_KEYS
+	CHECK(d.getData().map->slots.size() == 0);
+	CHECK(d.getData().map->hashEntries().size() == 2);
+#endif
+	Value r = Types::Map, s = Types::Map;
+	r.put(symbol("a"), 1);
+	r.put(symbol("b"), 2);
+	s.put(symbol("a"), 3);
+	s.put(symbol("b"), 4);
+	CHECK(r.getData().map->slots.size() == 2);
+	CHECK(r.getData().map->shape == s.getData().map->shape);
+	CHECK(r.get("b") == Value(2));
+	CHECK(s.get(symbol("a")) == Value(3));
+}
+
+// arrays and maps only get buffered as possible roots of cycles while detectCycles() is on
+static void testCycleDetection() {
+	{
+		Value a = Types::Array, b = Types::Array;
+		a.append(b, false);
+		b.append(a, false);
+		Value copy = a;
+		copy = Types::Null;
+		CHECK(ValueCycleCollector::instance().pending() == 0);
+		a.remove(0); // nothing would free the cycle otherwise
+	}
+	Value::detectCycles();
+	{
+		Value a = Types::Array, b = Types::Map;
+		a.append(b, false);
+		b.put("a", a);
+	}
+	CHECK(ValueCycleCollector::instance().pending() > 0);
+	CHECK(Value::collectCycles() == 2);
+	Value::detectCycles(false);
+}
+
+// a temporary slice holds no elements of its own, extend() copies them from the array it views
+static void testExtendWithSlice() {
+	Value a = Types::Array;
+	a.append("a");
+	a.append("b");
+	a.append("c");
+	a.append("d");
+	Value out = Types::Array;
+	out.extend(a.slice(0, 3));
+	CHECK(out.toString() == "[a, b, c]");
+	CHECK(a.length() == 4);
+}
+
+// elements sharing a payload are handed to the callbacks on the calling thread, in order for reduce
+static void testParallelShared() {
+	Value shared = "s";
+	Value a = Types::Array;
+	std::string expected;
+	for (int i = 0; i < 5000; i++) {
+		if (i % 3 == 0) {
+			a.append(shared);
+			expected += "s";
+		} else {
+			a.append(Value(std::to_string(i % 10)));
+			expected += std::to_string(i % 10);
+		}
+	}
+	Value copies = a.parallelMap([] (const Value& e) { return e; });
+	CHECK(copies.length() == a.length());
+	CHECK(copies == a);
+	Value joined = a.parallelReduce("", [] (const Value& acc, const Value& e) { return acc + e; });
+	CHECK(joined.toString() == expected);
+	Value kept = a.parallelFilter([] (const Value& e) { return e == Value("s"); });
+	CHECK(kept.length() == 1667);
+}
+
+// a text shared with a variable changes in place through it, the cached text has to see that
+static void testCachedAliasedText() {
+	Value t = "abc";
+	Value m = Types::Map;
+	m.put("t", t);
+	Value outer = Types::Array;
+	outer.append(m);
+	CHECK(outer.toCachedString() == outer.toString());
+	t += "def";
+	CHECK(outer.toString() == "[{t = abcdef}]");
+	CHECK(outer.toCachedString() == outer.toString());
+}
+
+// integer powers stay exact past 2^53, huge exponents saturate instead of overflowing the casts
+static void testPow() {
+	Value a = 3;
+	a.pow(34);
+	CHECK(a.toString() == "16677181699666569");
+	Value b = 2;
+	b.pow(53);
+	b += 1;
+	CHECK(b.toString() == "9007199254740993");
+	Value c = 2;
+	c.pow(-2);
+	CHECK(c == Value(0.25));
+	Value d = 16;
+	d.pow(0.5);
+	CHECK(d == Value(4));
+	Value e = 2;
+	e.pow(1e30);
+	CHECK(e.toDouble() == HUGE_VAL);
+	Value f = 0.5;
+	f.pow(1e30);
+	CHECK(f.toDouble() == 0);
+	Value g = 3;
+	g.pow(40);
+	CHECK(g.getType() == Types::BigNumber);
+	g.pow(1e30);
+	CHECK(g.toDouble() == HUGE_VAL);
+	Value h = 3;
+	h.pow(40);
+	h.pow(-1e30);
+	CHECK(h.toDouble() == 0);
+}
+
+static void testPowMod() {
+	Value a = 4;
+	a.powMod(13, 497);
+	CHECK(a == Value(445));
+	Value b = 2;
+	b.powMod(100, 1000000007);
+	CHECK(b == Value(976371285));
+	Value c = 3;
+	Value m = 10;
+	m.pow(20);
+	m += 39;
+	c.powMod(200, m);
+	CHECK(c.toString() == "82009743269444766517");
+}
+
+// a const value is read in place, writing through the elements or entries of a copy copies first
+static void testIteration() {
+	Value a = Types::Array;
+	for (int i = 1; i <= 4; i++) a.append(i);
+	Value b = a;
+	const Value& cb = b;
+	double sum = 0;
+	for (const Value& x : cb) sum += x.toDouble();
+	CHECK(sum == 10);
+	CHECK(std::count(cb.begin(), cb.end(), Value(3)) == 1);
+	CHECK(a.getData().array->isPacked);
+	for (Value& x : b) x = 9;
+	CHECK(a.toString() == "[1, 2, 3, 4]");
+	CHECK(b.toString() == "[9, 9, 9, 9]");
+	Value m = Types::Map;
+	m.put("x", 1);
+	m.put("y", 2);
+	Value n = m;
+	const Value& cn = n;
+	sum = 0;
+	for (auto e : cn.entries()) sum += e.value.toDouble();
+	CHECK(sum == 3);
+	for (auto e : n.entries()) e.value = 0;
+	CHECK(m.get("x") == Value(1));
+	CHECK(n.get("x") == Value(0));
+}
+
+// applying the diff from a to b to a copy of a gives b, and leaves a alone
+static void checkRoundTrip(const Value& a, const Value& b) {
+	Value before = a.deepCopy();
+	Value x = a;
+	x.apply(Value::diff(a, b));
+	CHECK(x == b);
+	CHECK(a == before);
+	Value y = b;
+	y.apply(Value::diff(b, a));
+	CHECK(y == a);
+}
+
+static void testDiffApply() {
+	Value a = Types::Map, b = Types::Map, inner = Types::Map, list = Types::Array;
+	list.append(1);
+	list.append(2);
+	inner.put("y", 1);
+	inner.put("z", list);
+	a.put("x", inner);
+	a.put("gone", "old");
+	b.put("x", Types::Map);
+	b.get("x").put("y", 2);
+	b.get("x").put("w", "t");
+	b.put("new", 3);
+	checkRoundTrip(a, b);
+	Value longer = Types::Array, shorter = Types::Array;
+	for (int i = 1; i <= 6; i++) longer.append(i);
+	shorter.append(1);
+	shorter.append(9);
+	shorter.append(6);
+	checkRoundTrip(longer, shorter);
+	Value texts = Types::Array, more = Types::Array;
+	texts.append("a");
+	texts.append(inner);
+	more.append("a");
+	more.append("b");
+	more.append(inner);
+	more.append(list);
+	checkRoundTrip(texts, more);
+	checkRoundTrip(Value("hello world"), Value("hello there world"));
+	checkRoundTrip(Value("abc"), Value("xbz"));
+	checkRoundTrip(Value(5), list);
+	Value scalar = Types::Map, array = Types::Map;
+	scalar.put("k", 5);
+	array.put("k", list);
+	checkRoundTrip(scalar, array);
+}
+
+// a published version is frozen: reading a missing key doesn't add it, a copy that gets modified
+// clones the payload, and the replaced version is freed once the reader went through a quiescent state
+static void testSnapshot() {
+	Value m = Types::Map, inner = Types::Map;
+	inner.put("c", 2);
+	m.put("a", 1);
+	m.put("b", inner);
+	ValueSnapshot<> s(m);
+	{
+		const Value& r = s.read();
+		CHECK(r.isFrozen());
+		r.get("missing");
+		CHECK(!r.containsKey("missing"));
+		CHECK(r.length() == 2);
+		Value c = r;
+		c.put("z", 3);
+		CHECK(!c.isFrozen());
+		CHECK(c.containsKey("z"));
+		CHECK(!r.containsKey("z"));
+		Value b = r.get("b");
+		b.put("d", 4);
+		CHECK(!r.get("b").containsKey("d"));
+		CHECK(r == m);
+	}
+	Value next = Types::Map;
+	next.put("a", 5);
+	s.publish(next);
+	CHECK(s.reclaim() == 1);
+	s.synchronize();
+	CHECK(s.reclaim() == 0);
+	CHECK(s.read() == next);
+	CHECK(!m.isFrozen());
+}
+
+static Value nested(size_t depth, const Value& innermost) {
+	Value v = innermost;
+	for (size_t i = 0; i < depth; i++) {
+		Value outer = Types::Array;
+		outer.append(v);
+		v = outer;
+	}
+	return v;
+}
+
+// values nested deeper than the stack could recurse are destroyed, compared and printed
+static void testDeepNesting() {
+	const size_t depth = 100000;
+	{
+		Value a = nested(depth, Types::Array);
+		Value b = nested(depth, Types::Array);
+		Value one = Types::Array;
+		one.append(1);
+		Value c = nested(depth, one);
+		CHECK(a == b);
+		CHECK(!(a == c));
+		CHECK(a.toString().size() == 2 * (depth + 1));
+	}
+	CHECK(nested(depth, 1).toString().size() == 2 * depth + 1);
+}
+
+// a child held twice counts twice, or once with sharedOnce
+static void testSharedMemoryUsage() {
+	Value child = Types::Array;
+	for (int i = 0; i < 100; i++) child.append(Value("element ") + Value(i));
+	Value copy = child.deepCopy();
+	Value twice = Types::Array, copied = Types::Array;
+	twice.append(child);
+	twice.append(child);
+	copied.append(child);
+	copied.append(copy);
+	size_t once = twice.memoryUsage(true);
+	CHECK(twice.memoryUsage() - once == child.memoryUsage());
+	CHECK(copied.memoryUsage(true) - once == copy.memoryUsage());
+	CHECK(copied.memoryUsage(true) == copied.memoryUsage());
+}
+
+// parallelEquals() and parallelHash() agree with == and HashFunction, with the work split among threads
+static void testParallelCompare() {
+#ifdef USE_THREADS
+	ValueThreadPool::setThreads(4);
+#endif
+	Value numbers = Types::Array, texts = Types::Array, reversed = Types::Array, m = Types::Map;
+	for (int i = 0; i < 5000; i++) {
+		numbers.append(i);
+		texts.append(Value("t") + Value(i % 100));
+		m.put(Value("k") + Value(i), i);
+	}
+	for (int i = 4999; i >= 0; i--) reversed.append(texts[i]);
+	Value values[] = { numbers, texts, reversed, m, Value("t1") };
+	for (const Value& a : values) {
+		Value same = a.deepCopy();
+		CHECK(a.parallelEquals(same));
+		CHECK(a.parallelHash() == HashFunction()(a));
+		CHECK(same.parallelHash() == a.parallelHash());
+		for (const Value& b : values) CHECK(a.parallelEquals(b) == (a == b));
+	}
+	Value changed = numbers.deepCopy();
+	changed.set(4321, -1);
+	CHECK(!numbers.parallelEquals(changed));
+	CHECK(!texts.parallelEquals(reversed));
+	CHECK(texts.parallelEquals(reversed, false));
+	CHECK(texts.parallelHash(false) == reversed.parallelHash(false));
+	Value mixed = Types::Array;
+	for (int i = 0; i < 5000; i++) mixed.append(i == 17 ? Value("t17") : Value(4999 - i));
+	CHECK(!numbers.parallelEquals(mixed, false));
+}
+
+// what goes in and out of a concurrent map is copied, and threads (with USE_THREADS) putting and
+// removing keys of their own (some in the same shards) leave the others alone
+static void testConcurrentMap() {
+	ValueConcurrentMap m(4);
+	Value v = Types::Array;
+	v.append(1);
+	m.put("a", v);
+	v.append(2);
+	CHECK(m.get("a").length() == 1);
+	Value got = m.get("a");
+	got.append(3);
+	CHECK(m.get("a").length() == 1);
+	m.put("a", 5);
+	CHECK(m.get("a") == Value(5));
+	CHECK(m.get("missing").getType() == Types::Null);
+	CHECK(m.containsKey("a"));
+	CHECK(!m.remove("missing"));
+	CHECK(m.remove("a"));
+	CHECK(!m.containsKey("a"));
+	CHECK(m.size() == 0);
+	const int threads = 4, keys = 2000;
+	auto work = [&m] (int t) {
+		for (int i = 0; i < keys; i++) m.put(Value(t * keys + i), Value(i));
+		for (int i = 0; i < keys; i += 2) m.remove(Value(t * keys + i));
+	};
+#ifdef USE_THREADS
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; t++) workers.emplace_back(work, t);
+	for (auto& w : workers) w.join();
+#else
+	for (int t = 0; t < threads; t++) work(t);
+#endif
+	CHECK(m.size() == threads * keys / 2);
+	Value snapshot = m.snapshot();
+	CHECK(snapshot.getType() == Types::Map);
+	CHECK(snapshot.length() == threads * keys / 2);
+	bool all = true;
+	for (int k = 0; k < threads * keys; k++) {
+		bool kept = k % 2 == 1;
+		all = all && m.containsKey(Value(k)) == kept && snapshot.containsKey(Value(k)) == kept;
+		if (kept) all = all && m.get(Value(k)) == Value(k % keys) && snapshot.get(Value(k)) == Value(k % keys);
+	}
+	CHECK(all);
+}
+
+int main() {
+	testMoveAssignment();
+	testPackedReads();
+	testPackedKernels();
+	testNumericSort();
+	testPersistentReads();
+	testInternCopy();
+	testSymbolKeys();
+	testShapedMapReferences();
+	testShapesAreOptIn();
+	testCycleDetection();
+	testExtendWithSlice();
+	testParallelShared();
+	testCachedAliasedText();
+	testPow();
+	testPowMod();
+	testIteration();
+	testDiffApply();
+	testSnapshot();
+	testDeepNesting();
+	testSharedMemoryUsage();
+	testParallelCompare();
+	testConcurrentMap();
+	if (failures == 0) std::cout << "all passed" << std::endl;
+	return failures;
+}
@@ -67,1746 +67,5145 @@ inline unsigned char countDigits(long x) {
         10)))))))));
 }
 
+// raises an integral base to a non-negative integral exponent by repeated squaring,
+// returns false as soon as the magnitude reaches limit (the caller has to use a wider type)
+inline bool powBySquaring(double base, unsigned long exp, double limit, double& result) {
+  result = 1;
+  while (exp) {
+    if (exp & 1) {
+      result *= base;
+      if (fabs(result) >= limit) return false;
+    }
+    exp >>= 1;
+    if (exp) {
+      if (fabs(base) >= limit) return false;
+      base *= base;
+    }
+  }
+  return true;
+}
+
+// (a * b) % m without overflowing, a and b should be smaller than m
+inline unsigned long long mulMod(unsigned long long a, unsigned long long b, unsigned long long m) {
+  if (m <= 0xFFFFFFFFULL) return (a * b) % m;
+  unsigned long long res = 0;
+  while (b) {
+    if (b & 1) res = (res >= m - a) ? res - (m - a) : res + a;
+    b >>= 1;
+    if (b) a = (a >= m - a) ? a - (m - a) : a + a;
+  }
+  return res;
+}
+
+inline unsigned long long powMod(unsigned long long base, unsigned long long exp, unsigned long long m) {
+  unsigned long long res = 1 % m;
+  base %= m;
+  while (exp) {
+    if (exp & 1) res = mulMod(res, base, m);
+    exp >>= 1;
+    if (exp) base = mulMod(base, base, m);
+  }
+  return res;
+}
+
+// Symbol is internal (getType() says Text) and kept at the end of the range, out of the way of the
+// types added after __ADDITIONAL_TYPES__
+enum class Types : char { Null = 0, True, False, Number, BigNumber, Text, Array, Map, SmallNumber, __ADDITIONAL_TYPES__, Symbol = 127 };
+
 #ifdef USE_ARDUINO_ARRAY
 #include <Array.h> // library by peterpolidoro (https://github.com/janelia-arduino/Array)
 #define ARRAY Array<Value*, MAX_FIXED_ARRAY_SIZE>
 #else
 #include <vector>
 #include <sstream>
-#define ARRAY std::vector<Value>
-#ifdef USE_BIG_NUMBER
-#ifndef USE_ARDUINO_STRING
-#include <sstream>
-#include <iomanip>
-#endif
-#endif
-#endif
+#include <string.h>
+#include <unordered_set>
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+// persistent vector (a radix balanced trie with a tail, like Clojure's), copies share every node and
+// the ones being modified get copied first unless they aren't shared, so a modification on a copy
+// costs O(log n) instead of a copy of the whole array
+template <class V>
+class PersistentVector {
+  enum { BITS = 5, WIDTH = 1 << BITS, MASK = WIDTH - 1 };
+  struct Node {
+    size_t refs = 1;
+  };
+  struct Leaf : Node {
+    V values[WIDTH];
+  };
+  struct Branch : Node {
+    Node* children[WIDTH] = { 0 };
+  };
+  Node* root = 0;
+  Leaf* tail = 0;
+  size_t count = 0;
+  int shift = BITS;
+
+  static void release(Node* n, int level) {
+    if (n == 0 || --n->refs != 0) return;
+    if (level == 0) {
+      delete (Leaf*) n;
+      return;
+    }
+    for (int i = 0; i < WIDTH; i++) {
+      release(((Branch*) n)->children[i], level - BITS);
+    }
+    delete (Branch*) n;
+  }
 
-//#ifdef USE_DOUBLE
-//#define IS_NUM(x) x.getType() == Types::Number || x.getType() == Types::SmallNumber
-//#else
-#define IS_NUM(x) x.getType() == Types::Number || x.getType() == Types::BigNumber || x.getType() == Types::SmallNumber
-//#endif
+  static Leaf* own(Leaf* n) {
+    if (n->refs == 1) return n;
+    Leaf* copy = new Leaf();
+    std::copy(n->values, n->values + WIDTH, copy->values);
+    n->refs--;
+    return copy;
+  }
 
-#define _ISNUMBER(x) (x == Types::Number || x == Types::SmallNumber TREAT_AS_NUMBER(x))
-#define _ISBIGNUMBER(x) (x == Types::BigNumber TREAT_AS_BIG_NUMBER(x))
-#define _ISTEXT(x) (x == Types::Text TREAT_AS_TEXT(x))
-#define _ISNULL(x) (x == Types::Null TREAT_AS_NULL(x))
-#define _ISTRUE(x) (x == Types::True TREAT_AS_TRUE(x))
-#define _ISFALSE(x) (x == Types::False TREAT_AS_FALSE(x))
-#define _ISARR(x) (x == Types::Array TREAT_AS_ARRAY(x))
-#define _ISMAP(x) (x == Types::Map TREAT_AS_MAP(x))
+  static Branch* own(Node* n) {
+    Branch* b = (Branch*) n;
+    if (b->refs == 1) return b;
+    Branch* copy = new Branch();
+    for (int i = 0; i < WIDTH; i++) {
+      copy->children[i] = b->children[i];
+      if (copy->children[i]) copy->children[i]->refs++;
+    }
+    b->refs--;
+    return copy;
+  }
 
-#ifndef TREAT_AS_NUMBER
-#define TREAT_AS_NUMBER(x) 
-#endif
+  inline size_t tailOffset() const {
+    return count < WIDTH ? 0 : ((count - 1) >> BITS) << BITS;
+  }
 
-#ifndef TREAT_AS_BIG_NUMBER
-#define TREAT_AS_BIG_NUMBER(x) 
-#endif
+  const Leaf* leafFor(size_t i) const {
+    if (i >= tailOffset()) return tail;
+    const Node* n = root;
+    for (int level = shift; level > 0; level -= BITS) {
+      n = ((const Branch*) n)->children[(i >> level) & MASK];
+    }
+    return (const Leaf*) n;
+  }
 
-#ifndef TREAT_AS_TEXT
-#define TREAT_AS_TEXT(x) 
-#endif
+  static Node* newPath(int level, Node* leaf) {
+    if (level == 0) return leaf;
+    Branch* b = new Branch();
+    b->children[0] = newPath(level - BITS, leaf);
+    return b;
+  }
 
-#ifndef TREAT_AS_NULL
-#define TREAT_AS_NULL(x) 
-#endif
+  Node* pushTail(int level, Node* parent, Leaf* leaf) {
+    Branch* b = own(parent);
+    size_t i = ((count - 1) >> level) & MASK;
+    if (level == BITS) {
+      b->children[i] = leaf;
+    } else if (b->children[i]) {
+      b->children[i] = pushTail(level - BITS, b->children[i], leaf);
+    } else {
+      b->children[i] = newPath(level - BITS, leaf);
+    }
+    return b;
+  }
 
-#ifndef TREAT_AS_TRUE
-#define TREAT_AS_TRUE(x) 
-#endif
+  // takes the last leaf out of the trie, returns 0 when nothing is left under node
+  Node* popTail(int level, Node* node) {
+    Branch* b = own(node);
+    size_t i = ((count - 2) >> level) & MASK;
+    if (level > BITS) {
+      b->children[i] = popTail(level - BITS, b->children[i]);
+    } else {
+      release(b->children[i], 0);
+      b->children[i] = 0;
+    }
+    if (i == 0 && b->children[0] == 0) {
+      delete b;
+      return 0;
+    }
+    return b;
+  }
 
-#ifndef TREAT_AS_FALSE
-#define TREAT_AS_FALSE(x) 
-#endif
+public:
+  PersistentVector() {}
 
-#ifndef TREAT_AS_ARRAY
-#define TREAT_AS_ARRAY(x) 
-#endif
+  PersistentVector(const PersistentVector& other) : root(other.root), tail(other.tail), count(other.count), shift(other.shift) {
+    if (root) root->refs++;
+    if (tail) tail->refs++;
+  }
 
-#ifndef TREAT_AS_MAP
-#define TREAT_AS_MAP(x) 
-#endif
+  PersistentVector& operator= (const PersistentVector& other) {
+    if (this == &other) return *this;
+    clear();
+    root = other.root;
+    tail = other.tail;
+    count = other.count;
+    shift = other.shift;
+    if (root) root->refs++;
+    if (tail) tail->refs++;
+    return *this;
+  }
 
-#define USE_COUNT_TYPE char
-#define modify_linked()     \
-    if (copyBeforeModification) { \
-      clone(); \
-      copyBeforeModification = false; \
+  ~PersistentVector() {
+    clear();
+  }
+
+  void clear() {
+    release(root, shift);
+    release(tail, 0);
+    root = 0;
+    tail = 0;
+    count = 0;
+    shift = BITS;
+  }
+
+  inline size_t size() const {
+    return count;
+  }
+
+  // true if both share all of their nodes (so they hold the same elements)
+  bool sameAs(const PersistentVector& other) const {
+    return root == other.root && tail == other.tail && count == other.count;
+  }
+
+  const V& operator[] (size_t i) const {
+    return leafFor(i)->values[i & MASK];
+  }
+
+  // reference to an element that can be modified, the nodes on its path get unshared first
+  V& ref(size_t i) {
+    if (i >= tailOffset()) {
+      tail = own(tail);
+      return tail->values[i & MASK];
+    }
+    Branch* b = own(root);
+    root = b;
+    for (int level = shift; level > BITS; level -= BITS) {
+      Node*& child = b->children[(i >> level) & MASK];
+      b = own(child);
+      child = b;
     }
+    Node*& leaf = b->children[(i >> BITS) & MASK];
+    Leaf* l = own((Leaf*) leaf);
+    leaf = l;
+    return l->values[i & MASK];
+  }
 
-#define _release_value(elseExp) \
-    if (useCount != 0) { \
-      if (*useCount == 0) { \
-        delete useCount; \
-        useCount = 0; \
-      } else { \
-        (*useCount) --; \
-        elseExp; \
-      } \
+  V& push_back(V&& v) {
+    if (tail == 0) tail = new Leaf();
+    size_t inTail = count - tailOffset();
+    if (inTail < WIDTH) {
+      tail = own(tail);
+      tail->values[inTail] = static_cast<V&&>(v);
+      count++;
+      return tail->values[inTail];
+    }
+    if (root == 0) root = new Branch();
+    if ((count >> BITS) > ((size_t) 1 << shift)) {
+      Branch* b = new Branch();
+      b->children[0] = root;
+      b->children[1] = newPath(shift, tail);
+      root = b;
+      shift += BITS;
+    } else {
+      root = pushTail(shift, root, tail);
     }
+    tail = new Leaf();
+    tail->values[0] = static_cast<V&&>(v);
+    count++;
+    return tail->values[0];
+  }
 
-class Value;
+  void pop_back() {
+    if (count <= 1) {
+      clear();
+      return;
+    }
+    size_t inTail = count - tailOffset();
+    if (inTail > 1) {
+      tail = own(tail);
+      tail->values[inTail - 1] = V();
+      count--;
+      return;
+    }
+    Leaf* last = (Leaf*) leafFor(count - 2);
+    last->refs++;
+    root = popTail(shift, root);
+    if (root && shift > BITS && ((Branch*) root)->children[1] == 0) {
+      Node* child = ((Branch*) root)->children[0];
+      child->refs++;
+      release(root, shift);
+      root = child;
+      shift -= BITS;
+    }
+    release(tail, 0);
+    tail = last;
+    count--;
+  }
 
-#ifdef USE_ARDUINO_STRING
-int compareValue(const void *cmp1, const void *cmp2);
-int compareValueNumeric(const void *cmp1, const void *cmp2);
-#endif
+  template <class F>
+  void forEach(const F& fn) const {
+    for (size_t i = 0; i < count; i += WIDTH) {
+      const Leaf* l = leafFor(i);
+      size_t n = count - i < (size_t) WIDTH ? count - i : (size_t) WIDTH;
+      for (size_t j = 0; j < n; j++) {
+        fn(l->values[j]);
+      }
+    }
+  }
+};
 
-#ifdef USE_NOSTD_MAP
-class Pair {
+// the text Value::toCachedString() keeps for an array or map payload: what it writes itself, leaving
+// out the arrays and maps in it that go at the offsets in splits. A copy of the payload starts without
+// one, and assigning to the payload makes it invalid
+class ValueTextCache {
 public:
-  Value* key;
-  Value* value;
-  Pair() {}
-  Pair& operator= (const Pair&);
+  struct Text {
+    TEXT text;
+    std::vector<size_t> splits;
+    size_t elements = 0; // entries for maps
+    bool valid = false;
+  };
+  Text* text = 0;
+
+  ValueTextCache() {}
+  ValueTextCache(const ValueTextCache&) {}
+  ValueTextCache& operator= (const ValueTextCache&) {
+    invalidate();
+    return *this;
+  }
+  ~ValueTextCache() {
+    delete text;
+  }
+
+  inline void invalidate() {
+    if (text) text->valid = false;
+  }
+
+  Text& get() {
+    if (!text) text = new Text();
+    return *text;
+  }
 };
-#else
-#include <unordered_map>
-#include <sstream>
-class HashFunction {
+
+// array payload, arrays holding nothing but Types::Number keep their elements packed as plain
+// doubles (8 bytes each instead of a whole Value) until something else gets into them, persist()
+// moves the elements into a PersistentVector until something it doesn't support is done on them.
+// A view (made by Value::slice()) holds no elements, it reads every viewStep-th one of the array in
+// viewOf from viewStart on and gets its own copies of them (materialize()) before being modified
+template <class V>
+class ValueArray {
+  typedef std::vector<V> Values;
+  Values values; // the elements when the array isn't packed, persistent or a view
 public:
-  size_t operator() (const Value& v) const;
-};
+  std::vector<double> packed;
+  bool isPacked = true;
+  PersistentVector<V> persistent;
+  bool isPersistent = false;
+  bool buffered = false; // kept by ValueCycleCollector as a possible root of a cycle
+  V viewOf;
+  size_t viewStart = 0, viewStep = 1, viewCount = 0;
+  bool isView = false;
+  ValueTextCache textCache;
+
+  inline size_t size() const {
+    if (isView) return viewSize();
+    return isPersistent ? persistent.size() : isPacked ? packed.size() : values.size();
+  }
 
-namespace std {
-  template <>
-  struct hash<Value> {
-    std::size_t operator()(const Value& k) const; // just defined to avoid error (there has been some errors with the compiler used for arduino due)
-  };
-}
-#endif
+  // the array in viewOf could have got shorter since the view was made
+  size_t viewSize() const {
+    size_t n = viewOf.getData().array->size();
+    if (n <= viewStart) return 0;
+    size_t available = (n - viewStart + viewStep - 1) / viewStep;
+    return available < viewCount ? available : viewCount;
+  }
 
-enum class Types : char { Null = 0, True, False, Number, BigNumber, Text, Array, Map, SmallNumber, __ADDITIONAL_TYPES__ };
+  // from a view to a vector of its own elements
+  void materialize() {
+    if (!isView) return;
+    const ValueArray& source = *viewOf.getData().array;
+    size_t n = viewSize();
+    values.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+      values.push_back(source.element(viewStart + i * viewStep));
+    }
+    isView = false;
+    viewOf = V();
+  }
 
-#ifndef MAX_FIXED_MAP_SIZE
-#define MAX_FIXED_MAP_SIZE MAX_FIXED_ARRAY_SIZE
-#endif
+  inline bool empty() const {
+    return size() == 0;
+  }
 
-class Value {
-private:
-  Value(Value* v) {
-    this->data = v->data;
-    this->type = v->type;
-    useCount = v->useCount;
-    if (useCount) (*useCount) ++;
+  void reserve(size_t n) {
+    if (isPersistent) return;
+    if (isPacked) packed.reserve(n);
+    else values.reserve(n);
   }
-  typedef union {
-#ifndef USE_DOUBLE
-    NUMBER* number;
-    double smallNumber;
-#else
-    double number;
-#endif
-    TEXT* text;
-    ARRAY* array;
-#ifdef USE_NOSTD_MAP
-    Array<Pair, MAX_FIXED_MAP_SIZE>* map;
-#else
-    std::unordered_map<Value, Value, HashFunction>* map;
-#endif
-} Data;
-  Data data;
-  Types type = Types::Null;
-public:
-  USE_COUNT_TYPE* useCount = 0;
-  bool copyBeforeModification = false;
-  void clone() {
-    if (_ISTEXT(type)) {
-      TEXT* t = new TEXT(*data.text);
-      data.text = t;
-      (*useCount) --;
-      useCount = new USE_COUNT_TYPE; *useCount = 0;
-    } 
-#ifndef USE_DOUBLE
-    else if (_ISBIGNUMBER(type)) {
-      NUMBER* t = new NUMBER(*data.number);
-      data.number = t;
-      (*useCount) --;
-      useCount = new USE_COUNT_TYPE; *useCount = 0;
+
+  void shrinkToFit() {
+    packed.shrink_to_fit();
+    values.shrink_to_fit();
+  }
+
+  void clear() {
+    values.clear();
+    packed.clear();
+    persistent.clear();
+    isPacked = true;
+    isPersistent = false;
+    isView = false;
+    viewOf = V();
+  }
+
+  void persist() {
+    materialize();
+    if (isPersistent) return;
+    if (isPacked) {
+      for (size_t i = 0; i < packed.size(); i++) persistent.push_back(V(packed[i]));
+      std::vector<double>().swap(packed);
+    } else {
+      for (size_t i = 0; i < values.size(); i++) persistent.push_back(static_cast<V&&>(values[i]));
+      Values().swap(values);
     }
-#endif
-    else if (_ISARR(type)) {
-      ARRAY* t = new ARRAY(*data.array);
-      data.array = t;
-      (*useCount) --;
-      useCount = new USE_COUNT_TYPE; *useCount = 0;
-#if !defined(USE_ARDUINO_ARRAY) && defined(VECTOR_RESERVED_SIZE)
-      data.array->reserve(VECTOR_RESERVED_SIZE);
-#endif
-    } else if (_ISMAP(type)) {
-#ifndef USE_NOSTD_MAP
-      std::unordered_map<Value, Value, HashFunction>* t = new std::unordered_map<Value, Value, HashFunction>();
-      *t = *data.map;
-      data.map = t;
-#else
-      Array<Pair, MAX_FIXED_MAP_SIZE>* t = new Array<Pair, MAX_FIXED_MAP_SIZE>(*data.map);
-      data.map = t; 
-#endif
-      (*useCount) --;
-      useCount = new USE_COUNT_TYPE; *useCount = 0;
+    isPacked = false;
+    isPersistent = true;
+  }
+
+  // back from the persistent representation to a vector (packed if it can be), views get their own
+  // elements
+  void flatten() {
+    materialize();
+    if (!isPersistent) return;
+    values.reserve(persistent.size());
+    persistent.forEach([this] (const V& v) {
+      values.push_back(v);
+    });
+    persistent.clear();
+    isPersistent = false;
+    pack();
+  }
+
+  // elements of arrays that aren't packed
+  inline const V& item(size_t i) const {
+    if (isView) return viewItem(i);
+    return isPersistent ? persistent[i] : values[i];
+  }
+
+  const V& viewItem(size_t i) const {
+    const ValueArray& source = *viewOf.getData().array;
+    if (!source.isPacked) return source.item(viewStart + i * viewStep);
+    // the array got packed after the view was made, there are no elements to point to anymore
+    const_cast<ValueArray*>(this)->materialize();
+    return values[i];
+  }
+
+  // switch to a vector of Values, has to be done before handing out references to the elements
+  void unpack() {
+    flatten();
+    if (!isPacked) return;
+    values.reserve(values.capacity() > packed.size() ? values.capacity() : packed.size());
+    for (size_t i = 0; i < packed.size(); i++) {
+      values.emplace_back(packed[i]);
     }
+    std::vector<double>().swap(packed);
+    isPacked = false;
   }
 
-  // free unused pointers
-  void freeUnusedMemory() {
-    _release_value(return)
-    if (_ISTEXT(type) && data.text != 0) {
-      delete data.text;
-      data.text = 0;
-    } 
-#ifndef USE_DOUBLE
-    else if (_ISBIGNUMBER(type) && data.number != 0) {
-      delete data.number;
-      data.number = 0;
+  // switch back to packed storage if every element is a Types::Number
+  bool pack() {
+    flatten();
+    if (isPacked) return true;
+    for (size_t i = 0; i < values.size(); i++) {
+      if (values[i].getType() != Types::Number) return false;
     }
-#endif
-    else if (_ISARR(type) && data.array != 0) {
-#ifdef USE_ARDUINO_ARRAY
-      for (short i = 0; i < data.array->size(); i++) {
-        free((*data.array)[i]);
+    packed.reserve(values.size());
+    for (size_t i = 0; i < values.size(); i++) {
+      packed.push_back(values[i].toDouble());
+    }
+    values.clear();
+    isPacked = true;
+    return true;
+  }
+
+  // points out to the elements as doubles (copied into buffer if the array isn't packed),
+  // returns false if there is anything other than Types::Number in the array
+  bool numbers(const double*& out, std::vector<double>& buffer) const {
+    if (isPacked) {
+      out = packed.data();
+      return true;
+    }
+    for (size_t i = 0; i < size(); i++) {
+      if (item(i).getType() != Types::Number) return false;
+    }
+    buffer.resize(size());
+    for (size_t i = 0; i < size(); i++) {
+      buffer[i] = item(i).toDouble();
+    }
+    out = buffer.data();
+    return true;
+  }
+
+  V element(size_t i) const {
+    return isPacked ? V(packed[i]) : item(i);
+  }
+
+  // the vector of Values, only there after unpack()
+  typedef typename Values::iterator iterator;
+  typedef typename Values::const_iterator const_iterator;
+  inline V& operator[] (size_t i) { return values[i]; }
+  inline const V& operator[] (size_t i) const { return values[i]; }
+  inline iterator begin() { return values.begin(); }
+  inline iterator end() { return values.end(); }
+  inline const_iterator begin() const { return values.begin(); }
+  inline const_iterator end() const { return values.end(); }
+  inline V& back() { return values.back(); }
+  inline V* data() { return values.data(); }
+  inline size_t capacity() const { return values.capacity(); }
+  inline void resize(size_t n) { values.resize(n); }
+  inline void push_back(const V& v) { values.push_back(v); }
+  inline void push_back(V&& v) { values.push_back(static_cast<V&&>(v)); }
+  template <class... A>
+  inline void emplace_back(A&&... args) { values.emplace_back(std::forward<A>(args)...); }
+  inline void pop_back() { values.pop_back(); }
+  inline iterator insert(const_iterator at, const V& v) { return values.insert(at, v); }
+  inline iterator insert(const_iterator at, size_t n, const V& v) { return values.insert(at, n, v); }
+  inline iterator erase(const_iterator at) { return values.erase(at); }
+  inline iterator erase(const_iterator from, const_iterator to) { return values.erase(from, to); }
+
+  // reorders the elements so that the i-th one becomes the order[i]-th one
+  void permute(const std::vector<size_t>& order) {
+    flatten();
+    if (isPacked) {
+      std::vector<double> res(order.size());
+      for (size_t i = 0; i < order.size(); i++) {
+        res[i] = packed[order[i]];
       }
-#endif
-      delete data.array;
-      data.array = 0;
-    } else if (_ISMAP(type) && data.map != 0) {
-#ifdef USE_NOSTD_MAP
-      for (short i = 0; i < data.map->size(); i++) {
-        free((*data.map)[i].key);
-        free((*data.map)[i].value);
+      packed.swap(res);
+    } else {
+      Values res;
+      res.reserve(values.capacity());
+      for (size_t i = 0; i < order.size(); i++) {
+        res.emplace_back(static_cast<V&&>(values[order[i]]));
       }
-#endif
-      delete data.map;
-      data.map = 0;
+      values.swap(res);
     }
   }
-  Value () { type = Types::Null; }
-  Value (bool b) {
-    if (b) type = Types::True;
-    else type = Types::False;
-  }
-  Value (Types t) {
-    if (t == Types::Array) {
-      useCount = new USE_COUNT_TYPE; *useCount = 0;
-      data.array = new ARRAY();
-#if !defined(USE_ARDUINO_ARRAY) && defined(VECTOR_RESERVED_SIZE)
-      data.array->reserve(VECTOR_RESERVED_SIZE);
+};
+#define ARRAY ValueArray<Value>
+
+// kernels for packed arrays, 256 bit vectors when the compiler targets AVX2 (-mavx2, or USE_AVX2 in
+// the examples' CMakeLists.txt) and plain loops (which the compiler can still auto-vectorize) otherwise
+#if defined(__AVX2__)
+#include <immintrin.h>
 #endif
-    } else if (t == Types::Map) {
-      useCount = new USE_COUNT_TYPE; *useCount = 0;
-#ifdef USE_NOSTD_MAP
-      data.map = new Array<Pair, MAX_FIXED_MAP_SIZE>();
-#else
-      data.map = new std::unordered_map<Value, Value, HashFunction>();
+
+struct PackedAdd {
+  static double limit() { return 10000000; }
+  static bool wholeThousandths() { return false; }
+  double operator()(double a, double b) const { return a + b; }
+#if defined(__AVX2__)
+  __m256d operator()(__m256d a, __m256d b) const { return _mm256_add_pd(a, b); }
+#endif
+};
+
+struct PackedSub {
+  static double limit() { return 10000000; }
+  static bool wholeThousandths() { return false; }
+  double operator()(double a, double b) const { return a - b; }
+#if defined(__AVX2__)
+  __m256d operator()(__m256d a, __m256d b) const { return _mm256_sub_pd(a, b); }
+#endif
+};
+
+struct PackedMul {
+  static double limit() { return 10000; }
+  static bool wholeThousandths() { return true; }
+  double operator()(double a, double b) const { return a * b; }
+#if defined(__AVX2__)
+  __m256d operator()(__m256d a, __m256d b) const { return _mm256_mul_pd(a, b); }
+#endif
+};
+
+struct PackedDiv {
+  static double limit() { return 1000000; }
+  static bool wholeThousandths() { return true; }
+  double operator()(double a, double b) const { return a / b; }
+#if defined(__AVX2__)
+  __m256d operator()(__m256d a, __m256d b) const { return _mm256_div_pd(a, b); }
 #endif
+};
+
+// true if all the numbers are below limit (and have at most 3 decimal places if wholeThousandths is set),
+// the range where +=, -=, *= and /= keep a Types::Number as a double instead of making it a BigNumber
+inline bool packedInRange(const double* a, size_t n, double limit, bool wholeThousandths) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256d sign = _mm256_set1_pd(-0.0), l = _mm256_set1_pd(limit), thousand = _mm256_set1_pd(1000);
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_loadu_pd(a + i);
+    __m256d ok = _mm256_cmp_pd(_mm256_andnot_pd(sign, x), l, _CMP_LT_OQ);
+    if (wholeThousandths) {
+      __m256d t = _mm256_mul_pd(x, thousand);
+      ok = _mm256_and_pd(ok, _mm256_cmp_pd(t, _mm256_round_pd(t, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC), _CMP_EQ_OQ));
     }
-    type = t;
-  }
-#ifndef USE_DOUBLE
-  Value (const NUMBER& n) {
-    this->data.number = new NUMBER(n);
-    type = Types::BigNumber;
-    useCount = new USE_COUNT_TYPE; *useCount = 0;
+    if (_mm256_movemask_pd(ok) != 0xF) return false;
   }
 #endif
-  Value (int n) {
-#ifndef USE_DOUBLE
-    this->data.smallNumber = n;
-#else
-    this->data.number = n;
+  for (; i < n; i++) {
+    if (!(fabs(a[i]) < limit)) return false;
+    if (wholeThousandths && a[i] * 1000 != ::floor(a[i] * 1000)) return false;
+  }
+  return true;
+}
+
+template <class Op>
+inline void packedApply(double* a, const double* b, size_t n, Op op) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  for (; i + 4 <= n; i += 4) {
+    _mm256_storeu_pd(a + i, op(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+  }
 #endif
-    type = Types::Number;
+  for (; i < n; i++) {
+    a[i] = op(a[i], b[i]);
+  }
+}
+
+template <class Op>
+inline void packedApply(double* a, double b, size_t n, Op op) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256d s = _mm256_set1_pd(b);
+  for (; i + 4 <= n; i += 4) {
+    _mm256_storeu_pd(a + i, op(_mm256_loadu_pd(a + i), s));
   }
-  Value (double n) {
-#ifndef USE_DOUBLE
-    this->data.smallNumber = n;
-#else
-    this->data.number = n;
 #endif
-    type = Types::Number;
+  for (; i < n; i++) {
+    a[i] = op(a[i], b);
   }
-  Value (long n) {
-#ifndef USE_DOUBLE
-    this->data.smallNumber = n;
+}
+
+inline double packedSum(const double* a, size_t n) {
+  size_t i = 0;
+  double s[4] = { 0, 0, 0, 0 };
+#if defined(__AVX2__)
+  __m256d acc = _mm256_setzero_pd();
+  for (; i + 4 <= n; i += 4) {
+    acc = _mm256_add_pd(acc, _mm256_loadu_pd(a + i));
+  }
+  _mm256_storeu_pd(s, acc);
 #else
-    this->data.number = n;
-#endif
-    type = Types::Number;
+  for (; i + 4 <= n; i += 4) {
+    s[0] += a[i]; s[1] += a[i + 1]; s[2] += a[i + 2]; s[3] += a[i + 3];
   }
-  Value (const TEXT& s) {
-    data.text = new TEXT(s);
-    type = Types::Text;
-    useCount = new USE_COUNT_TYPE; *useCount = 0;
+#endif
+  double res = (s[0] + s[1]) + (s[2] + s[3]);
+  for (; i < n; i++) res += a[i];
+  return res;
+}
+
+inline double packedDot(const double* a, const double* b, size_t n) {
+  size_t i = 0;
+  double s[4] = { 0, 0, 0, 0 };
+#if defined(__AVX2__)
+  __m256d acc = _mm256_setzero_pd();
+  for (; i + 4 <= n; i += 4) {
+    acc = _mm256_add_pd(acc, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
   }
-  Value (const char* s) {
-    data.text = new TEXT(s);
-    type = Types::Text;
-    useCount = new USE_COUNT_TYPE; *useCount = 0;
+  _mm256_storeu_pd(s, acc);
+#else
+  for (; i + 4 <= n; i += 4) {
+    s[0] += a[i] * b[i]; s[1] += a[i + 1] * b[i + 1]; s[2] += a[i + 2] * b[i + 2]; s[3] += a[i + 3] * b[i + 3];
   }
-  Value (Value&& v) : data(v.data), type(v.type), useCount(v.useCount) {
-    if (useCount) (*useCount) ++;
+#endif
+  double res = (s[0] + s[1]) + (s[2] + s[3]);
+  for (; i < n; i++) res += a[i] * b[i];
+  return res;
+}
+
+// smallest (or largest) number skipping NaNs, NaN if there is nothing else
+inline double packedExtreme(const double* a, size_t n, bool smallest) {
+  double res = smallest ? INFINITY : -INFINITY;
+  size_t i = 0;
+#if defined(__AVX2__)
+  __m256d acc = _mm256_set1_pd(res);
+  for (; i + 4 <= n; i += 4) {
+    // min/max return the second operand when the first one is NaN
+    acc = smallest ? _mm256_min_pd(_mm256_loadu_pd(a + i), acc) : _mm256_max_pd(_mm256_loadu_pd(a + i), acc);
   }
-  Value (const Value& v) {
-    data = v.data;
-    type = v.type;
-    copyBeforeModification = true;
-    useCount = v.useCount;
-    if (useCount) (*useCount) ++;
+  double s[4];
+  _mm256_storeu_pd(s, acc);
+  for (int j = 0; j < 4; j++) {
+    if (smallest ? s[j] < res : s[j] > res) res = s[j];
   }
-  Value (Data data, Types type, USE_COUNT_TYPE* useCount): data(data), type(type), useCount(useCount) {
-    if (useCount) (*useCount) ++;
+#endif
+  for (; i < n; i++) {
+    if (smallest ? a[i] < res : a[i] > res) res = a[i];
   }
-  // free unused pointers when the object is destructing
-  ~Value () {
-    freeUnusedMemory();
+  if (isinf(res) && std::find(a, a + n, res) == a + n) return NAN;
+  return res;
+}
+
+#ifndef PARALLEL_SORT_THRESHOLD
+#define PARALLEL_SORT_THRESHOLD 16384
+#endif
+
+#ifdef USE_THREADS
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+// work-stealing pool, every worker pops its own tasks LIFO and steals FIFO from the others when it runs
+// out, the thread waiting for a parallelFor() runs tasks too so nested parallel loops can't deadlock
+class ValueThreadPool {
+  struct Queue {
+    std::mutex lock;
+    std::deque<std::function<void()>> tasks;
+  };
+  std::vector<std::thread> workers;
+  std::unique_ptr<Queue[]> queues;
+  size_t queueCount;
+  std::mutex sleepLock;
+  std::condition_variable wake;
+  std::atomic<size_t> pending;
+  std::atomic<size_t> next;
+  std::atomic<bool> stopping;
+
+  bool take(size_t self, bool own, std::function<void()>& task) {
+    if (own) {
+      std::lock_guard<std::mutex> l(queues[self].lock);
+      if (!queues[self].tasks.empty()) {
+        task = std::move(queues[self].tasks.back());
+        queues[self].tasks.pop_back();
+        return true;
+      }
+    }
+    for (size_t i = own ? 1 : 0; i < queueCount; i++) {
+      Queue& q = queues[(self + i) % queueCount];
+      std::lock_guard<std::mutex> l(q.lock);
+      if (!q.tasks.empty()) {
+        task = std::move(q.tasks.front());
+        q.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
   }
 
-  void operator= (const Value& v) {
-    freeUnusedMemory();
-    data = v.data;
-    type = v.type;
-    copyBeforeModification = true;
-    useCount = v.useCount;
-    if (useCount) (*useCount) ++;
+  void work(size_t self) {
+    std::function<void()> task;
+    while (!stopping) {
+      if (take(self, true, task)) {
+        pending--;
+        task();
+        continue;
+      }
+      std::unique_lock<std::mutex> l(sleepLock);
+      wake.wait(l, [this] { return stopping || pending > 0; });
+    }
   }
 
-  void be(Value* v) {
-    freeUnusedMemory();
-    data = v->data;
-    type = v->type;
-    useCount = v->useCount;
-    if (useCount) (*useCount) ++;
-    copyBeforeModification = false;
+  static std::unique_ptr<ValueThreadPool>& holder() {
+    static std::unique_ptr<ValueThreadPool> pool;
+    return pool;
   }
 
-  void operator= (bool v) {
-    freeUnusedMemory();
-    if (v) type = Types::True;
-    else type = Types::False;
-    copyBeforeModification = false;
+public:
+  // the thread calling parallelFor() takes part as well, so threads - 1 workers are started
+  explicit ValueThreadPool(size_t threads) : queueCount(threads > 1 ? threads - 1 : 1), pending(0), next(0), stopping(false) {
+    queues.reset(new Queue[queueCount]);
+    for (size_t i = 0; i + 1 < threads; i++) {
+      workers.emplace_back(&ValueThreadPool::work, this, i);
+    }
   }
 
-  void operator= (Types t) {
-    freeUnusedMemory();
-    copyBeforeModification = false;
-    if (t == Types::Array) {
-      useCount = new USE_COUNT_TYPE; *useCount = 0;
-      data.array = new ARRAY();
-#if !defined(USE_ARDUINO_ARRAY) && defined(VECTOR_RESERVED_SIZE)
-      data.array->reserve(VECTOR_RESERVED_SIZE);
-#endif
-    } else if (t == Types::Map) {
-      useCount = new USE_COUNT_TYPE; *useCount = 0;
-#ifdef USE_NOSTD_MAP
-      data.map = new Array<Pair, MAX_FIXED_MAP_SIZE>();
-#else
-      data.map = new std::unordered_map<Value, Value, HashFunction>();
-#endif
+  ~ValueThreadPool() {
+    {
+      std::lock_guard<std::mutex> l(sleepLock);
+      stopping = true;
     }
-    type = t;
+    wake.notify_all();
+    for (size_t i = 0; i < workers.size(); i++) workers[i].join();
   }
 
-  void operator= (int n) {
-    freeUnusedMemory();
-    copyBeforeModification = false;
-#ifndef USE_DOUBLE
-    this->data.smallNumber = n;
-#else
-    this->data.number = n;
-#endif
-    type = Types::Number;
+  // the first call makes the pool (unless setThreads() already did), threads can race for it
+  static ValueThreadPool& instance() {
+    static std::once_flag made;
+    std::call_once(made, [] {
+      std::unique_ptr<ValueThreadPool>& pool = holder();
+      if (pool) return;
+      size_t n = std::thread::hardware_concurrency();
+      pool.reset(new ValueThreadPool(n ? n : 1));
+    });
+    return *holder();
   }
 
-  void operator= (long n) {
-    freeUnusedMemory();
-    copyBeforeModification = false;
-#ifndef USE_DOUBLE
-    this->data.smallNumber = n;
-#else
-    this->data.number = n;
-#endif
-    type = Types::Number;
+  // replaces the shared pool, should not be called while it is in use
+  static void setThreads(size_t threads) {
+    holder().reset(new ValueThreadPool(threads ? threads : 1));
   }
 
-  void operator= (double n) {
-    freeUnusedMemory();
-    copyBeforeModification = false;
-#ifndef USE_DOUBLE
-    this->data.smallNumber = n;
-#else
-    this->data.number = n;
-#endif
-    type = Types::Number;
+  size_t size() const {
+    return workers.size() + 1;
   }
 
-  void operator= (const TEXT& t) {
-    if (type == Types::Text && !copyBeforeModification) {
-      *data.text = t;
-      return;
+  void submit(std::function<void()> task) {
+    pending++;
+    Queue& q = queues[next++ % queueCount];
+    {
+      std::lock_guard<std::mutex> l(q.lock);
+      q.tasks.push_back(std::move(task));
     }
-    freeUnusedMemory();
-    copyBeforeModification = false;
-    this->data.text = new TEXT(t);
-    type = Types::Text;
-    useCount = new USE_COUNT_TYPE; *useCount = 0;
+    {
+      std::lock_guard<std::mutex> l(sleepLock);
+    }
+    wake.notify_one();
   }
 
-  void operator= (const char* t) {
-    if (type == Types::Text && !copyBeforeModification) {
-      *data.text = t;
-      return;
-    }
-    freeUnusedMemory();
-    copyBeforeModification = false;
-    this->data.text = new TEXT(t);
-    type = Types::Text;
-    useCount = new USE_COUNT_TYPE; *useCount = 0;
+  // runs one queued task on the calling thread, false if there was none
+  bool runPending() {
+    std::function<void()> task;
+    if (!take(next % queueCount, false, task)) return false;
+    pending--;
+    task();
+    return true;
   }
 
-#ifndef USE_DOUBLE
-  void operator= (const NUMBER& n) {
-    if (type == Types::BigNumber && !copyBeforeModification) {
-      *data.number = n;
+  // calls fn(begin, end) on chunks (of at least grain indices) covering [0, n) and waits for all of them
+  template <class F>
+  void parallelFor(size_t n, size_t grain, const F& fn) {
+    if (grain == 0) grain = 1;
+    size_t chunks = (n + grain - 1) / grain, limit = size() * 4;
+    if (chunks > limit) chunks = limit;
+    if (chunks <= 1 || workers.empty()) {
+      if (n) fn(0, n);
       return;
     }
-    freeUnusedMemory();
-    copyBeforeModification = false;
-    this->data.number = new NUMBER(n);
-    type = Types::BigNumber;
-    useCount = new USE_COUNT_TYPE; *useCount = 0;
+    std::atomic<size_t> remaining(chunks - 1);
+    for (size_t c = 1; c < chunks; c++) {
+      size_t begin = n * c / chunks, end = n * (c + 1) / chunks;
+      submit([&fn, &remaining, begin, end] {
+        fn(begin, end);
+        remaining--;
+      });
+    }
+    fn(0, n / chunks);
+    while (remaining > 0) {
+      if (!runPending()) std::this_thread::yield();
+    }
   }
-#endif
-
-  void append(const Value& v, bool _clone = true) {
-    modify_linked()
-#ifdef USE_ARDUINO_ARRAY
-    Value* value = new Value(v.data, v.type, v.useCount);
-    data.array->push_back(value);
-    (*data.array)[data.array->size() - 1]->copyBeforeModification = _clone;
+};
 #else
-    data.array->emplace_back(v.data, v.type, v.useCount);
-    (*data.array)[data.array->size() - 1].copyBeforeModification = _clone;
-#endif
+// stands in for the pool when USE_THREADS isn't defined, everything runs on the calling thread
+class ValueThreadPool {
+public:
+  static ValueThreadPool& instance() {
+    static ValueThreadPool pool;
+    return pool;
   }
 
-  void remove(size_t i, size_t n) {
-    modify_linked()
-#ifdef USE_ARDUINO_ARRAY
-    for (; n > i; n--) {
-      delete (*data.array)[i];
-      data.array->remove(i);
-    }
-#else
-    data.array->erase(data.array->begin() + i, data.array->begin() + n);
-#endif
+  size_t size() const {
+    return 1;
   }
 
-  void remove(size_t i) {
-    modify_linked()
-#ifdef USE_ARDUINO_ARRAY
-    delete (*data.array)[i];
-    data.array->remove(i);
-#else
-    data.array->erase(data.array->begin() + i);
+  template <class F>
+  void parallelFor(size_t n, size_t /* grain */, const F& fn) {
+    if (n) fn(0, n);
+  }
+};
 #endif
+
+// index (in a) of the split point of the first k elements of the stable merge of a and b
+template <class T, class Less>
+inline size_t mergeSplit(const T* a, size_t na, const T* b, size_t nb, size_t k, Less& less) {
+  size_t lo = k > nb ? k - nb : 0, hi = k < na ? k : na;
+  while (lo < hi) {
+    size_t i = (lo + hi) / 2, j = k - i;
+    if (j > 0 && !less(b[j - 1], a[i])) lo = i + 1;
+    else hi = i;
   }
+  return lo;
+}
 
-  void remove(const Value& i) {
-    modify_linked()
-    if (_ISARR(type)) {
-#ifdef USE_ARDUINO_ARRAY
-      data.array->remove((long) i);
-#else
-      data.array->erase(data.array->begin() + (long) i);
-#endif
-    } else if (_ISMAP(type)) {
-#ifdef USE_NOSTD_MAP
-      for (int j = 0; j < data.map->size(); j++) {
-        if (*(*data.map)[j].key == i) {
-          data.map->remove((long) j);
-        }
-      }
-#else
-      data.map->erase(i);
-#endif
+// stable merge sort, with threads the runs are sorted in parallel and every merge pass is split
+// into independent pieces along the merge path so that all the threads stay busy until the end
+template <class T, class Less>
+inline void parallelStableSort(T* data, size_t n, Less less) {
+  ValueThreadPool& pool = ValueThreadPool::instance();
+  size_t parts = pool.size();
+  if (n < PARALLEL_SORT_THRESHOLD || parts < 2) {
+    std::stable_sort(data, data + n, less);
+    return;
+  }
+  size_t run = (n + parts - 1) / parts;
+  pool.parallelFor(parts, 1, [&] (size_t begin, size_t end) {
+    for (size_t r = begin; r < end; r++) {
+      std::stable_sort(data + std::min(n, r * run), data + std::min(n, (r + 1) * run), less);
     }
+  });
+  std::vector<T> buffer(n);
+  T* from = data;
+  T* to = buffer.data();
+  for (size_t width = run; width < n; width *= 2) {
+    size_t pairs = (n + 2 * width - 1) / (2 * width), pieces = (parts + pairs - 1) / pairs;
+    pool.parallelFor(pairs * pieces, 1, [&] (size_t begin, size_t end) {
+      for (size_t t = begin; t < end; t++) {
+        size_t lo = t / pieces * 2 * width, mid = std::min(n, lo + width), hi = std::min(n, lo + 2 * width);
+        size_t na = mid - lo, nb = hi - mid, piece = t % pieces;
+        size_t k0 = (na + nb) * piece / pieces, k1 = (na + nb) * (piece + 1) / pieces;
+        size_t i0 = mergeSplit(from + lo, na, from + mid, nb, k0, less);
+        size_t i1 = mergeSplit(from + lo, na, from + mid, nb, k1, less);
+        std::merge(from + lo + i0, from + lo + i1, from + mid + (k0 - i0), from + mid + (k1 - i1), to + lo + k0, less);
+      }
+    });
+    std::swap(from, to);
   }
+  if (from != data) std::copy(from, from + n, data);
+}
 
-  void clear() {
-    modify_linked()
-    if (_ISARR(type)) {
-      data.array->clear();
-    } else if (_ISTEXT(type)) {
-      *data.text = "";
+// maps a double to an integer with the same order (NaNs go after everything else)
+inline unsigned long long numberSortKey(double d) {
+  if (d != d) return ~0ULL;
+  unsigned long long k;
+  memcpy(&k, &d, sizeof(k));
+  return (k >> 63) ? ~k : k | 0x8000000000000000ULL;
+}
+
+inline double numberFromSortKey(unsigned long long k) {
+  k = (k >> 63) ? k & 0x7FFFFFFFFFFFFFFFULL : ~k;
+  double d;
+  memcpy(&d, &k, sizeof(d));
+  return d;
+}
+
+// LSD radix sort on 64 bit keys, one byte per pass and the passes where all the keys have the same
+// byte are skipped (so small integers take two or three passes), indices move along with their keys
+inline void radixSort(unsigned long long* keys, size_t* indices, size_t n) {
+  if (n < 2) return;
+  std::vector<unsigned long long> keyBuffer(n);
+  std::vector<size_t> indexBuffer(indices ? n : 0), counts(8 * 256, 0);
+  for (size_t i = 0; i < n; i++) {
+    for (int p = 0; p < 8; p++) {
+      counts[p * 256 + ((keys[i] >> (8 * p)) & 255)]++;
+    }
+  }
+  unsigned long long *k = keys, *kb = keyBuffer.data();
+  size_t *x = indices, *xb = indexBuffer.data();
+  for (int p = 0; p < 8; p++) {
+    size_t* c = &counts[p * 256];
+    if (c[(k[0] >> (8 * p)) & 255] == n) continue;
+    size_t sum = 0;
+    for (int b = 0; b < 256; b++) {
+      size_t t = c[b];
+      c[b] = sum;
+      sum += t;
     }
+    for (size_t i = 0; i < n; i++) {
+      size_t pos = c[(k[i] >> (8 * p)) & 255]++;
+      kb[pos] = k[i];
+      if (x) xb[pos] = x[i];
+    }
+    std::swap(k, kb);
+    std::swap(x, xb);
+  }
+  if (k != keys) {
+    std::copy(k, k + n, keys);
+    if (indices) std::copy(x, x + n, indices);
   }
+}
 
-  NUMBER getNumber() const {
-    if (_ISNUMBER(type)) {
-#ifdef USE_DOUBLE
-      return data.number;
-#else
-      return data.smallNumber;
-    } else if (_ISBIGNUMBER(type)) {
-      return *data.number;
-#endif
+struct TextSortItem {
+  const unsigned char* text;
+  size_t length;
+  size_t index;
+};
+
+// byte at depth + 1, 0 once the text has ended
+inline size_t textSortDigit(const TextSortItem& t, size_t depth) {
+  return depth < t.length ? t.text[depth] + 1 : 0;
+}
+
+// one counting pass of the MSD radix sort, bounds gets the 257 buckets ([bounds[b], bounds[b + 1]))
+inline void textRadixPass(TextSortItem* items, TextSortItem* buffer, size_t begin, size_t end, size_t depth, size_t* bounds) {
+  size_t pos[257] = { 0 };
+  for (size_t i = begin; i < end; i++) {
+    pos[textSortDigit(items[i], depth)]++;
+  }
+  bounds[0] = begin;
+  for (int b = 0; b < 257; b++) {
+    bounds[b + 1] = bounds[b] + pos[b];
+    pos[b] = bounds[b];
+  }
+  for (size_t i = begin; i < end; i++) {
+    buffer[pos[textSortDigit(items[i], depth)]++] = items[i];
+  }
+  std::copy(buffer + begin, buffer + end, items + begin);
+}
+
+// MSD radix sort of items in [begin, end) that share their first depth bytes, small buckets are finished
+// with a stable comparison sort, uses an explicit stack so long common prefixes don't recurse
+inline void textRadixSort(TextSortItem* items, TextSortItem* buffer, size_t begin, size_t end, size_t depth) {
+  struct Job {
+    size_t begin, end, depth;
+  };
+  std::vector<Job> jobs(1, Job { begin, end, depth });
+  size_t bounds[258];
+  while (!jobs.empty()) {
+    Job j = jobs.back();
+    jobs.pop_back();
+    if (j.end - j.begin < 32) {
+      size_t d = j.depth;
+      std::stable_sort(items + j.begin, items + j.end, [d] (const TextSortItem& l, const TextSortItem& r) {
+        int c = memcmp(l.text + d, r.text + d, (l.length < r.length ? l.length : r.length) - d);
+        return c != 0 ? c < 0 : l.length < r.length;
+      });
+      continue;
+    }
+    textRadixPass(items, buffer, j.begin, j.end, j.depth, bounds);
+    for (int b = 1; b < 257; b++) {
+      if (bounds[b + 1] - bounds[b] > 1) jobs.push_back(Job { bounds[b], bounds[b + 1], j.depth + 1 });
     }
-    return 0;
   }
+}
 
-  Value pop() {
-    modify_linked()
-    if (_ISARR(type)) {
-#ifdef USE_ARDUINO_ARRAY
-      Value* v = (*data.array)[data.array->size() - 1];
-      Value res(v->data, v->type, v->useCount);
-      delete v;
-#else
-      Value& v = (*data.array)[data.array->size() - 1];
-      Value res(v.data, v.type, v.useCount);
-#endif
-      data.array->pop_back();
-      return res;
-    } else if (_ISTEXT(type)) {
-#ifdef USE_ARDUINO_STRING
-      size_t s = data.text->length() - 1;
-      char t = data.text->charAt(s);
-      data.text->remove(s);
-      return TEXT(t);
-#else
-      char t = (*data.text)[data.text->size() - 1];
-      data.text->pop_back();
-      return TEXT("") + t;
-#endif
+// stable sort of texts in byte order (like std::string's <), after the common prefix the buckets of
+// the first distinguishing byte are sorted in parallel
+inline void textRadixSort(TextSortItem* items, size_t n) {
+  std::vector<TextSortItem> buffer(n);
+  size_t depth = 0, bounds[258];
+  while (true) {
+    if (n < PARALLEL_SORT_THRESHOLD || ValueThreadPool::instance().size() < 2) {
+      textRadixSort(items, buffer.data(), 0, n, depth);
+      return;
     }
-    return Types::Null;
+    textRadixPass(items, buffer.data(), 0, n, depth, bounds);
+    if (bounds[1] == n) return;
+    size_t b = 1;
+    while (bounds[b + 1] - bounds[b] != n && b < 256) b++;
+    if (bounds[b + 1] - bounds[b] != n) break;
+    depth++;
   }
+  ValueThreadPool::instance().parallelFor(256, 1, [&] (size_t begin, size_t end) {
+    for (size_t b = begin + 1; b <= end; b++) {
+      if (bounds[b + 1] - bounds[b] > 1) textRadixSort(items, buffer.data(), bounds[b], bounds[b + 1], depth + 1);
+    }
+  });
+}
+#ifdef USE_BIG_NUMBER
+#ifndef USE_ARDUINO_STRING
+#include <sstream>
+#include <iomanip>
+#endif
+#endif
+#endif
 
-  void _pop() {
-    modify_linked()
-    if (_ISARR(type)) {
-#ifdef USE_ARDUINO_ARRAY
-      Value* v = (*data.array)[data.array->size() - 1];
-      delete v;
+//#ifdef USE_DOUBLE
+//#define IS_NUM(x) x.getType() == Types::Number || x.getType() == Types::SmallNumber
+//#else
+#define IS_NUM(x) x.getType() == Types::Number || x.getType() == Types::BigNumber || x.getType() == Types::SmallNumber
+//#endif
+
+#define _ISNUMBER(x) (x == Types::Number || x == Types::SmallNumber TREAT_AS_NUMBER(x))
+#define _ISBIGNUMBER(x) (x == Types::BigNumber TREAT_AS_BIG_NUMBER(x))
+#define _ISTEXT(x) (x == Types::Text || x == Types::Symbol TREAT_AS_TEXT(x))
+#define _ISNULL(x) (x == Types::Null TREAT_AS_NULL(x))
+#define _ISTRUE(x) (x == Types::True TREAT_AS_TRUE(x))
+#define _ISFALSE(x) (x == Types::False TREAT_AS_FALSE(x))
+#define _ISARR(x) (x == Types::Array TREAT_AS_ARRAY(x))
+#define _ISMAP(x) (x == Types::Map TREAT_AS_MAP(x))
+
+#ifndef TREAT_AS_NUMBER
+#define TREAT_AS_NUMBER(x) 
 #endif
-      data.array->pop_back();
-    } else if (_ISTEXT(type)) {
-#ifdef USE_ARDUINO_STRING
-      size_t s = data.text->length() - 1;
-      data.text->remove(s);
+
+#ifndef TREAT_AS_BIG_NUMBER
+#define TREAT_AS_BIG_NUMBER(x) 
+#endif
+
+#ifndef TREAT_AS_TEXT
+#define TREAT_AS_TEXT(x) 
+#endif
+
+#ifndef TREAT_AS_NULL
+#define TREAT_AS_NULL(x) 
+#endif
+
+#ifndef TREAT_AS_TRUE
+#define TREAT_AS_TRUE(x) 
+#endif
+
+#ifndef TREAT_AS_FALSE
+#define TREAT_AS_FALSE(x) 
+#endif
+
+#ifndef TREAT_AS_ARRAY
+#define TREAT_AS_ARRAY(x) 
+#endif
+
+#ifndef TREAT_AS_MAP
+#define TREAT_AS_MAP(x) 
+#endif
+
+#ifndef USE_COUNT_TYPE
+#if defined(USE_ARDUINO_ARRAY) || defined(USE_ARDUINO_STRING)
+#define USE_COUNT_TYPE char
 #else
-      data.text->pop_back();
+#define USE_COUNT_TYPE size_t
+#endif
+#endif
+#ifndef USE_ARDUINO_ARRAY
+#define modify_linked()     \
+    if (copyBeforeModification || type == Types::Symbol || useCount == frozenCount()) { \
+      clone(); \
+      copyBeforeModification = false; \
+    } \
+    if (_ISARR(type) && data.array->isView) data.array->materialize(); \
+    textChanged();
+#else
+#define modify_linked()     \
+    if (copyBeforeModification || type == Types::Symbol || useCount == frozenCount()) { \
+      clone(); \
+      copyBeforeModification = false; \
+    }
 #endif
+
+#define _retain_value() \
+    if (useCount != 0 && useCount != frozenCount()) (*useCount) ++
+
+#define _release_value(elseExp) \
+    if (useCount != 0) { \
+      if (*useCount == 0) { \
+        delete useCount; \
+        useCount = 0; \
+      } else { \
+        (*useCount) --; \
+        elseExp; \
+      } \
     }
+
+class Value;
+class ValueInternTable;
+class ValueCycleCollector;
+
+#ifdef USE_STATS
+#include <atomic>
+#include <mutex>
+#include <vector>
+// what values do (compile with USE_STATS, without it counting compiles to nothing), every thread
+// counts in its own ValueCounters and Value::stats() adds them up
+template <class Counter>
+struct ValueCounters {
+  enum Operators { Add = 0, Subtract, Multiply, Divide, Pow, PowMod, OPERATORS };
+  Counter allocations[(int) Types::__ADDITIONAL_TYPES__] = {}; // payloads allocated, by type
+  Counter useCounts = {}; // use counts allocated
+  Counter clones = {}; // shared payloads copied before being modified
+  Counter bytesCloned = {};
+  Counter promotions[OPERATORS] = {}; // small numbers that became big ones, by operator
+  Counter rehashes = {}; // hash maps whose buckets grew or that were built from a shape
+
+  template <class C>
+  void add(const ValueCounters<C>& other) {
+    for (int i = 0; i < (int) Types::__ADDITIONAL_TYPES__; i++) allocations[i] += other.allocations[i];
+    useCounts += other.useCounts;
+    clones += other.clones;
+    bytesCloned += other.bytesCloned;
+    for (int i = 0; i < OPERATORS; i++) promotions[i] += other.promotions[i];
+    rehashes += other.rehashes;
   }
+};
 
-  inline Types getType() const {
-    return type;
+typedef ValueCounters<size_t> ValueStats;
+
+// a counter of a thread, nothing but its thread writes it so it needs no atomic read-modify-write,
+// relaxed loads and stores are enough for stats() to read it from another thread
+struct ValueCounter {
+  std::atomic<size_t> n;
+  ValueCounter() : n(0) {}
+  void operator+= (size_t k) { n.store(n.load(std::memory_order_relaxed) + k, std::memory_order_relaxed); }
+  operator size_t() const { return n.load(std::memory_order_relaxed); }
+};
+
+class ValueStatistics {
+  std::mutex lock; // taken when a thread starts or stops counting and by snapshot()
+  std::vector<const ValueCounters<ValueCounter>*> threads;
+  ValueStats finished; // what the threads that ended counted
+
+  struct Thread {
+    ValueCounters<ValueCounter> counters;
+    Thread() {
+      ValueStatistics& s = instance();
+      std::lock_guard<std::mutex> guard(s.lock);
+      s.threads.push_back(&counters);
+    }
+    ~Thread() {
+      ValueStatistics& s = instance();
+      std::lock_guard<std::mutex> guard(s.lock);
+      s.finished.add(counters);
+      s.threads.erase(std::find(s.threads.begin(), s.threads.end(), &counters));
+    }
+  };
+
+public:
+  static ValueStatistics& instance() {
+    static ValueStatistics* statistics = new ValueStatistics(); // outlives the threads
+    return *statistics;
   }
 
-  inline void setType(Types t) {
-    type = t;
+  static ValueCounters<ValueCounter>& local() {
+    static thread_local Thread thread;
+    return thread.counters;
   }
 
-  inline Data getData() const {
-    return data;
+  ValueStats snapshot() {
+    std::lock_guard<std::mutex> guard(lock);
+    ValueStats res = finished;
+    for (size_t i = 0; i < threads.size(); i++) res.add(*threads[i]);
+    return res;
   }
+};
 
-  void put(const Value& k, const Value& v) {
-    modify_linked()
-    if (_ISMAP(type)) {
-#ifndef USE_NOSTD_MAP
-      (*data.map)[k].be((Value*) &v);
+#define _count_stat(counter, n) ValueStatistics::local().counter += n
 #else
-      Pair p;
-      Value* value = new Value();
-      *value = v;
-      Value* key = new Value();
-      *key = k;
-      p.key = key;
-      p.value = value;
-      data.map->push_back(p);
+#define _count_stat(counter, n)
 #endif
-    }
-  }
-
-  Value& get(const Value& k) const;
 
-  void set(const Value& i, const Value& v) {
-    modify_linked()
-    if (_ISMAP(type)) {
-      put(i, v);
-    } else if (_ISARR(type)) {
-#ifdef USE_ARDUINO_ARRAY
-      Value* value = new Value();
-      *value = v;
-      long l = i;
-      Value* n = new Value();
-      while (data.array->size() < (l + 1)) {
-        data.array->push_back(n);
-      }
-      (*data.array)[l] = value;
-#else
-      long l = i;
-      if (data.array->size() < (l + 1)) data.array->resize(l + 1);
-      (*data.array)[l] = v;
+#ifdef USE_TRACE
+#include <chrono>
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
 #endif
-    } else if (_ISTEXT(type) && _ISTEXT(v.type)) {
-#ifdef USE_ARDUINO_STRING
-      long x = i;
-      String s = v.toString();
-      for (long j = x; j < x + v.length(); j++) {
-        data.text->setCharAt(j, s[j - x]);
-      }
-#else
-      data.text->replace((long) i, v.length(), v.toString());
+// an operation that took long or worked on a big value, size is its number of elements (characters
+// for texts)
+struct ValueTrace {
+  const char* operation;
+  Types type;
+  size_t size;
+  unsigned long long nanoseconds;
+};
+
+// operations (clone, toString, sort, numericSort, collectCycles) that take at least minNanoseconds or
+// work on at least minSize elements are passed to handler, and to the value:operation USDT probe that
+// perf or bpftrace can attach to when sys/sdt.h is there. Small numbers promoted to big ones are always
+// passed. Compile with USE_TRACE, without it tracing compiles to nothing. Set these up before other
+// threads use values
+class ValueTracing {
+public:
+  void (*handler)(const ValueTrace&) = 0;
+  size_t minSize = 1000000;
+  unsigned long long minNanoseconds = 1000000;
+
+  static ValueTracing& instance() {
+    static ValueTracing tracing;
+    return tracing;
+  }
+
+  static void fire(const ValueTrace& trace) {
+#ifdef DTRACE_PROBE4
+    DTRACE_PROBE4(value, operation, trace.operation, (int) trace.type, trace.size, trace.nanoseconds);
 #endif
-    }
+    if (instance().handler) instance().handler(trace);
   }
+};
 
-  void insert(Value i, Value v) {
-    modify_linked()
-    if (_ISARR(type)) {
-#ifdef USE_ARDUINO_ARRAY
-      long l = i;
-      if (l < data.array->size()) {
-        Value* value = new Value();
-        *value = v;
-        Value** p = data.array->data();
-        ARRAY* tmp = new ARRAY();
-        while (tmp->size() < data.array->size() + 1) {
-          tmp->push_back(0);
-        }
-        memcpy(tmp->data(), p, l + 1);
-        memcpy(tmp->data() + l + 1, p + l, (data.array->size()) - l + 2);
-        (*tmp)[l] = value;
-        delete data.array;
-        data.array = tmp;
-      } else {
-        set(i, v);
-      }
+// times an operation until the end of the scope
+class ValueTraceScope {
+  const char* operation;
+  Types type;
+  size_t size;
+  std::chrono::steady_clock::time_point start;
+
+public:
+  ValueTraceScope(const char* operation, Types type, size_t size) : operation(operation), type(type), size(size), start(std::chrono::steady_clock::now()) {}
+
+  ~ValueTraceScope() {
+    unsigned long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    const ValueTracing& tracing = ValueTracing::instance();
+    if (size >= tracing.minSize || ns >= tracing.minNanoseconds) ValueTracing::fire(ValueTrace { operation, type, size, ns });
+  }
+};
+
+#define _trace_scope(operation, type, size) ValueTraceScope _trace(operation, type, size)
+#define _trace_event(operation, type, size) ValueTracing::fire(ValueTrace { operation, type, size, 0 })
 #else
-      long l = i;
-      if (data.array->size() < (l + 1)) data.array->resize(l);
-      data.array->insert(data.array->begin() + l, v);
+#define _trace_scope(operation, type, size)
+#define _trace_event(operation, type, size)
 #endif
-    } else if (_ISTEXT(type) && _ISTEXT(v.type)) {
+
+// number of possible roots of cycles after which creating an array or map runs the cycle collector
+// first (and turns on Value::detectCycles() from the start), 0 leaves it to Value::collectCycles()
+#ifndef CYCLE_COLLECT_THRESHOLD
+#define CYCLE_COLLECT_THRESHOLD 0
+#endif
+
+// where get(k, cache) found k the last time (a cache is meant for a single key), looking the key up
+// again in a map with the same shape goes straight to its value
+struct ValueKeyCache {
+  const void* shape = 0;
+  size_t index = 0;
+};
+
+// payload of Types::Symbol values, every text is kept once as a symbol (see Value::symbol()) along
+// with its hash
+class SymbolText : public TEXT {
+public:
+  size_t hash = 0;
+  SymbolText(const TEXT& t) : TEXT(t) {}
+};
+
 #ifdef USE_ARDUINO_STRING
-      long l = i;
-      *data.text = data.text->substring(0, l) + v.toString() + data.text->substring(l);
-#else
-      data.text->replace((long) i, 0, v.toString());
+int compareValue(const void *cmp1, const void *cmp2);
+int compareValueNumeric(const void *cmp1, const void *cmp2);
 #endif
-    }
-  }
 
-  bool containsKey(const Value& k) const {
 #ifdef USE_NOSTD_MAP
-      for (int i = 0; i < data.map->size(); i++) {
-        if (*(*data.map)[i].key == k) {
-          return true;
-        }
-      }
+class Pair {
+public:
+  Value* key;
+  Value* value;
+  Pair() {}
+  Pair& operator= (const Pair&);
+};
 #else
-      return data.map->count(k);
+#include <unordered_map>
+#include <sstream>
+class HashFunction {
+public:
+  size_t operator() (const Value& v) const;
+#ifndef USE_ARDUINO_ARRAY
+private:
+  size_t hashNested(const Value& v) const;
 #endif
-    return false;
-  }
+};
 
-  TEXT toString() const {
-    if (_ISNUMBER(type)) {
-#ifdef USE_DOUBLE
-#ifdef USE_ARDUINO_STRING
-      unsigned char decimalPlaces = 0;
-      double x = data.number;
-      while (int(x) != x) {
-        x *= 10;
-        decimalPlaces++;
-      }
-      String s(data.number, decimalPlaces);
-      s.trim();
-      return s;
-#else
-      // TEXT t = std::to_string(data.number);
-      // t.erase(t.find_last_not_of('0') + 1, std::string::npos);
-      // t.pop_back();
-      // return t;
-      std::ostringstream s;
-      s << std::setprecision(16) << data.number;
-      return s.str();
-#endif
-#else
-#ifdef USE_ARDUINO_STRING
-      unsigned char decimalPlaces = 0;
-      double x = data.smallNumber;
-      while (int(x) != x) {
-        x *= 10;
-        decimalPlaces++;
-      }
-      String s(data.smallNumber, decimalPlaces);
-      s.trim();
-      return s;
-#else
-      // TEXT t = std::to_string(data.smallNumber);
-      // t.erase(t.find_last_not_of('0') + 1, std::string::npos);
-      // if (t[t.size() - 1] == '.') t.pop_back();
-      // return t;
-      std::ostringstream s;
-      s << std::setprecision(16) << data.smallNumber;
-      return s.str();
-#endif
-#endif
-#ifndef USE_DOUBLE
-    } else if (_ISBIGNUMBER(type)) {
-#ifdef USE_BIG_NUMBER
-      return data.number->toString();
-#else
-      std::ostringstream s;
-      s << std::setprecision(256) << *data.number;
-      return s.str();
-#endif
-#endif
-    } else if (_ISTEXT(type)) {
-      return *data.text;
-    } else if (_ISTRUE(type)) {
-      return "True";
-    } else if (_ISFALSE(type)) {
-      return "False";
-    } else if (_ISNULL(type)) {
-      return "null";
-    } else if (_ISARR(type)) {
-#ifdef USE_ARDUINO_ARRAY
-      String s = "[";
-      for (int i = 0; i < data.array->size(); i++) {
-        if ((*data.array)[i] == this) s += "[...]";
-        else s += (*data.array)[i]->toString();
-        if (i != data.array->size() - 1) s += ", ";
-      }
-      s += "]";
-      return s;
-#elif !defined(USE_ARDUINO_STRING)
-      std::ostringstream s;
-      s << '[';
-      if (!data.array->empty()) {
-        for (int i = 0; i < data.array->size(); i++) {
-          if (&(*data.array)[i] == this) s << "[...]";
-          else s << (*data.array)[i].toString();
-          if (i != data.array->size() - 1) s << ", ";
-        }
-      }
-      s << ']';
-      return s.str();
-#else
-      String s = "[";
-      for (int i = 0; i < data.array->size(); i++) {
-        if (&(*data.array)[i] == this) s += "[...]";
-        else s += (*data.array)[i].toString();
-        if (i != data.array->size() - 1) s += ", ";
-      }
-      return s + "]";
-#endif
-    } else if (_ISMAP(type)) {
-#ifndef USE_NOSTD_MAP
-      std::ostringstream s;
-      s << '{';
-      std::unordered_map<Value, Value, HashFunction>::iterator it;
-      size_t size = std::distance((*data.map).begin(), (*data.map).end()) - 1;
-      for (it = data.map->begin(); it != data.map->end(); it++) {
-        s << it->first.toString() << " = " << it->second.toString();
-        if (std::distance(data.map->begin(), it) != size) s << ", ";
-      }
-      s << '}';
-      return s.str();
-#else
-      String s = "{";
-      for (int i = 0; i < data.map->size(); i++) {
-        s += (*data.map)[i].key->toString() + " = " + (*data.map)[i].value->toString();
-        if (i != data.map->size() - 1) s += ", ";
-      }
-      return s + "}";
-#endif
+namespace std {
+  template <>
+  struct hash<Value> {
+    std::size_t operator()(const Value& k) const; // just defined to avoid error (there has been some errors with the compiler used for arduino due)
+  };
+}
+
+// persistent hash map (a hash array mapped trie), every node holds up to 32 entries or children chosen
+// by 5 bits of the hash, like PersistentVector copies share the nodes and modifications copy the path
+template <class K, class T, class H>
+class PersistentMap {
+  enum { BITS = 5, WIDTH = 1 << BITS, MASK = WIDTH - 1, LAST_SHIFT = 60 };
+  struct Entry {
+    K key;
+    T value;
+    size_t hash;
+  };
+  // below LAST_SHIFT the hash bits are used up, the entries of those nodes are just searched through
+  struct Node {
+    size_t refs = 1;
+    unsigned entryMap = 0, nodeMap = 0;
+    std::vector<Entry> entries;
+    std::vector<Node*> nodes;
+  };
+  Node* root = 0;
+  size_t count = 0;
+
+  static void release(Node* n) {
+    if (n == 0 || --n->refs != 0) return;
+    for (size_t i = 0; i < n->nodes.size(); i++) {
+      release(n->nodes[i]);
     }
-    return "";
+    delete n;
   }
 
-  bool operator== (const Value& other) const {
-#ifndef USE_DOUBLE
-    if (_ISNUMBER(type) && _ISBIGNUMBER(other.type)) {
-      return *other.data.number == data.smallNumber;
-    } else if (_ISBIGNUMBER(type) && _ISNUMBER(other.type)) {
-      return *data.number == other.data.smallNumber;
-    }
-#endif
-    if (other.type == type || (_ISNUMBER(other.type) && _ISNUMBER(type))) {
-      if (_ISNUMBER(type)) {
-#ifdef USE_DOUBLE
-        return data.number == other.data.number;
-#else
-        return data.smallNumber == other.data.smallNumber;
-      } else if (_ISBIGNUMBER(type)) {
-        return *data.number == *other.data.number;
-#endif
-      }
-      if (_ISTEXT(type)) {
-        return *data.text == *other.data.text;
-      } else if (_ISTRUE(type) || _ISFALSE(type) || _ISNULL(type)) {
-        return true;
-      } else if (_ISARR(type)) {
-#ifdef USE_ARDUINO_ARRAY
-        if (data.array->size() == other.data.array->size()) {
-          for (size_t i = 0; i < data.array->size(); i++) {
-            if (*(*data.array)[i] != *(*other.data.array)[i]) return false;
-          }
-          return true;
-        }
-#else
-        return std::equal(data.array->begin(), data.array->end(), other.data.array->begin());
-#endif
-      } else if (_ISMAP(type)) {
-#ifdef USE_NOSTD_MAP
-        if (data.map->size() == other.data.map->size()) {
-          for (size_t i = 0; i < data.map->size(); i++) {
-            if (*(*data.map)[i].value != other.get((*data.map)[i].key)) return false;
-          }
-          return true;
-        }
-#else
-        return *data.map == *other.data.map;
-#endif
-      }
+  static Node* own(Node* n) {
+    if (n->refs == 1) return n;
+    Node* copy = new Node(*n);
+    copy->refs = 1;
+    for (size_t i = 0; i < copy->nodes.size(); i++) {
+      copy->nodes[i]->refs++;
     }
-    return false;
+    n->refs--;
+    return copy;
   }
 
-  bool operator!= (const Value& other) const {
-    return !(*this == other);
+  static inline size_t position(unsigned map, unsigned bit) {
+    return __builtin_popcount(map & (bit - 1));
   }
 
-  bool operator> (const Value& other) const {
-    if (_ISNUMBER(other.type) && _ISNUMBER(type)) {
-#ifdef USE_DOUBLE
-      return data.number > other.data.number;
-#else
-      return data.smallNumber > other.data.smallNumber;
-#endif
+  T& ref(Node*& slot, const K& k, size_t hash, int shift, bool& added) {
+    Node* n = own(slot);
+    slot = n;
+    if (shift > LAST_SHIFT) {
+      for (size_t i = 0; i < n->entries.size(); i++) {
+        if (n->entries[i].key == k) return n->entries[i].value;
+      }
+      n->entries.push_back(Entry { k, T(), hash });
+      added = true;
+      return n->entries.back().value;
     }
-#ifndef USE_DOUBLE
-    else if (_ISBIGNUMBER(other.type) && _ISBIGNUMBER(type)) {
-      return *data.number > *other.data.number;
-    } else if (_ISBIGNUMBER(type) && _ISNUMBER(other.type)) {
-      return *data.number > other.data.smallNumber;
-    } else if (_ISNUMBER(type) && _ISBIGNUMBER(other.type)) {
-      return data.smallNumber > *other.data.number;
+    unsigned bit = 1u << ((hash >> shift) & MASK);
+    if (n->nodeMap & bit) {
+      return ref(n->nodes[position(n->nodeMap, bit)], k, hash, shift + BITS, added);
     }
-#endif
-    return false;
+    size_t i = position(n->entryMap, bit);
+    if (n->entryMap & bit) {
+      if (n->entries[i].key == k) return n->entries[i].value;
+      // two entries for the same slot, both of them go one level down
+      Node* child = new Node();
+      Entry& e = n->entries[i];
+      bool moved = false;
+      ref(child, e.key, e.hash, shift + BITS, moved) = static_cast<T&&>(e.value);
+      n->entries.erase(n->entries.begin() + i);
+      n->entryMap ^= bit;
+      size_t j = position(n->nodeMap, bit);
+      n->nodes.insert(n->nodes.begin() + j, child);
+      n->nodeMap |= bit;
+      return ref(n->nodes[j], k, hash, shift + BITS, added);
+    }
+    n->entries.insert(n->entries.begin() + i, Entry { k, T(), hash });
+    n->entryMap |= bit;
+    added = true;
+    return n->entries[i].value;
   }
 
-  bool operator< (const Value& other) const {
-    if (_ISNUMBER(other.type) && _ISNUMBER(type)) {
-#ifdef USE_DOUBLE
-      return data.number < other.data.number;
-#else
-      return data.smallNumber < other.data.smallNumber;
-#endif
-    }
-#ifndef USE_DOUBLE
-    else if (_ISBIGNUMBER(other.type) && _ISBIGNUMBER(type)) {
-      return *data.number < *other.data.number;
-    } else if (_ISBIGNUMBER(type) && _ISNUMBER(other.type)) {
-      return *data.number < other.data.smallNumber;
-    } else if (_ISNUMBER(type) && _ISBIGNUMBER(other.type)) {
-      return data.smallNumber < *other.data.number;
+  static const Entry* find(const Node* n, const K& k, size_t hash) {
+    for (int shift = 0; n; shift += BITS) {
+      if (shift > LAST_SHIFT) {
+        for (size_t i = 0; i < n->entries.size(); i++) {
+          if (n->entries[i].key == k) return &n->entries[i];
+        }
+        return 0;
+      }
+      unsigned bit = 1u << ((hash >> shift) & MASK);
+      if (n->entryMap & bit) {
+        const Entry& e = n->entries[position(n->entryMap, bit)];
+        return e.hash == hash && e.key == k ? &e : 0;
+      }
+      n = n->nodeMap & bit ? n->nodes[position(n->nodeMap, bit)] : 0;
     }
-#endif
-    return false;
+    return 0;
   }
 
-  bool operator<= (const Value& other) const {
-    if (_ISNUMBER(other.type) && _ISNUMBER(type)) {
-#ifdef USE_DOUBLE
-      return data.number <= other.data.number;
-#else
-      return data.smallNumber <= other.data.smallNumber;
-#endif
+  // the key is known to be there
+  void erase(Node*& slot, const K& k, size_t hash, int shift) {
+    Node* n = own(slot);
+    slot = n;
+    if (shift > LAST_SHIFT) {
+      for (size_t i = 0; i < n->entries.size(); i++) {
+        if (n->entries[i].key == k) {
+          n->entries.erase(n->entries.begin() + i);
+          return;
+        }
+      }
+      return;
     }
-#ifndef USE_DOUBLE
-    else if (_ISBIGNUMBER(other.type) && _ISBIGNUMBER(type)) {
-      return *data.number <= *other.data.number;
-    } else if (_ISBIGNUMBER(type) && _ISNUMBER(other.type)) {
-      return *data.number <= other.data.smallNumber;
-    } else if (_ISNUMBER(type) && _ISBIGNUMBER(other.type)) {
-      return data.smallNumber <= *other.data.number;
+    unsigned bit = 1u << ((hash >> shift) & MASK);
+    if (n->entryMap & bit) {
+      n->entries.erase(n->entries.begin() + position(n->entryMap, bit));
+      n->entryMap ^= bit;
+      return;
+    }
+    size_t j = position(n->nodeMap, bit);
+    erase(n->nodes[j], k, hash, shift + BITS);
+    Node* child = n->nodes[j];
+    if (child->nodes.empty() && child->entries.size() <= 1) {
+      // a child with a single entry gets merged back into this node
+      n->nodes.erase(n->nodes.begin() + j);
+      n->nodeMap ^= bit;
+      if (child->entries.size() == 1) {
+        n->entries.insert(n->entries.begin() + position(n->entryMap, bit), child->entries[0]);
+        n->entryMap |= bit;
+      }
+      release(child);
     }
-#endif
-    return false;
   }
 
-  bool operator>= (const Value& other) const {
-    if (_ISNUMBER(other.type) && _ISNUMBER(type)) {
-#ifdef USE_DOUBLE
-      return data.number >= other.data.number;
-#else
-      return data.smallNumber >= other.data.smallNumber;
-#endif
+  template <class F>
+  static bool forEach(const Node* n, const F& fn) {
+    for (size_t i = 0; i < n->entries.size(); i++) {
+      if (!fn(n->entries[i].key, n->entries[i].value)) return false;
     }
-#ifndef USE_DOUBLE
-    else if (_ISBIGNUMBER(other.type) && _ISBIGNUMBER(type)) {
-      return *data.number >= *other.data.number;
-    } else if (_ISBIGNUMBER(type) && _ISNUMBER(other.type)) {
-      return *data.number >= other.data.smallNumber;
-    } else if (_ISNUMBER(type) && _ISBIGNUMBER(other.type)) {
-      return data.smallNumber >= *other.data.number;
+    for (size_t i = 0; i < n->nodes.size(); i++) {
+      if (!forEach(n->nodes[i], fn)) return false;
     }
-#endif
-    return false;
+    return true;
   }
 
-  bool operator! () const {
-    if ((_ISNUMBER(type) || _ISBIGNUMBER(type)) && toLong() == 0)
-      return true;
-    if (_ISFALSE(type)) {
-      return true;
-    }
-    return false;
-  }
+public:
+  PersistentMap() {}
 
-  double toDouble() const {
-    if (_ISNUMBER(type)) {
-#ifdef USE_DOUBLE
-      return data.number;
-#else
-      return data.smallNumber;
-#endif
-    }
-#ifndef USE_DOUBLE
-    else if (_ISBIGNUMBER(type)) {
-#ifdef USE_BIG_NUMBER
-      return data.number->toDouble();
-#else
-      return data.number->get_d();
-#endif
-    }
-#endif
-    return 0;
+  PersistentMap(const PersistentMap& other) : root(other.root), count(other.count) {
+    if (root) root->refs++;
   }
 
-  long toLong() const {
-    if (_ISNUMBER(type)) {
-#ifdef USE_DOUBLE
-      return data.number;
-#else
-      return data.smallNumber;
-#endif
-    }
-#ifndef USE_DOUBLE
-    else if (_ISBIGNUMBER(type)) {
-#ifdef USE_BIG_NUMBER
-      return data.number->toLong();
-#else
-      return data.number->get_si();
-#endif
-    }
-#endif
-    return 0;
+  PersistentMap& operator= (const PersistentMap& other) {
+    if (this == &other) return *this;
+    clear();
+    root = other.root;
+    count = other.count;
+    if (root) root->refs++;
+    return *this;
   }
 
-  long operator~ () const {
-    if (_ISNUMBER(type)) {
-      return ~toLong();
-    }
-    return 0;
+  ~PersistentMap() {
+    clear();
   }
 
-  Value operator- () const {
-    if (_ISNUMBER(type)
-#ifndef USE_DOUBLE
-    || _ISBIGNUMBER(type)
-#endif
-    ) {
-      return *this * Value(-1);
-    }
-    return 0;
+  void clear() {
+    release(root);
+    root = 0;
+    count = 0;
   }
 
-  inline operator bool() const {
-    if (_ISTRUE(type)) return true;
-    return false;
+  inline size_t size() const {
+    return count;
   }
 
-  inline operator int() const {
-    return toLong();
+  bool sameAs(const PersistentMap& other) const {
+    return root == other.root;
   }
 
-  inline operator long() const {
-    return toLong();
+  const T* find(const K& k) const {
+    const Entry* e = find(root, k, H()(k));
+    return e ? &e->value : 0;
   }
 
-  inline operator double() const {
-    return toDouble();
+  // like std::unordered_map's [], the entry gets added if it isn't there
+  T& operator[] (const K& k) {
+    if (root == 0) root = new Node();
+    bool added = false;
+    T& res = ref(root, k, H()(k), 0, added);
+    if (added) count++;
+    return res;
   }
 
-  inline bool equals(const Value& v) const {
-    return *this == v;
+  size_t erase(const K& k) {
+    size_t hash = H()(k);
+    if (find(root, k, hash) == 0) return 0;
+    erase(root, k, hash, 0);
+    count--;
+    return 1;
   }
 
-  bool looksEqual(const Value& v) const {
-    return toString() == v.toString();
+  // calls fn(key, value) for every entry until it returns false
+  template <class F>
+  void forEach(const F& fn) const {
+    if (root) forEach(root, fn);
   }
 
-  void sort() {
-    modify_linked()
-    if (_ISARR(type)) {
-#ifdef USE_ARDUINO_STRING
-      qsort(data.array->data(), data.array->size(), sizeof(Value*), compareValue);
-#else
-      std::sort(data.array->begin(), data.array->end(), [=] (const Value& l, const Value& r) {
-        return l.toString() < r.toString();
-      });
-#endif
+  // copies the nodes shared with other maps, so that the values can be modified in place
+  void own() {
+    if (root == 0) return;
+    std::vector<Node**> slots(1, &root);
+    while (!slots.empty()) {
+      Node** slot = slots.back();
+      slots.pop_back();
+      *slot = own(*slot);
+      for (size_t i = 0; i < (*slot)->nodes.size(); i++) slots.push_back(&(*slot)->nodes[i]);
     }
   }
 
-  void numericSort() {
-    modify_linked()
-    if (_ISARR(type)) {
-#ifdef USE_ARDUINO_STRING
-      qsort(data.array->data(), data.array->size(), sizeof(Value*), compareValueNumeric);
-#else
-      std::sort(data.array->begin(), data.array->end(), [=] (const Value& l, const Value& r) {
-        if (_ISNUMBER(l.type) && _ISNUMBER(r.type)) {
-          return l < r;
-        } else {
-          return (bool) false;
+  // goes through the entries of every node before the ones of its children, the path down to the
+  // current node is kept in the iterator itself (no allocations when copying it)
+  class iterator {
+    enum { DEPTH = LAST_SHIFT / BITS + 2 };
+    Node* path[DEPTH];
+    size_t next[DEPTH]; // the child to go to after the entries of each node on the path
+    int depth = -1;
+    size_t entry = 0;
+
+    void settle() {
+      while (depth >= 0) {
+        Node* n = path[depth];
+        if (entry < n->entries.size()) return;
+        if (next[depth] < n->nodes.size()) {
+          path[depth + 1] = n->nodes[next[depth]++];
+          depth++;
+          next[depth] = 0;
+          entry = 0;
+        } else if (--depth >= 0) {
+          entry = path[depth]->entries.size();
         }
-      });
-#endif
+      }
+    }
+
+  public:
+    iterator() {}
+
+    explicit iterator(Node* root) {
+      if (root == 0) return;
+      path[0] = root;
+      next[0] = 0;
+      depth = 0;
+      settle();
     }
+
+    inline const K& key() const {
+      return path[depth]->entries[entry].key;
+    }
+
+    inline T& value() const {
+      return path[depth]->entries[entry].value;
+    }
+
+    iterator& operator++ () {
+      entry++;
+      settle();
+      return *this;
+    }
+
+    bool operator== (const iterator& other) const {
+      return depth == other.depth && (depth < 0 || (path[depth] == other.path[depth] && entry == other.entry));
+    }
+
+    bool operator!= (const iterator& other) const {
+      return !(*this == other);
+    }
+  };
+
+  iterator begin() const {
+    return iterator(root);
   }
 
-  void reverse() {
-    modify_linked()
-    if (_ISARR(type)) {
-#ifdef USE_ARDUINO_ARRAY
-      size_t s = data.array->size();
-      if (s > 1) {
-        Value* tmp;
-        for (int i = 0; i < s / 2; i++) {
-          tmp = (*data.array)[i];
-          (*data.array)[i] = (*data.array)[s - (i + 1)];
-          (*data.array)[s - (i + 1)] = tmp;
-        }
-      }
-#else
-      std::reverse(data.array->begin(), data.array->end());
+  iterator end() const {
+    return iterator();
+  }
+};
+
+#ifndef MAX_SHAPE_SIZE
+#define MAX_SHAPE_SIZE 32
 #endif
-    } else if (_ISTEXT(type)) {
-#ifdef USE_ARDUINO_ARRAY
-      size_t s = data.text->length();
-      if (s > 1) {
-        char tmp;
-        for (int i = 0; i < s / 2; i++) {
-          tmp = (*data.text)[i];
-          (*data.text)[i] = (*data.text)[s - (i + 1)];
-          (*data.text)[s - (i + 1)] = tmp;
-        }
-      }
-#else
-      std::reverse(data.text->begin(), data.text->end());
+
+#ifndef MAX_SHAPES
+#define MAX_SHAPES 16384
+#endif
+
+// key layout shared by the maps that got the same symbol keys added in the same order (like the hidden
+// classes of JavaScript engines), those maps hold nothing but the values in the order of the keys. Only
+// symbols (Value::symbol(), or every text key with USE_SYMBOL_KEYS) go into shapes, so maps used as
+// dictionaries stay hash maps. Shapes are never freed, once there are MAX_SHAPES of them new key orders
+// go to hash maps too. Following a transition to a shape that already exists takes no lock
+template <class K, class H>
+class ValueShape {
+  const ValueShape* parent;
+  mutable std::atomic<size_t> expected; // most keys a map went on to get after having this shape
+  enum { TABLE = 2 * MAX_SHAPES };
+#ifdef USE_THREADS
+  static std::mutex& lock() {
+    static std::mutex m;
+    return m;
+  }
 #endif
+
+  static size_t& count() {
+    static size_t n = 0;
+    return n;
+  }
+
+  // every shape but the root, found by its parent and its last key (open addressing, at most half
+  // full). Slots get filled once and never emptied, so readers don't need the lock
+  static std::atomic<ValueShape*>* table() {
+    static std::atomic<ValueShape*>* slots = new std::atomic<ValueShape*>[TABLE]();
+    return slots;
+  }
+
+  size_t slot(size_t hash) const {
+    size_t h = (hash ^ reinterpret_cast<size_t>(this)) * (size_t) 0x9E3779B97F4A7C15ULL;
+    return (h ^ (h >> 29)) % TABLE;
+  }
+
+  // the shape with k added after these keys, if a map got there before
+  const ValueShape* find(const K& k, size_t hash) const {
+    std::atomic<ValueShape*>* slots = table();
+    for (size_t i = slot(hash); ; i = (i + 1) % TABLE) {
+      const ValueShape* s = slots[i].load(std::memory_order_acquire);
+      if (s == 0) return 0;
+      if (s->parent != this) continue;
+      const K& last = s->keys.back();
+      if (k.isSymbol() ? last.getData().text == k.getData().text : last == k) return s;
     }
   }
 
-  void replace(Value a, Value b) {
-    modify_linked()
-    if (_ISTEXT(type)) {
-#ifndef USE_ARDUINO_STRING
-      TEXT t = a.toString();
-      int i = data.text->find(t);
-      if (i != -1) data.text->replace(i, t.length(), b.toString());
+  ValueShape(const ValueShape* parent) : parent(parent), expected(0) {}
+
+public:
+  std::vector<K> keys; // symbols, made along with the shape so there are at most MAX_SHAPES of them
+  std::vector<size_t> hashes; // of the keys
+
+  static const ValueShape* root() {
+#ifdef USE_ARDUINO_STRING
+    return 0;
 #else
-      data.text->replace(a.toString(), b.toString());
+    static const ValueShape* shape = new ValueShape(0);
+    return shape;
 #endif
-    }
   }
 
-  int indexOf(Value v, int index = 0) const {
-    if (_ISTEXT(type)) {
-#ifdef USE_ARDUINO_STRING
-      return data.text->indexOf(v.toString(), index);
+  // whether k can go into a shape
+  static inline bool takes(const K& k) {
+#ifdef USE_SYMBOL_KEYS
+    return k.getType() == Types::Text; // made into a symbol when the shape gets made
 #else
-      return data.text->find(v.toString(), index);
+    return k.isSymbol();
 #endif
-    } else if (_ISARR(type)) {
-#ifdef USE_ARDUINO_ARRAY
-      for (int i = index; i < data.array->size(); i++) {
-        if (*(*data.array)[i] == v) {
-          return i;
-        }
+  }
+
+  inline size_t indexOf(const K& k) const {
+    if (k.isSymbol()) {
+      const void* text = k.getData().text;
+      for (size_t i = 0; i < keys.size(); i++) {
+        if (keys[i].getData().text == text) return i;
       }
-#else
-      auto it = std::find(data.array->begin() + index, data.array->end(), v);
-      if (it != data.array->end()) {
-        return it - data.array->begin();
+    } else if (!keys.empty() && k.getType() == Types::Text) {
+      // the hashes of the keys are next to each other, most keys that aren't here get no text comparison
+      size_t hash = H()(k);
+      for (size_t i = 0; i < hashes.size(); i++) {
+        if (hashes[i] == hash && keys[i].getString() == k.getString()) return i;
       }
-#endif
     }
-    return -1;
+    return (size_t) -1;
   }
 
-  int lastIndexOf(Value v, int index) const {
-    if (_ISTEXT(type)) {
-#ifdef USE_ARDUINO_STRING
-      return data.text->lastIndexOf(v.toString(), index);
-#else
-      return data.text->find_last_of(v.toString(), index);
-#endif
-    } else if (_ISARR(type)) {
-      for (int i = index; i >= 0; i--) {
-#ifdef USE_ARDUINO_ARRAY
-        if (*(*data.array)[i] == v) {
-#else
-        if ((*data.array)[i] == v) {
-#endif
-          return i;
+  // the shape with the key added after these keys (0 if it would go over the limits), reserve gets
+  // how many values maps with that shape have ended up needing
+  const ValueShape* with(const K& k, size_t& reserve) const {
+    if (keys.size() >= MAX_SHAPE_SIZE) return 0;
+    size_t hash = H()(k);
+    const ValueShape* res = find(k, hash);
+    if (res == 0) {
+#ifdef USE_THREADS
+      std::lock_guard<std::mutex> guard(lock());
+#endif
+      res = find(k, hash); // unless another thread made it in the meantime
+      if (res == 0) {
+        if (count() >= MAX_SHAPES) return 0;
+        count()++;
+        ValueShape* shape = new ValueShape(this);
+        shape->keys = keys;
+        shape->keys.push_back(K::symbol(k));
+        shape->hashes = hashes;
+        shape->hashes.push_back(hash);
+        size_t n = shape->keys.size();
+        shape->expected.store(n, std::memory_order_relaxed);
+        for (const ValueShape* s = this; s && s->expected.load(std::memory_order_relaxed) < n; s = s->parent) {
+          s->expected.store(n, std::memory_order_relaxed);
         }
+        std::atomic<ValueShape*>* slots = table();
+        size_t i = slot(hash);
+        while (slots[i].load(std::memory_order_relaxed) != 0) i = (i + 1) % TABLE;
+        slots[i].store(shape, std::memory_order_release);
+        res = shape;
       }
     }
-    return -1;
+    reserve = res->expected.load(std::memory_order_relaxed);
+    return res;
   }
+};
 
-  int lastIndexOf(Value v) const {
-    if (_ISTEXT(type)) {
-#ifdef USE_ARDUINO_STRING
-      return data.text->lastIndexOf(v.toString());
-#else
-      return data.text->find_last_of(v.toString());
-#endif
-    } else if (_ISARR(type)) {
-      for (int i = data.array->size(); i >= 0; i--) {
-#ifdef USE_ARDUINO_ARRAY
-        if (*(*data.array)[i] == v) {
-#else
-        if ((*data.array)[i] == v) {
-#endif
-          return i;
-        }
-      }
+// values of a shaped map, in blocks that never move so that references to them stay valid while keys
+// get added. The first block is as big as maps of the same shape have needed, most maps have just one
+template <class T>
+class ValueSlots {
+  struct Block {
+    Block* next;
+    size_t capacity;
+    T* values() {
+      return reinterpret_cast<T*>(this + 1);
     }
-    return -1;
+  };
+  Block* first = 0;
+  size_t count = 0, total = 0;
+
+  void add(size_t capacity) {
+    static_assert(sizeof(Block) % alignof(T) == 0, "values right after the block header");
+    Block* b = static_cast<Block*>(::operator new(sizeof(Block) + capacity * sizeof(T)));
+    b->next = 0;
+    b->capacity = capacity;
+    Block** last = &first;
+    while (*last) last = &(*last)->next;
+    *last = b;
+    total += capacity;
   }
 
-  Value substring(const Value& other) const {
-#ifdef USE_ARDUINO_STRING
-    return data.text->substring((long) other);
-#else
-    return data.text->substr((long) other);
-#endif
+public:
+  ValueSlots() {}
+
+  ValueSlots(const ValueSlots& other) {
+    *this = other;
   }
 
-  Value substring(Value v1, Value v2) const {
-#ifdef USE_ARDUINO_STRING
-    return data.text->substring((long) v1, (long) v2);
-#else
-    return data.text->substr((long) v1, (long) v2 - (long) v1);
-#endif
+  ValueSlots& operator= (const ValueSlots& other) {
+    if (this == &other) return *this;
+    clear();
+    reserve(other.count);
+    for (size_t i = 0; i < other.count; i++) emplace_back(other[i]);
+    return *this;
   }
 
-  inline int length() const {
-    if (_ISTEXT(type)) {
-#ifdef USE_ARDUINO_STRING
-      return data.text->length();
-#else
-      return data.text->size();
-#endif
-    } else if (_ISARR(type)) {
-      return data.array->size();
-    } else if (_ISMAP(type)) {
-      return data.map->size();
+  ~ValueSlots() {
+    clear();
+  }
+
+  inline size_t size() const {
+    return count;
+  }
+
+  inline size_t capacity() const {
+    return total;
+  }
+
+  inline T& operator[] (size_t i) {
+    Block* b = first;
+    while (i >= b->capacity) {
+      i -= b->capacity;
+      b = b->next;
     }
-    return 0;
+    return b->values()[i];
   }
 
-  const Value& getKeyAt(size_t index) const;
+  inline const T& operator[] (size_t i) const {
+    return const_cast<ValueSlots&>(*this)[i];
+  }
 
-  const Value& getValueAt(size_t index) const;
+  void reserve(size_t n) {
+    if (n > total) add(n - total);
+  }
 
-  Value split(Value d) const {
-    Value res = Types::Array;
-    if (_ISTEXT(type)) {
-      int start = 0;
-      int end = indexOf(d);
-      while (end != -1) {
-        res.append(substring(start, end));
-        start = end + d.length();
-        end = indexOf(d, start);
-      }
-      res.append(substring(start, end));
-    }
-    return res;
+  template <class... A>
+  T& emplace_back(A&&... args) {
+    if (count == total) add(total < 4 ? 4 : total);
+    T* at = &(*this)[count];
+    new (at) T(std::forward<A>(args)...);
+    count++;
+    return *at;
   }
 
-  Value trimRight() const {
-    if (_ISTEXT(type)) {
-      int i = length() - 1;
-      while ((*data.text)[i] == '\n' || (*data.text)[i] == '\t' || (*data.text)[i] == ' ') i--;
-      return substring(0, i + 1);
+  void clear() {
+    size_t left = count;
+    while (first) {
+      Block* next = first->next;
+      for (size_t i = 0; i < first->capacity && left > 0; i++, left--) first->values()[i].~T();
+      ::operator delete(first);
+      first = next;
     }
-    return "";
+    count = total = 0;
   }
 
-  Value trimLeft() const {
-    if (_ISTEXT(type)) {
-      int i = 0;
-      while ((*data.text)[i] == '\n' || (*data.text)[i] == '\t' || (*data.text)[i] == ' ') i++;
-      return substring(i);
-    }
-    return "";
+  // a single block with no room to spare, the values move
+  void shrink_to_fit() {
+    if (total == count && (first == 0 || first->next == 0)) return;
+    ValueSlots res;
+    res.reserve(count);
+    for (size_t i = 0; i < count; i++) res.emplace_back(static_cast<T&&>((*this)[i]));
+    swap(res);
   }
 
-  Value trim() const {
-    if (_ISTEXT(type)) {
-      return trimLeft().trimRight();
-    }
-    return "";
+  void swap(ValueSlots& other) {
+    std::swap(first, other.first);
+    std::swap(count, other.count);
+    std::swap(total, other.total);
   }
+};
 
-  Value toUpper() const {
-    TEXT t = *data.text;
-    for (size_t c = 0; c < length(); c++) {
-      if (t[c] > 96 && t[c] < 123) {
-        t[c] -= 32;
-      }
-    }
-    return t;
+// map payload, maps start out with a shape (their keys are in the shared ValueShape and the values in
+// slots), the keys a shape can't take (ones that aren't symbols, or past MAX_SHAPE_SIZE and MAX_SHAPES)
+// go to the hash map next to it. The map turns into a hash map when a key of the shape gets removed,
+// persist() switches it to a PersistentMap. References to values are valid until their key is removed
+// or the map is turned into a hash map or a persistent map, like they are with an std::unordered_map
+template <class K, class T, class H>
+class ValueMap {
+  typedef std::unordered_map<K, T, H> Entries;
+  typedef ValueShape<K, H> Shape;
+  Entries hashed; // the keys the shape couldn't take, every key once there is no shape
+public:
+  const Shape* shape = Shape::root();
+  ValueSlots<T> slots;
+  PersistentMap<K, T, H> persistent;
+  bool isPersistent = false;
+  bool buffered = false; // kept by ValueCycleCollector as a possible root of a cycle
+  ValueTextCache textCache;
+
+  inline size_t size() const {
+    return shape ? slots.size() + hashed.size() : isPersistent ? persistent.size() : hashed.size();
   }
 
-  Value toLower() {
-    TEXT t = *data.text;
-    for (size_t c = 0; c < length(); c++) {
-      if (t[c] < 91 && t[c] > 64) {
-        t[c] += 32;
-      }
-    }
-    return t;
+  // the entries of the hash map, for a map with a shape the ones of the keys the shape couldn't take
+  inline const Entries& hashEntries() const {
+    return hashed;
   }
 
-  bool startsWith(const Value& v) const {
-#ifdef USE_ARDUINO_STRING
-    return data.text->startsWith(v.toString());
-#else
-    return data.text->find(v.toString()) == 0;
-#endif
+  void clear() {
+    hashed.clear();
+    slots.clear();
+    persistent.clear();
+    shape = Shape::root();
+    isPersistent = false;
   }
 
-  bool endsWith(const Value& v) const {
-#ifdef USE_ARDUINO_STRING
-    return data.text->endsWith(v.toString());
-#else
-    TEXT t = v.toString();
-    int i = lastIndexOf(t);
-    return i == data.text->size() - t.size() || i == -1;
-#endif
+  void reserve(size_t n) {
+    if (shape) slots.reserve(n);
+    else if (!isPersistent) hashed.reserve(n);
   }
 
-  int codePointAt(const Value& at) const {
-    if (_ISTEXT(type))
-      return (int) (*data.text)[(long) at];
-    return -1;
+  void shrinkToFit() {
+    if (shape) slots.shrink_to_fit();
+    if (!isPersistent) hashed.rehash(0);
   }
 
-  char charAt(const Value& at) const {
-    if (_ISTEXT(type))
-      return (*data.text)[(long) at];
-    return 0;
+  inline bool empty() const {
+    return size() == 0;
   }
 
-  Value& operator[] (const Value& i) const;
+  // from a shape to a hash map
+  void unshape() {
+    if (shape == 0) return;
+    _count_stat(rehashes, 1);
+    hashed.reserve(hashed.size() + slots.size());
+    for (size_t i = 0; i < slots.size(); i++) {
+      hashed.emplace(shape->keys[i], static_cast<T&&>(slots[i]));
+    }
+    slots.clear();
+    shape = 0;
+  }
 
-  Value& operator[] (int i) const;
+  void persist() {
+    if (isPersistent) return;
+    unshape();
+    for (auto it = hashed.begin(); it != hashed.end(); it++) {
+      persistent[it->first] = static_cast<T&&>(it->second);
+    }
+    Entries().swap(hashed);
+    isPersistent = true;
+  }
 
-  void toNumber() {
-    modify_linked()
-    if (_ISTEXT(type)) {
-      TEXT t = *data.text;
-      int floatDigits = 0;
-      int intDigits = indexOf(".");
-      if (intDigits == -1) {
-        intDigits = t.length();
-      } else {
-        floatDigits = t.length() - intDigits - 1;
-      }
-      if (t[0] == '-') intDigits--;
-      // bool isSmall = (floatDigits == 0 && intDigits <= 15) || (floatDigits != 0 && intDigits <= 10);
-      bool isSmall = floatDigits <= 4 && intDigits < 9;
-      freeUnusedMemory();
-#ifndef USE_DOUBLE
-      if (isSmall) {
-        type = Types::Number;
-        data.smallNumber = atof(t.c_str());
-      } else {
-        type = Types::BigNumber;
-        data.number = new NUMBER(t.c_str());
-        useCount = new USE_COUNT_TYPE; *useCount = 0;
+  inline T& operator[] (const K& k) {
+    if (shape) {
+      size_t i = shape->indexOf(k);
+      if (i != (size_t) -1) return slots[i];
+      size_t reserve = 0;
+      // once a key went to the hash map the ones after it go there too
+      const Shape* next = Shape::takes(k) && hashed.empty() ? shape->with(k, reserve) : 0;
+      if (next) {
+        shape = next;
+        slots.reserve(reserve);
+        return slots.emplace_back();
       }
-#else
-      data.number = NUMBER_FROM_STRING(t.c_str());
-      type = Types::Number;
-#endif
-    } else if (_ISTRUE(type)) {
-#ifndef USE_DOUBLE
-    data.smallNumber = 1;
-#else
-    data.number = 1;
+    }
+#if !defined(USE_ARDUINO_STRING) && defined(USE_SYMBOL_KEYS)
+    if (k.getType() == Types::Text && !k.isSymbol()) {
+      // the key gets added as a symbol
+      if (isPersistent) return persistent.find(k) ? persistent[k] : persistent[K::symbol(k)];
+      auto it = hashed.find(k);
+      return it != hashed.end() ? it->second : entry(K::symbol(k));
+    }
 #endif
-      type = Types::Number;
-    } else if (_ISFALSE(type) || _ISNULL(type)) {
-#ifndef USE_DOUBLE
-      data.smallNumber = 0;
+    return isPersistent ? persistent[k] : entry(k);
+  }
+
+  // hashed[k], counting the rehashes it does
+  inline T& entry(const K& k) {
+#ifdef USE_STATS
+    size_t buckets = hashed.bucket_count();
+    T& res = hashed[k];
+    if (hashed.bucket_count() != buckets) _count_stat(rehashes, 1);
+    return res;
 #else
-      data.number = 0;
+    return hashed[k];
 #endif
-      type = Types::Number;
-    }
   }
 
-  Value operator&=(const Value& other) {
-    modify_linked()
-    if ((_ISTRUE(type) || _ISFALSE(type)) &&
-            (_ISTRUE(other.type) || _ISFALSE(other.type))) {
-      *this = *this && other;
-    } else {
-      long a, b;
-      if (_ISTRUE(type) || _ISFALSE(type)) {
-        a = (int) ((bool) *this);
-      } else a = toLong();
-      if (_ISTRUE(other.type) || _ISFALSE(other.type)) {
-        b = (int) ((bool) other);
-      } else b = other.toLong();
-      *this = a & b;
+  inline size_t count(const K& k) const {
+    if (shape && shape->indexOf(k) != (size_t) -1) return 1;
+    return isPersistent ? persistent.find(k) != 0 : hashed.count(k);
+  }
+
+  inline size_t erase(const K& k) {
+    if (shape) {
+      if (shape->indexOf(k) == (size_t) -1) return hashed.erase(k);
+      unshape();
     }
-    return this;
+    return isPersistent ? persistent.erase(k) : hashed.erase(k);
   }
 
-  Value operator&(const Value& other) const {
-    Value v = *this;
-    v &= other;
-    return v;
+  // calls fn(key, value) for every entry until it returns false
+  template <class F>
+  void forEach(const F& fn) const {
+    if (shape) {
+      for (size_t i = 0; i < slots.size(); i++) {
+        if (!fn(shape->keys[i], slots[i])) return;
+      }
+    } else if (isPersistent) {
+      persistent.forEach(fn);
+      return;
+    }
+    for (auto it = hashed.begin(); it != hashed.end(); it++) {
+      if (!fn(it->first, it->second)) return;
+    }
   }
 
-  Value operator|=(const Value& other) {
-    modify_linked()
-    if ((_ISTRUE(type) || _ISFALSE(type)) &&
-            (_ISTRUE(other.type) || _ISFALSE(other.type))) {
-      *this = *this || other;
+  // fn(key, value, part) for every entry, with the entries split in chunks among the threads of
+  // ValueThreadPool (the buckets of a hash map, persistent maps get their entries listed first). Every
+  // chunk has a part of its own, starting out as Part() and passed to done(part) at the end
+  template <class Part, class F, class Done>
+  void parallelForEach(const F& fn, const Done& done) const {
+    ValueThreadPool& pool = ValueThreadPool::instance();
+    if (shape) {
+      pool.parallelFor(slots.size(), 1024, [&] (size_t begin, size_t end) {
+        Part part = Part();
+        for (size_t i = begin; i < end; i++) fn(shape->keys[i], slots[i], part);
+        done(part);
+      });
+      if (hashed.empty()) return;
+    }
+    if (!isPersistent) {
+      pool.parallelFor(hashed.bucket_count(), 1024, [&] (size_t begin, size_t end) {
+        Part part = Part();
+        for (size_t i = begin; i < end; i++) {
+          for (auto it = hashed.begin(i); it != hashed.end(i); it++) fn(it->first, it->second, part);
+        }
+        done(part);
+      });
     } else {
-      long a, b;
-      if (_ISTRUE(type) || _ISFALSE(type)) {
-        a = (int) ((bool) *this);
-      } else a = toLong();
-      if (_ISTRUE(other.type) || _ISFALSE(other.type)) {
-        b = (int) ((bool) other);
-      } else b = other.toLong();
-      *this = a | b;
+      std::vector<std::pair<const K*, const T*> > entries;
+      entries.reserve(persistent.size());
+      persistent.forEach([&entries] (const K& k, const T& v) {
+        entries.push_back(std::make_pair(&k, &v));
+        return true;
+      });
+      pool.parallelFor(entries.size(), 1024, [&] (size_t begin, size_t end) {
+        Part part = Part();
+        for (size_t i = begin; i < end; i++) fn(*entries[i].first, *entries[i].second, part);
+        done(part);
+      });
     }
-    return this;
   }
 
-  Value operator|(const Value& other) const {
-    Value v = *this;
-    v |= other;
-    return v;
+  const T* find(const K& k) const {
+    if (shape) {
+      size_t i = shape->indexOf(k);
+      if (i != (size_t) -1) return &slots[i];
+    }
+    if (isPersistent) return persistent.find(k);
+    auto it = hashed.find(k);
+    return it == hashed.end() ? 0 : &it->second;
   }
 
-  Value operator<<=(const Value& other) {
-    modify_linked()
-    if (IS_NUM(other) && (_ISNUMBER(type) || _ISBIGNUMBER(type))) {
-      *this = toLong() << other.toLong();
+  template <class V>
+  struct BasicEntry {
+    const K& key;
+    V& value;
+  };
+  typedef BasicEntry<T> Entry;
+  typedef BasicEntry<const T> ConstEntry;
+
+  // forward iterator over the entries (a key and a reference to its value), adding or removing keys
+  // invalidates it. Persistent maps get their shared nodes copied by begin() so writing to a value
+  // doesn't change the other copies, on a const map it only reads and leaves them shared
+  template <bool Const>
+  class Iterator {
+    typedef typename std::conditional<Const, const ValueMap, ValueMap>::type Map;
+    typedef typename std::conditional<Const, ConstEntry, Entry>::type Item;
+    typedef typename std::conditional<Const, typename Entries::const_iterator, typename Entries::iterator>::type Hashed;
+    Map* map = 0;
+    size_t index = 0;
+    Hashed entries;
+    typename PersistentMap<K, T, H>::iterator persistentEntries;
+
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef Item value_type;
+    typedef Item reference;
+    typedef std::ptrdiff_t difference_type;
+    typedef void pointer;
+
+    Iterator() {}
+
+    // the slots of a shape first, then the hash map
+    Iterator(Map* map, bool end) : map(map) {
+      if (map->isPersistent) {
+        if (!end) persistentEntries = map->persistent.begin();
+      } else {
+        if (map->shape) index = end ? map->slots.size() : 0;
+        entries = end ? map->hashed.end() : map->hashed.begin();
+      }
     }
-    return this;
-  }
 
-  Value operator<<(const Value& other) const {
-    Value v = *this;
-    v <<= other;
-    return v;
-  }
+    Item operator* () const {
+      if (map->shape && index < map->slots.size()) return Item { map->shape->keys[index], map->slots[index] };
+      if (map->isPersistent) return Item { persistentEntries.key(), persistentEntries.value() };
+      return Item { entries->first, entries->second };
+    }
 
-  Value operator>>=(const Value& other) {
-    modify_linked()
-    if (IS_NUM(other) && (_ISNUMBER(type) || _ISBIGNUMBER(type))) {
-      *this = toLong() >> other.toLong();
+    Iterator& operator++ () {
+      if (map->shape && index < map->slots.size()) index++;
+      else if (map->isPersistent) ++persistentEntries;
+      else ++entries;
+      return *this;
     }
-    return this;
-  }
 
-  Value operator>>(const Value& other) const {
-    Value v = *this;
-    v >>= other;
-    return v;
-  }
+    Iterator operator++ (int) {
+      Iterator res = *this;
+      ++*this;
+      return res;
+    }
 
-  Value operator^=(const Value& other) {
-    modify_linked()
-    if (IS_NUM(other) && (_ISNUMBER(type) || _ISBIGNUMBER(type))) {
-      *this = toLong() ^ other.toLong();
+    bool operator== (const Iterator& other) const {
+      if (map == 0 || other.map == 0) return map == other.map;
+      if (map->shape) return index == other.index && entries == other.entries;
+      if (map->isPersistent) return persistentEntries == other.persistentEntries;
+      return entries == other.entries;
     }
-    return this;
+
+    bool operator!= (const Iterator& other) const {
+      return !(*this == other);
+    }
+  };
+  typedef Iterator<false> iterator;
+  typedef Iterator<true> const_iterator;
+
+  iterator begin() {
+    if (isPersistent) persistent.own();
+    return iterator(this, false);
   }
 
-  Value operator^(const Value& other) const {
-    Value v = *this;
-    v ^= other;
-    return v;
+  iterator end() {
+    return iterator(this, true);
   }
 
-  Value& operator+=(const Value& other) {
-    modify_linked()
-#ifndef USE_DOUBLE
-    if (_ISBIGNUMBER(type) && _ISBIGNUMBER(other.type)) {
-      *data.number += *other.data.number;
-    } else if (_ISNUMBER(type) && _ISNUMBER(other.type)) {
-      if (type != Types::SmallNumber) {
-        unsigned char digitCount = countDigits(data.smallNumber);
-        unsigned char otherDigitCount = countDigits(other.data.smallNumber);
-        bool limitExceed = digitCount + otherDigitCount > 14;
-        if ((data.smallNumber < 0) ^ (other.data.smallNumber < 0)) limitExceed = false; // one of the numbers is negative
-        if (limitExceed || digitCount > 8 || otherDigitCount > 8) {
-  #ifndef USE_BIG_NUMBER
-          NUMBER n = NUMBER(std::to_string(other.data.smallNumber));
-          data.number = new NUMBER(std::to_string(data.smallNumber));
-  #else
-          NUMBER n = NUMBER(other.toString().c_str());
-          data.number = new NUMBER(toString().c_str());
-  #endif
-          type = Types::BigNumber;
-          useCount = new USE_COUNT_TYPE; *useCount = 0;
-          *data.number += n;
-        } else {
-          goto addDoubles;
-        }
-      } else {
-        addDoubles:
-        data.smallNumber += other.toDouble();
-      }
-    } else if (_ISBIGNUMBER(type) && _ISNUMBER(other.type)) {
-#ifndef USE_BIG_NUMBER
-      NUMBER n = NUMBER(std::to_string(other.data.smallNumber));
-#else
-      NUMBER n = NUMBER(other.toString().c_str());
+  const_iterator begin() const {
+    return const_iterator(this, false);
+  }
+
+  const_iterator end() const {
+    return const_iterator(this, true);
+  }
+};
+#define MAP ValueMap<Value, Value, HashFunction>
 #endif
-      *data.number += n;
-    } else if (_ISNUMBER(type) && _ISBIGNUMBER(other.type)) {
-#ifndef USE_BIG_NUMBER
-      data.number = new NUMBER(std::to_string(data.smallNumber));
-#else
-      data.number = new NUMBER(toString().c_str());
+
+#ifndef MAX_FIXED_MAP_SIZE
+#define MAX_FIXED_MAP_SIZE MAX_FIXED_ARRAY_SIZE
 #endif
-      type = Types::BigNumber;
-      useCount = new USE_COUNT_TYPE; *useCount = 0;
-      *data.number += *other.data.number;
+
+class Value {
+private:
+  Value(Value* v) {
+    this->data = v->data;
+    this->type = v->type;
+    useCount = v->useCount;
+    _retain_value();
+  }
+  typedef union {
+#ifndef USE_DOUBLE
+    NUMBER* number;
+    double smallNumber;
 #else
-    if (_ISNUMBER(type) && _ISNUMBER(other.type)) {
-      data.number += other.data.number;
+    double number;
 #endif
-    } else if (_ISTEXT(type) || _ISTEXT(other.type)) { // If either a or b is text
-      if (_ISTEXT(type)) {
-        *data.text += other.toString();
-      } else {
-        _release_value()
-        useCount = new USE_COUNT_TYPE; *useCount = 0;
-        auto temp = data;
-        data.text = new TEXT(toString() + other.toString());
+    TEXT* text;
+    ARRAY* array;
+#ifdef USE_NOSTD_MAP
+    Array<Pair, MAX_FIXED_MAP_SIZE>* map;
+#else
+    MAP* map;
+#endif
+} Data;
+  Data data = Data(); // zeroed so moving a value that has no payload never copies garbage
+  Types type = Types::Null;
+  // the use count of frozen payloads (see freeze()), it never changes: values holding it share the
+  // payload without owning it
+  static USE_COUNT_TYPE* frozenCount() {
+    static USE_COUNT_TYPE count = 0;
+    return &count;
+  }
+public:
+  USE_COUNT_TYPE* useCount = 0;
+  bool copyBeforeModification = false;
+  bool modified = false; // since the array or map holding it last wrote it in toCachedString()
+  void clone() {
+    bool frozen = useCount == frozenCount();
+    if (type != Types::Symbol && !frozen && (useCount == 0 || *useCount == 0)) return; // nothing else uses this payload
+    _count_stat(clones, 1);
+    _trace_scope("clone", type, length());
+    if (_ISTEXT(type)) {
+      TEXT* t = new TEXT(*data.text);
+      _count_stat(allocations[(int) Types::Text], 1);
+      _count_stat(bytesCloned, sizeof(TEXT) + t->length());
+      data.text = t;
+      if (type == Types::Symbol) type = Types::Text;
+      else if (!frozen) (*useCount) --;
+      useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+    } 
 #ifndef USE_DOUBLE
-        if (_ISBIGNUMBER(type)) delete temp.number;
+    else if (_ISBIGNUMBER(type)) {
+      NUMBER* t = new NUMBER(*data.number);
+      _count_stat(allocations[(int) Types::BigNumber], 1);
+      _count_stat(bytesCloned, sizeof(NUMBER));
+      data.number = t;
+      if (!frozen) (*useCount) --;
+      useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+    }
 #endif
-        if (_ISARR(type)) delete temp.array;
-        if (_ISMAP(type)) delete temp.map;
-        type = Types::Text;
-      }
+    else if (_ISARR(type)) {
+      ARRAY* t = new ARRAY(*data.array);
+      _count_stat(allocations[(int) Types::Array], 1);
+      _count_stat(bytesCloned, sizeof(ARRAY) + (t->isPersistent || t->isView ? 0 : t->size() * (t->isPacked ? sizeof(double) : sizeof(Value))));
+      if (!frozen) (*useCount) --;
+#if !defined(USE_ARDUINO_ARRAY) && !defined(USE_NOSTD_MAP)
+      t->buffered = false;
+      if (!frozen) bufferPossibleCycle();
+#endif
+      data.array = t;
+      useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+#if !defined(USE_ARDUINO_ARRAY) && defined(VECTOR_RESERVED_SIZE)
+      data.array->reserve(VECTOR_RESERVED_SIZE);
+#endif
+    } else if (_ISMAP(type)) {
+#ifndef USE_NOSTD_MAP
+      MAP* t = new MAP(*data.map);
+      _count_stat(allocations[(int) Types::Map], 1);
+      _count_stat(bytesCloned, sizeof(MAP) + t->slots.size() * sizeof(Value) + (t->isPersistent ? 0 : t->hashEntries().size() * 2 * sizeof(Value)));
+      if (!frozen) (*useCount) --;
+#ifndef USE_ARDUINO_ARRAY
+      t->buffered = false;
+      if (!frozen) bufferPossibleCycle();
+#endif
+      data.map = t;
+#else
+      Array<Pair, MAX_FIXED_MAP_SIZE>* t = new Array<Pair, MAX_FIXED_MAP_SIZE>(*data.map);
+      _count_stat(allocations[(int) Types::Map], 1);
+      data.map = t; 
+      if (!frozen) (*useCount) --;
+#endif
+      useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
     }
-    return *this;
   }
 
-  Value operator+(const Value& other) const {
-    Value v = *this;
-    v += other;
-    return v;
+#ifndef USE_ARDUINO_ARRAY
+  // the text toCachedString() kept for this payload, and for the one holding this value, is out of date
+  inline void textChanged() {
+    modified = true;
+    if (_ISARR(type)) data.array->textCache.invalidate();
+#ifndef USE_NOSTD_MAP
+    else if (_ISMAP(type)) data.map->textCache.invalidate();
+#endif
   }
+#endif
 
-  Value& operator-=(const Value& other) {
-    modify_linked()
-#ifndef USE_DOUBLE
-    if (_ISBIGNUMBER(type) && _ISBIGNUMBER(other.type)) {
-      *data.number -= *other.data.number;
-    } else if (_ISNUMBER(type) && _ISNUMBER(other.type)) {
-      if (type != Types::SmallNumber) {
-        unsigned char digitCount = countDigits(data.smallNumber);
-        unsigned char otherDigitCount = countDigits(other.data.smallNumber);
-        bool limitExceed = digitCount + otherDigitCount > 14;
-        if ((data.smallNumber > 0) == (other.data.smallNumber > 0)) limitExceed = false; // both of the numbers have the same sign
-        if (limitExceed || digitCount > 8 || otherDigitCount > 8) {
-  #ifndef USE_BIG_NUMBER
-          NUMBER n = NUMBER(std::to_string(other.data.smallNumber));
-          data.number = new NUMBER(std::to_string(data.smallNumber));
-  #else
-          NUMBER n = NUMBER(other.toString().c_str());
-          data.number = new NUMBER(toString().c_str());
-  #endif
-          type = Types::BigNumber;
-          useCount = new USE_COUNT_TYPE; *useCount = 0;
-          *data.number -= n;
-        } else {
-          goto subDoubles;
-        }
-      } else {
-        subDoubles:
-        data.smallNumber -= other.toDouble();
+#if !defined(USE_ARDUINO_ARRAY) && !defined(USE_NOSTD_MAP)
+  friend class ValueCycleCollector;
+  // an array or map that lost a reference but is still used could be kept alive by nothing but a cycle
+  void bufferPossibleCycle();
+  static void forgetPossibleCycle(Types type, Data data);
+#endif
+
+  static void freeContainer(Types type, Data data) {
+    if (_ISARR(type)) {
+#ifdef USE_ARDUINO_ARRAY
+      for (short i = 0; i < data.array->size(); i++) {
+        free((*data.array)[i]);
       }
-    } else if (_ISBIGNUMBER(type) && _ISNUMBER(other.type)) {
-#ifndef USE_BIG_NUMBER
-      NUMBER n = NUMBER(std::to_string(other.data.smallNumber));
-#else
-      NUMBER n = NUMBER(other.toString().c_str());
 #endif
-      *data.number -= n;
-    } else if (_ISNUMBER(type) && _ISBIGNUMBER(other.type)) {
-#ifndef USE_BIG_NUMBER
-      data.number = new NUMBER(std::to_string(data.smallNumber));
-#else
-      data.number = new NUMBER(toString().c_str());
+#if !defined(USE_ARDUINO_ARRAY) && !defined(USE_NOSTD_MAP)
+      if (data.array->buffered) forgetPossibleCycle(type, data);
 #endif
-      type = Types::BigNumber;
-      useCount = new USE_COUNT_TYPE; *useCount = 0;
-      *data.number -= *other.data.number;
-#else
-    if (_ISNUMBER(type) && _ISNUMBER(other.type)) {
-      data.number -= other.data.number;
+      delete data.array;
+    } else {
+#if !defined(USE_ARDUINO_ARRAY) && !defined(USE_NOSTD_MAP)
+      if (data.map->buffered) forgetPossibleCycle(type, data);
 #endif
-    } else if (_ISTEXT(type) || _ISTEXT(other.type)) { // If either a or b is text
-      if (_ISTEXT(type)) {
-        *data.text = toString();
-      } else {
-        TEXT* t = new TEXT(toString());
-        freeUnusedMemory();
-        data.text = t;
+#ifdef USE_NOSTD_MAP
+      for (short i = 0; i < data.map->size(); i++) {
+        free((*data.map)[i].key);
+        free((*data.map)[i].value);
       }
-#ifndef USE_ARDUINO_STRING
-      TEXT t = other.toString();
-      int i = data.text->find(t);
-      if (i != -1) data.text->replace(i, t.length(), "");
-#else
-      data.text->replace(other.toString(), "");
 #endif
-      type = Types::Text;
+      delete data.map;
     }
-    return *this;
   }
 
-  Value operator-(const Value& other) const {
-    Value v = *this;
-    v -= other;
-    return v;
+#ifndef USE_ARDUINO_ARRAY
+  // arrays and maps that become unused while another one is being freed (its elements) are left
+  // here for the outermost freeUnusedMemory() to free them in a loop, so freeing a deep tree doesn't
+  // go deeper in the stack
+  struct PendingFrees {
+    bool freeing = false;
+    std::vector<std::pair<Types, Data> > payloads;
+  };
+
+  static PendingFrees& pendingFrees() {
+    static thread_local PendingFrees pending;
+    return pending;
   }
 
-  Value& operator*=(const Value& other) {
-    modify_linked()
-#ifndef USE_DOUBLE
-    if (_ISBIGNUMBER(type) && _ISBIGNUMBER(other.type)) {
-      *data.number *= *other.data.number;
-    } else if (_ISNUMBER(type) && _ISNUMBER(other.type)) {
-      if (type != Types::SmallNumber) {
-        unsigned char digitCount = countDigits(data.smallNumber);
-        unsigned char otherDigitCount = countDigits(other.data.smallNumber);
-        bool limitExceed = digitCount + otherDigitCount > 8;
-        double t = data.smallNumber, t2 = other.data.smallNumber;
-        t *= 1000; t2 *= 1000;
-        if (fmod(t, 1) != 0 || fmod(t2, 1) != 0) {
-          limitExceed = true;
-        } else if (::floor(data.smallNumber) == 0 || ::floor(other.data.smallNumber) == 0) {
-          limitExceed = false;
-        }
-        if (limitExceed || digitCount > 8 || otherDigitCount > 8) {
-  #ifndef USE_BIG_NUMBER
-          NUMBER n = NUMBER(std::to_string(other.data.smallNumber));
-          data.number = new NUMBER(std::to_string(data.smallNumber));
-  #else
-          NUMBER n = NUMBER(other.toString().c_str());
-          data.number = new NUMBER(toString().c_str());
-  #endif
-          type = Types::BigNumber;
-          useCount = new USE_COUNT_TYPE; *useCount = 0;
-          *data.number *= n;
-        } else {
-          goto multiplyDoubles;
+  // what memoryUsage() walks with, kept by every thread so that it allocates nothing once it has walked
+  // a value as big. seen is an open addressing table of the shared payloads found and their deep sizes
+  struct MemoryWalk {
+    struct Item {
+      const Value* value;
+      const void* payload; // closes a shared container, its elements got counted since start
+      size_t start;
+    };
+    std::vector<Item> stack;
+    std::vector<std::pair<const void*, size_t> > seen;
+    std::vector<size_t> used; // slots of seen in use
+
+    size_t slot(const void* p) const {
+      size_t mask = seen.size() - 1, i = (size_t) (((uintptr_t) p >> 4) * (size_t) 0x9E3779B97F4A7C15ULL) & mask;
+      while (seen[i].first && seen[i].first != p) i = (i + 1) & mask;
+      return i;
+    }
+
+    // the entry of p, added with the size (size_t) -1 (still being counted) unless found
+    std::pair<const void*, size_t>& get(const void* p, bool& found) {
+      if ((used.size() + 1) * 2 > seen.size()) {
+        std::vector<std::pair<const void*, size_t> > old(seen.empty() ? 64 : seen.size() * 2);
+        old.swap(seen);
+        used.clear();
+        for (size_t i = 0; i < old.size(); i++) {
+          if (old[i].first == 0) continue;
+          size_t j = slot(old[i].first);
+          seen[j] = old[i];
+          used.push_back(j);
         }
-      } else {
-        multiplyDoubles:
-        data.smallNumber *= other.toDouble();
       }
-    } else if (_ISBIGNUMBER(type) && _ISNUMBER(other.type)) {
-#ifndef USE_BIG_NUMBER
-      NUMBER n = NUMBER(std::to_string(other.data.smallNumber));
-#else
-      NUMBER n = NUMBER(other.toString().c_str());
-#endif
-      *data.number *= n;
-    } else if (_ISNUMBER(type) && _ISBIGNUMBER(other.type)) {
-#ifndef USE_BIG_NUMBER
-      data.number = new NUMBER(std::to_string(data.smallNumber));
-#else
-      data.number = new NUMBER(toString().c_str());
+      size_t i = slot(p);
+      found = seen[i].first != 0;
+      if (!found) {
+        seen[i] = std::make_pair(p, (size_t) -1);
+        used.push_back(i);
+      }
+      return seen[i];
+    }
+
+    void reset() {
+      for (size_t i = 0; i < used.size(); i++) seen[used[i]].first = 0;
+      used.clear();
+      stack.clear();
+    }
+  };
+
+  static MemoryWalk& memoryWalk() {
+    static thread_local MemoryWalk walk;
+    return walk;
+  }
 #endif
-      type = Types::BigNumber;
-      useCount = new USE_COUNT_TYPE; *useCount = 0;
-      *data.number *= *other.data.number;
+
+  // free unused pointers
+  void freeUnusedMemory() {
+    if (useCount == frozenCount()) { // the snapshot holding the frozen value frees it
+      useCount = 0;
+      return;
+    }
+#if !defined(USE_ARDUINO_ARRAY) && !defined(USE_NOSTD_MAP)
+    _release_value(bufferPossibleCycle(); useCount = 0; return)
 #else
-    if (_ISNUMBER(type) && _ISNUMBER(other.type)) {
-      data.number *= other.data.number;
+    _release_value(useCount = 0; return)
 #endif
-    } else if (_ISTEXT(type) && _ISBIGNUMBER(other.type)) {
-#ifndef USE_ARDUINO_STRING
-      std::ostringstream os;
-      for (NUMBER i = 0; i < 
+    if (_ISTEXT(type) && data.text != 0 && type != Types::Symbol) {
+      delete data.text;
+      data.text = 0;
+    } 
 #ifndef USE_DOUBLE
-      *other.data.number
-#else
-      other.data.number
+    else if (_ISBIGNUMBER(type) && data.number != 0) {
+      delete data.number;
+      data.number = 0;
+    }
 #endif
-      ; i++) {
-        os << toString();
-      }
-      *data.text = os.str();
-#else
-      String s;
-      for (NUMBER i = 0; i < 
-#ifndef USE_DOUBLE
-      *other.data.number
+    else if ((_ISARR(type) && data.array != 0) || (_ISMAP(type) && data.map != 0)) {
+#ifdef USE_ARDUINO_ARRAY
+      freeContainer(type, data);
 #else
-      other.data.number
-#endif
-      ; i++) {
-        s += toString();
+      PendingFrees& pending = pendingFrees();
+      if (pending.freeing) {
+        pending.payloads.push_back(std::make_pair(type, data));
+      } else {
+        pending.freeing = true;
+        freeContainer(type, data);
+        while (!pending.payloads.empty()) {
+          std::pair<Types, Data> p = pending.payloads.back();
+          pending.payloads.pop_back();
+          freeContainer(p.first, p.second);
+        }
+        pending.freeing = false;
       }
-      *data.text = s;
 #endif
-    } else if (_ISBIGNUMBER(type) && _ISTEXT(other.type)) {
-#ifndef USE_ARDUINO_STRING
-      std::ostringstream os;
-      for (NUMBER i = 0; i < 
-#ifndef USE_DOUBLE
-      *data.number
-#else
-      data.number
+      if (_ISARR(type)) data.array = 0;
+      else data.map = 0;
+    }
+  }
+  Value () { type = Types::Null; }
+  Value (bool b) {
+    if (b) type = Types::True;
+    else type = Types::False;
+  }
+  Value (Types t) {
+#if !defined(USE_ARDUINO_ARRAY) && !defined(USE_NOSTD_MAP) && CYCLE_COLLECT_THRESHOLD > 0
+    if (t == Types::Array || t == Types::Map) collectCyclesIfNeeded();
 #endif
-      ; i++) {
-        os << other.toString();
-      }
-      freeUnusedMemory();
-      type = Types::Text;
-      data.text = new TEXT(os.str());
-#else
-      String s;
-      for (NUMBER i = 0; i < 
-#ifndef USE_DOUBLE
-      *data.number
+    if (t == Types::Array) {
+      useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+      data.array = new ARRAY();
+      _count_stat(allocations[(int) Types::Array], 1);
+#if !defined(USE_ARDUINO_ARRAY) && defined(VECTOR_RESERVED_SIZE)
+      data.array->reserve(VECTOR_RESERVED_SIZE);
+#endif
+    } else if (t == Types::Map) {
+      useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+#ifdef USE_NOSTD_MAP
+      data.map = new Array<Pair, MAX_FIXED_MAP_SIZE>();
+      _count_stat(allocations[(int) Types::Map], 1);
 #else
-      data.number
+      data.map = new MAP();
+      _count_stat(allocations[(int) Types::Map], 1);
 #endif
-      ; i++) {
-        s += other.toString();
-      }
-      freeUnusedMemory();
-      type = Types::Text;
-      data.text = new TEXT(s);
+    }
+    type = t;
+  }
+#ifndef USE_DOUBLE
+  Value (const NUMBER& n) {
+    this->data.number = new NUMBER(n);
+    _count_stat(allocations[(int) Types::BigNumber], 1);
+    type = Types::BigNumber;
+    useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+  }
 #endif
-    } else if (_ISTEXT(type) && _ISNUMBER(other.type)) {
-#ifndef USE_ARDUINO_STRING
-      std::ostringstream os;
-      for (long i = 0; i < 
+  Value (int n) {
 #ifndef USE_DOUBLE
-      other.data.smallNumber
+    this->data.smallNumber = n;
 #else
-      other.data.number
+    this->data.number = n;
 #endif
-      ; i++) {
-        os << toString();
-      }
-      *data.text = os.str();
+    type = Types::Number;
+  }
+  Value (double n) {
+#ifndef USE_DOUBLE
+    this->data.smallNumber = n;
 #else
-      String s;
-      for (long i = 0; i < 
+    this->data.number = n;
+#endif
+    type = Types::Number;
+  }
+  Value (long n) {
 #ifndef USE_DOUBLE
-      other.data.smallNumber
+    this->data.smallNumber = n;
 #else
-      other.data.number
+    this->data.number = n;
 #endif
-      ; i++) {
-        s += toString();
-      }
-      *data.text = s;
+    type = Types::Number;
+  }
+  Value (const TEXT& s) {
+    data.text = new TEXT(s);
+    _count_stat(allocations[(int) Types::Text], 1);
+    type = Types::Text;
+    useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+  }
+  Value (const char* s) {
+    data.text = new TEXT(s);
+    _count_stat(allocations[(int) Types::Text], 1);
+    type = Types::Text;
+    useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+  }
+  Value (Value&& v) noexcept : data(v.data), type(v.type), useCount(v.useCount), copyBeforeModification(v.copyBeforeModification) {
+    v.useCount = 0;
+    v.type = Types::Null;
+  }
+  Value (const Value& v) {
+    data = v.data;
+    type = v.type;
+    copyBeforeModification = true;
+    useCount = v.useCount;
+    _retain_value();
+  }
+  Value (Data data, Types type, USE_COUNT_TYPE* useCount): data(data), type(type), useCount(useCount) {
+    _retain_value();
+  }
+  // free unused pointers when the object is destructing
+  ~Value () {
+    freeUnusedMemory();
+  }
+
+  void operator= (const Value& v) {
+    modified = true;
+    freeUnusedMemory();
+    data = v.data;
+    type = v.type;
+    copyBeforeModification = true;
+    useCount = v.useCount;
+    _retain_value();
+  }
+
+  // like assigning a copy, but without the use count going up and back down: a temporary that shared
+  // its payload through be() doesn't make this value modify that payload in place
+  void operator= (Value&& v) {
+    modified = true;
+    if (this == &v) return;
+    freeUnusedMemory();
+    data = v.data;
+    type = v.type;
+    copyBeforeModification = true;
+    useCount = v.useCount;
+    v.useCount = 0;
+    v.type = Types::Null;
+  }
+
+  void be(Value* v) {
+    modified = true;
+    freeUnusedMemory();
+    data = v->data;
+    type = v->type;
+    useCount = v->useCount;
+    _retain_value();
+    copyBeforeModification = false;
+  }
+
+  void operator= (bool v) {
+    modified = true;
+    freeUnusedMemory();
+    if (v) type = Types::True;
+    else type = Types::False;
+    copyBeforeModification = false;
+  }
+
+  void operator= (Types t) {
+    modified = true;
+    freeUnusedMemory();
+    copyBeforeModification = false;
+    if (t == Types::Array) {
+      useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+      data.array = new ARRAY();
+      _count_stat(allocations[(int) Types::Array], 1);
+#if !defined(USE_ARDUINO_ARRAY) && defined(VECTOR_RESERVED_SIZE)
+      data.array->reserve(VECTOR_RESERVED_SIZE);
 #endif
-    } else if (_ISBIGNUMBER(type) && _ISTEXT(other.type)) {
-#ifndef USE_ARDUINO_STRING
-      std::ostringstream os;
-      for (NUMBER i = 0; i < 
+    } else if (t == Types::Map) {
+      useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+#ifdef USE_NOSTD_MAP
+      data.map = new Array<Pair, MAX_FIXED_MAP_SIZE>();
+      _count_stat(allocations[(int) Types::Map], 1);
+#else
+      data.map = new MAP();
+      _count_stat(allocations[(int) Types::Map], 1);
+#endif
+    }
+    type = t;
+  }
+
+  void operator= (int n) {
+    modified = true;
+    freeUnusedMemory();
+    copyBeforeModification = false;
 #ifndef USE_DOUBLE
-      *data.number
+    this->data.smallNumber = n;
 #else
-      data.number
+    this->data.number = n;
 #endif
-      ; i++) {
-        os << other.toString();
-      }
-      freeUnusedMemory();
-      type = Types::Text;
-      data.text = new TEXT(os.str());
+    type = Types::Number;
+  }
+
+  void operator= (long n) {
+    modified = true;
+    freeUnusedMemory();
+    copyBeforeModification = false;
+#ifndef USE_DOUBLE
+    this->data.smallNumber = n;
 #else
-      String s;
-      for (NUMBER i = 0; i < 
+    this->data.number = n;
+#endif
+    type = Types::Number;
+  }
+
+  void operator= (double n) {
+    modified = true;
+    freeUnusedMemory();
+    copyBeforeModification = false;
 #ifndef USE_DOUBLE
-      *data.number
+    this->data.smallNumber = n;
 #else
-      data.number
+    this->data.number = n;
 #endif
-      ; i++) {
-        s += other.toString();
-      }
-      freeUnusedMemory();
-      type = Types::Text;
-      data.text = new TEXT(s);
+    type = Types::Number;
+  }
+
+  void operator= (const TEXT& t) {
+    modified = true;
+    if (type == Types::Text && !copyBeforeModification) {
+      *data.text = t;
+      return;
+    }
+    freeUnusedMemory();
+    copyBeforeModification = false;
+    this->data.text = new TEXT(t);
+    _count_stat(allocations[(int) Types::Text], 1);
+    type = Types::Text;
+    useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+  }
+
+  void operator= (const char* t) {
+    modified = true;
+    if (type == Types::Text && !copyBeforeModification) {
+      *data.text = t;
+      return;
+    }
+    freeUnusedMemory();
+    copyBeforeModification = false;
+    this->data.text = new TEXT(t);
+    _count_stat(allocations[(int) Types::Text], 1);
+    type = Types::Text;
+    useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+  }
+
+#ifndef USE_DOUBLE
+  void operator= (const NUMBER& n) {
+    modified = true;
+    if (type == Types::BigNumber && !copyBeforeModification) {
+      *data.number = n;
+      return;
+    }
+    freeUnusedMemory();
+    copyBeforeModification = false;
+    this->data.number = new NUMBER(n);
+    _count_stat(allocations[(int) Types::BigNumber], 1);
+    type = Types::BigNumber;
+    useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+  }
 #endif
+
+  void append(const Value& v, bool _clone = true) {
+    modify_linked()
+#ifdef USE_ARDUINO_ARRAY
+    Value* value = new Value(v.data, v.type, v.useCount);
+    data.array->push_back(value);
+    (*data.array)[data.array->size() - 1]->copyBeforeModification = _clone;
+#else
+    if (data.array->isPersistent) {
+      data.array->persistent.push_back(Value(v.data, v.type, v.useCount)).copyBeforeModification = _clone;
+      return;
     }
-    return *this;
+    if (data.array->isPacked) {
+      if (v.type == Types::Number) {
+        data.array->packed.push_back(v.toDouble());
+        return;
+      }
+      data.array->unpack();
+    }
+    data.array->emplace_back(v.data, v.type, v.useCount);
+    (*data.array)[data.array->size() - 1].copyBeforeModification = _clone;
+#endif
   }
 
-  Value operator*(const Value& other) const {
-    Value v = *this;
-    v *= other;
-    return v;
+#ifndef USE_ARDUINO_ARRAY
+private:
+  // room for n more elements, at least doubling the capacity so that many small additions stay amortized
+  template <class Vector>
+  static void grow(Vector& v, size_t n) {
+    size_t size = v.size() + n;
+    if (v.capacity() < size) v.reserve(size > 2 * v.capacity() ? size : 2 * v.capacity());
   }
 
-  Value& operator/=(const Value& other) {
+public:
+#endif
+  // room for n elements (or entries of a map) without reallocating, unlike VECTOR_RESERVED_SIZE it is
+  // just for this value
+  void reserve(size_t n) {
     modify_linked()
-#ifndef USE_DOUBLE
-    if (_ISBIGNUMBER(type) && _ISBIGNUMBER(other.type)) {
-      *data.number /= *other.data.number;
-    } else if (_ISNUMBER(type) && _ISNUMBER(other.type)) {
-      if (type != Types::SmallNumber) {
-        bool limitExceed = false;
-        unsigned char otherDigitCount = countDigits(other.data.smallNumber);
-        unsigned char digitCount = countDigits(data.smallNumber);
-        if (digitCount > 8 || otherDigitCount > 8) {
-          limitExceed = true;
-        } else {
-          double t = data.smallNumber, t2 = other.data.smallNumber;
-          t *= 1000; t2 *= 1000;
-          if (fmod(t, 1) != 0 || fmod(t2, 1) != 0) {
-            limitExceed = true;
-          } else if (fmod(data.smallNumber, 1) != 0) {
-            if (otherDigitCount + 3 > 9) {
-              limitExceed = true;
+#ifndef USE_ARDUINO_ARRAY
+    if (_ISARR(type)) data.array->reserve(n);
+#endif
+#ifndef USE_NOSTD_MAP
+    if (_ISMAP(type)) data.map->reserve(n);
+#endif
+  }
+
+  // gives back the room reserved beyond the current size
+  void shrinkToFit() {
+    modify_linked()
+#ifndef USE_ARDUINO_ARRAY
+    if (_ISARR(type)) data.array->shrinkToFit();
+#endif
+#ifndef USE_NOSTD_MAP
+    if (_ISMAP(type)) data.map->shrinkToFit();
+#endif
+  }
+
+  // appends every element of another array, the room for them is reserved once
+  void extend(const Value& other, bool _clone = true) {
+    if (!_ISARR(other.type)) return;
+    modify_linked()
+    if (!_ISARR(type)) return;
+#ifdef USE_ARDUINO_ARRAY
+    size_t n = other.data.array->size();
+    for (size_t i = 0; i < n; i++) append(*(*other.data.array)[i], _clone);
+#else
+    ARRAY& a = *data.array;
+    const ARRAY* source = other.data.array;
+    ARRAY self;
+    if (source == &a) { // extending an array with itself
+      self = a;
+      source = &self;
+    }
+    size_t n = source->size();
+    if (a.isPersistent) {
+      for (size_t i = 0; i < n; i++) {
+        a.persistent.push_back(source->element(i)).copyBeforeModification = _clone;
+      }
+      return;
+    }
+    if (a.isPacked) {
+      const double* numbers;
+      std::vector<double> buffer;
+      if (source->numbers(numbers, buffer)) {
+        grow(a.packed, n);
+        a.packed.insert(a.packed.end(), numbers, numbers + n);
+        return;
+      }
+      a.unpack();
+    }
+    grow(a, n);
+    for (size_t i = 0; i < n; i++) {
+      if (source->isPacked) {
+        a.emplace_back(source->packed[i]);
+      } else {
+        const Value& v = source->item(i);
+        a.emplace_back(v.data, v.type, v.useCount);
+        a.back().copyBeforeModification = _clone;
+      }
+    }
+#endif
+  }
+
+#ifndef USE_ARDUINO_ARRAY
+  // the elements of an array nothing else uses are moved instead of shared
+  void extend(Value&& other) {
+    if (this == &other || !_ISARR(other.type) || other.isFrozen() || *other.useCount != 0 || other.data.array->isPacked
+        || other.data.array->isPersistent || other.data.array->isView) {
+      extend(static_cast<const Value&>(other));
+      return;
+    }
+    modify_linked()
+    if (!_ISARR(type)) return;
+    ARRAY& a = *data.array;
+    ARRAY& source = *other.data.array;
+    if (a.isPersistent) {
+      for (size_t i = 0; i < source.size(); i++) a.persistent.push_back(static_cast<Value&&>(source[i]));
+    } else {
+      a.unpack();
+      grow(a, source.size());
+      for (size_t i = 0; i < source.size(); i++) a.emplace_back(static_cast<Value&&>(source[i]));
+    }
+    source.clear();
+  }
+
+  // appends the values from first to last (a forward range, moved in with move iterators)
+  template <class Iterator>
+  void extend(Iterator first, Iterator last) {
+    modify_linked()
+    if (!_ISARR(type)) return;
+    ARRAY& a = *data.array;
+    if (a.isPersistent) {
+      for (; first != last; ++first) a.persistent.push_back(Value(*first));
+      return;
+    }
+    size_t n = std::distance(first, last);
+    if (a.isPacked) grow(a.packed, n);
+    else grow(a, n);
+    for (; first != last; ++first) {
+      if (a.isPacked) {
+        if ((*first).type == Types::Number) {
+          a.packed.push_back((*first).toDouble());
+          continue;
+        }
+        a.unpack();
+        grow(a, n);
+      }
+      a.emplace_back(*first);
+    }
+  }
+#endif
+
+  // puts every entry of another map, the room for them is reserved once
+  void putAll(const Value& other) {
+    if (!_ISMAP(other.type)) return;
+    modify_linked()
+    if (!_ISMAP(type) || data.map == other.data.map) return;
+#ifndef USE_NOSTD_MAP
+    MAP& m = *data.map;
+    m.reserve(m.size() + other.data.map->size());
+    other.data.map->forEach([&m] (const Value& k, const Value& v) {
+      m[k].be((Value*) &v);
+      return true;
+    });
+#else
+    size_t n = other.data.map->size();
+    for (size_t i = 0; i < n; i++) put(*(*other.data.map)[i].key, *(*other.data.map)[i].value);
+#endif
+  }
+
+  void remove(size_t i, size_t n) {
+    modify_linked()
+#ifdef USE_ARDUINO_ARRAY
+    for (; n > i; n--) {
+      delete (*data.array)[i];
+      data.array->remove(i);
+    }
+#else
+    data.array->flatten();
+    if (data.array->isPacked) {
+      data.array->packed.erase(data.array->packed.begin() + i, data.array->packed.begin() + n);
+      return;
+    }
+    data.array->erase(data.array->begin() + i, data.array->begin() + n);
+#endif
+  }
+
+  void remove(size_t i) {
+    modify_linked()
+#ifdef USE_ARDUINO_ARRAY
+    delete (*data.array)[i];
+    data.array->remove(i);
+#else
+    data.array->flatten();
+    if (data.array->isPacked) {
+      data.array->packed.erase(data.array->packed.begin() + i);
+      return;
+    }
+    data.array->erase(data.array->begin() + i);
+#endif
+  }
+
+  void remove(const Value& i) {
+    modify_linked()
+    if (_ISARR(type)) {
+#ifdef USE_ARDUINO_ARRAY
+      data.array->remove((long) i);
+#else
+      data.array->flatten();
+      if (data.array->isPacked) {
+        data.array->packed.erase(data.array->packed.begin() + (long) i);
+      } else {
+        data.array->erase(data.array->begin() + (long) i);
+      }
+#endif
+    } else if (_ISMAP(type)) {
+#ifdef USE_NOSTD_MAP
+      for (int j = 0; j < data.map->size(); j++) {
+        if (*(*data.map)[j].key == i) {
+          data.map->remove((long) j);
+        }
+      }
+#else
+      data.map->erase(i);
+#endif
+    }
+  }
+
+  void clear() {
+    modify_linked()
+    if (_ISARR(type)) {
+      data.array->clear();
+    } else if (_ISTEXT(type)) {
+      *data.text = "";
+    }
+  }
+
+  NUMBER getNumber() const {
+    if (_ISNUMBER(type)) {
+#ifdef USE_DOUBLE
+      return data.number;
+#else
+      return data.smallNumber;
+    } else if (_ISBIGNUMBER(type)) {
+      return *data.number;
+#endif
+    }
+    return 0;
+  }
+
+  Value pop() {
+    modify_linked()
+    if (_ISARR(type)) {
+#ifdef USE_ARDUINO_ARRAY
+      Value* v = (*data.array)[data.array->size() - 1];
+      Value res(v->data, v->type, v->useCount);
+      delete v;
+#else
+      if (data.array->isPersistent) {
+        const Value& v = data.array->persistent[data.array->size() - 1];
+        Value res(v.data, v.type, v.useCount);
+        data.array->persistent.pop_back();
+        return res;
+      }
+      if (data.array->isPacked) {
+        Value res(data.array->packed.back());
+        data.array->packed.pop_back();
+        return res;
+      }
+      Value& v = (*data.array)[data.array->size() - 1];
+      Value res(v.data, v.type, v.useCount);
+#endif
+      data.array->pop_back();
+      return res;
+    } else if (_ISTEXT(type)) {
+#ifdef USE_ARDUINO_STRING
+      size_t s = data.text->length() - 1;
+      char t = data.text->charAt(s);
+      data.text->remove(s);
+      return TEXT(t);
+#else
+      char t = (*data.text)[data.text->size() - 1];
+      data.text->pop_back();
+      return TEXT("") + t;
+#endif
+    }
+    return Types::Null;
+  }
+
+  void _pop() {
+    modify_linked()
+    if (_ISARR(type)) {
+#ifdef USE_ARDUINO_ARRAY
+      Value* v = (*data.array)[data.array->size() - 1];
+      delete v;
+#else
+      if (data.array->isPersistent) {
+        data.array->persistent.pop_back();
+        return;
+      }
+      if (data.array->isPacked) {
+        data.array->packed.pop_back();
+        return;
+      }
+#endif
+      data.array->pop_back();
+    } else if (_ISTEXT(type)) {
+#ifdef USE_ARDUINO_STRING
+      size_t s = data.text->length() - 1;
+      data.text->remove(s);
+#else
+      data.text->pop_back();
+#endif
+    }
+  }
+
+  // symbols are texts for everything outside of Value
+  inline Types getType() const {
+    return type == Types::Symbol ? Types::Text : type;
+  }
+
+  inline bool isSymbol() const {
+    return type == Types::Symbol;
+  }
+
+  // part of a value published by a ValueSnapshot: it is read only, copies of it share its payload
+  // without changing a use count and clone it before they get modified
+  inline bool isFrozen() const {
+    return useCount == frozenCount();
+  }
+
+  inline void setType(Types t) {
+    type = t;
+  }
+
+  inline Data getData() const {
+    return data;
+  }
+
+  // keeps an array or a map in a persistent representation (a radix balanced trie for arrays and a hash
+  // array mapped trie for maps), copies of it share every part that hasn't been modified since, so
+  // copying and then modifying a big array or map costs O(log n) instead of O(n). Maps stay persistent,
+  // arrays go back to a vector for anything other than append(), pop(), set(), [], length(), indexOf() and
+  // reading
+  void persist() {
+#ifndef USE_ARDUINO_ARRAY
+    if (_ISARR(type)) data.array->persist();
+#endif
+#ifndef USE_NOSTD_MAP
+    if (_ISMAP(type)) data.map->persist();
+#endif
+  }
+
+  bool isPersistent() const {
+#ifndef USE_ARDUINO_ARRAY
+    if (_ISARR(type)) return data.array->isPersistent;
+#endif
+#ifndef USE_NOSTD_MAP
+    if (_ISMAP(type)) return data.map->isPersistent;
+#endif
+    return false;
+  }
+
+#ifndef USE_NOSTD_MAP
+  // makes this value and everything inside it share the payloads (texts, BigNumbers, arrays and maps)
+  // of equal values interned before instead of holding copies of their own. Those payloads are only
+  // copied before modifications that go through copyBeforeModification, writing to an element through
+  // operator[] or begin() doesn't, so an interned array or map has to be modified with set(), put(),
+  // append() and the like
+  void intern();
+  void intern(ValueInternTable& table);
+
+  // the symbol holding the same text as this one (created the first time), looking map keys up with
+  // it hashes nothing and compares pointers with the keys of shapes (which are symbols) and of hash
+  // maps built with USE_SYMBOL_KEYS (where every text key becomes a symbol when it is added). Maps
+  // get a shape from the symbol keys put into them. Symbols are never freed and modifying one turns it
+  // into a plain text first
+  static Value symbol(const Value& text);
+
+  // bytes held by the payload of this value itself, not by its elements (texts and vectors by their
+  // capacity, hash maps by their buckets and nodes, big numbers by their limbs, and the use count)
+  size_t payloadMemory() const;
+#endif
+
+#if !defined(USE_ARDUINO_ARRAY) && !defined(USE_NOSTD_MAP)
+  // bytes held by this value and everything inside it. A payload found more than once counts every
+  // time (what a deep copy would take) unless sharedOnce, then it counts once (what the value holds
+  // along with the other values sharing its payloads). A container found inside itself counts once.
+  // Takes linear time and allocates nothing once the thread has walked a value as big
+  size_t memoryUsage(bool sharedOnce = false) const;
+
+  // a copy with payloads of its own all the way down (symbols stay shared, they have no use count),
+  // reading this value changes none of its use counts so several threads can copy it at once
+  Value deepCopy() const;
+
+  // the changes that turn from into to, an array of operations for apply() to make in order. Each one
+  // is a map with the "op" and the "path" (keys and indexes) to what it changes, an empty path is the
+  // value itself:
+  //   replace  path, value             sets what is at path to value
+  //   insert   path, values            inserts the elements of values into an array before index path[-1]
+  //   insert   path, value             puts key path[-1] into a map
+  //   remove   path, count             removes count elements of an array starting at index path[-1]
+  //   remove   path                    removes key path[-1] of a map
+  //   splice   path, at, count, text   replaces count characters of a text starting at at with text
+  // Payloads both values share (the same use count) are skipped without looking inside them, and only
+  // the elements between the common start and the common end of two arrays are compared pairwise
+  static Value diff(const Value& from, const Value& to);
+  void apply(const Value& patch);
+
+private:
+  // the same payload, a use count belongs to a single one (but every frozen payload has the same)
+  static bool samePayload(const Value& a, const Value& b) {
+    return a.useCount != 0 && a.useCount == b.useCount && (a.useCount != frozenCount() || a.data.text == b.data.text);
+  }
+
+  // what k leads to, to be modified in place (this payload gets cloned first if it is shared)
+  Value& child(const Value& k) {
+    modify_linked()
+    return (*this)[k];
+  }
+
+  void insertAll(size_t at, const Value& values) {
+    modify_linked()
+    if (!_ISARR(type) || !_ISARR(values.type)) return;
+    ARRAY& a = *data.array;
+    ARRAY source = *values.data.array; // values could be inside this array
+    a.flatten();
+    a.unpack();
+    a.insert(a.begin() + at, source.size(), Value());
+    for (size_t i = 0; i < source.size(); i++) a[at + i] = source.element(i);
+  }
+
+  void splice(size_t at, size_t count, const Value& text) {
+    modify_linked()
+    if (!_ISTEXT(type) || !_ISTEXT(text.type)) return;
+#ifdef USE_ARDUINO_STRING
+    *data.text = data.text->substring(0, at) + *text.data.text + data.text->substring(at + count);
+#else
+    data.text->replace(at, count, *text.data.text);
+#endif
+  }
+
+  template <class T> friend class ValueSnapshot;
+  // a deep copy where every payload is frozen, nothing frees it until thaw() gives its payloads back
+  // to it (once no thread reads it anymore)
+  Value freeze() const;
+  static void thaw(Value& v);
+  template <class F>
+  static void forEachOwned(Value& v, F fn);
+
+public:
+
+  // frees the arrays and maps that nothing but reference cycles among themselves keep alive (made with
+  // append(v, false), be() or by adding a value to itself), returns how many got freed. It only finds
+  // the cycles that lost their last outside reference while detectCycles() was on
+  static size_t collectCycles();
+
+  // keeps the arrays and maps that lose a reference as possible roots of cycles for collectCycles(),
+  // off by default since that takes the collector's lock (with USE_THREADS) on every copy and release
+  // of an array or map. To be switched before other threads use values
+  static void detectCycles(bool on = true);
+#if CYCLE_COLLECT_THRESHOLD > 0
+  static void collectCyclesIfNeeded();
+#endif
+#endif
+
+#ifdef USE_STATS
+  // what the values of every thread did so far (allocations, clones, promotions to big numbers and
+  // rehashes), threadStats() is what the calling thread did
+  static ValueStats stats() {
+    return ValueStatistics::instance().snapshot();
+  }
+
+  static ValueStats threadStats() {
+    ValueStats res;
+    res.add(ValueStatistics::local());
+    return res;
+  }
+#endif
+
+  void put(const Value& k, const Value& v) {
+    modify_linked()
+    if (_ISMAP(type)) {
+#ifndef USE_NOSTD_MAP
+      (*data.map)[k].be((Value*) &v);
+#else
+      Pair p;
+      Value* value = new Value();
+      *value = v;
+      Value* key = new Value();
+      *key = k;
+      p.key = key;
+      p.value = value;
+      data.map->push_back(p);
+#endif
+    }
+  }
+
+  Value& get(const Value& k) const;
+
+#ifndef USE_NOSTD_MAP
+  Value& get(const Value& k, ValueKeyCache& cache) const;
+#endif
+
+  void set(const Value& i, const Value& v) {
+    modify_linked()
+    if (_ISMAP(type)) {
+      put(i, v);
+    } else if (_ISARR(type)) {
+#ifdef USE_ARDUINO_ARRAY
+      Value* value = new Value();
+      *value = v;
+      long l = i;
+      Value* n = new Value();
+      while (data.array->size() < (l + 1)) {
+        data.array->push_back(n);
+      }
+      (*data.array)[l] = value;
+#else
+      long l = i;
+      if (data.array->isPersistent && l >= 0 && (size_t) l < data.array->size()) {
+        data.array->persistent.ref(l) = v;
+        return;
+      }
+      data.array->flatten();
+      if (data.array->isPacked) {
+        if (v.type == Types::Number && l >= 0 && (size_t) l < data.array->size()) {
+          data.array->packed[l] = v.toDouble();
+          return;
+        }
+        data.array->unpack();
+      }
+      if (data.array->size() < (l + 1)) data.array->resize(l + 1);
+      (*data.array)[l] = v;
+#endif
+    } else if (_ISTEXT(type) && _ISTEXT(v.type)) {
+#ifdef USE_ARDUINO_STRING
+      long x = i;
+      String s = v.toString();
+      for (long j = x; j < x + v.length(); j++) {
+        data.text->setCharAt(j, s[j - x]);
+      }
+#else
+      data.text->replace((long) i, v.length(), v.toString());
+#endif
+    }
+  }
+
+  void insert(Value i, Value v) {
+    modify_linked()
+    if (_ISARR(type)) {
+#ifdef USE_ARDUINO_ARRAY
+      long l = i;
+      if (l < data.array->size()) {
+        Value* value = new Value();
+        *value = v;
+        Value** p = data.array->data();
+        ARRAY* tmp = new ARRAY();
+        _count_stat(allocations[(int) Types::Array], 1);
+        while (tmp->size() < data.array->size() + 1) {
+          tmp->push_back(0);
+        }
+        memcpy(tmp->data(), p, l + 1);
+        memcpy(tmp->data() + l + 1, p + l, (data.array->size()) - l + 2);
+        (*tmp)[l] = value;
+        delete data.array;
+        data.array = tmp;
+      } else {
+        set(i, v);
+      }
+#else
+      long l = i;
+      if (data.array->isPersistent && l >= 0 && (size_t) l == data.array->size()) {
+        data.array->persistent.push_back(Value(v));
+        return;
+      }
+      data.array->flatten();
+      if (data.array->isPacked) {
+        if (v.type == Types::Number && l >= 0 && (size_t) l <= data.array->size()) {
+          data.array->packed.insert(data.array->packed.begin() + l, v.toDouble());
+          return;
+        }
+        data.array->unpack();
+      }
+      if (data.array->size() < (l + 1)) data.array->resize(l);
+      data.array->insert(data.array->begin() + l, v);
+#endif
+    } else if (_ISTEXT(type) && _ISTEXT(v.type)) {
+#ifdef USE_ARDUINO_STRING
+      long l = i;
+      *data.text = data.text->substring(0, l) + v.toString() + data.text->substring(l);
+#else
+      data.text->replace((long) i, 0, v.toString());
+#endif
+    }
+  }
+
+  bool containsKey(const Value& k) const {
+#ifdef USE_NOSTD_MAP
+      for (int i = 0; i < data.map->size(); i++) {
+        if (*(*data.map)[i].key == k) {
+          return true;
+        }
+      }
+#else
+      return data.map->count(k);
+#endif
+    return false;
+  }
+
+private:
+#if !defined(USE_ARDUINO_ARRAY) && !defined(USE_ARDUINO_STRING)
+  // writes an array or a map with an explicit stack instead of recursing into toString(), so deep
+  // ones don't run out of stack
+  void write(std::ostream& s) const {
+    struct Frame {
+      const Value* value;
+      size_t next;
+      std::vector<const Value*> entries; // key, value, key, value... for maps
+    };
+    std::vector<Frame> stack;
+    std::unordered_set<const void*> open; // payloads of the frames, found again further down in cycles
+    s << std::setprecision(16);
+    const Value* v = this;
+    while (true) {
+      if (v != 0) {
+        if (_ISARR(v->type) && !open.insert(v->data.array).second) {
+          s << "[...]";
+        } else if (_ISARR(v->type)) {
+          s << '[';
+          stack.push_back(Frame { v, 0, {} });
+        }
+#ifndef USE_NOSTD_MAP
+        else if (_ISMAP(v->type) && !open.insert(v->data.map).second) {
+          s << "{...}";
+        } else if (_ISMAP(v->type)) {
+          s << '{';
+          stack.push_back(Frame { v, 0, {} });
+          std::vector<const Value*>& entries = stack.back().entries;
+          entries.reserve(2 * v->data.map->size());
+          v->data.map->forEach([&entries] (const Value& k, const Value& e) {
+            entries.push_back(&k);
+            entries.push_back(&e);
+            return true;
+          });
+        }
+#endif
+        else if (_ISNUMBER(v->type)) {
+#ifdef USE_DOUBLE
+          s << v->data.number;
+#else
+          s << v->data.smallNumber;
+#endif
+        } else {
+          s << v->toString();
+        }
+        v = 0;
+      }
+      if (stack.empty()) return;
+      Frame& f = stack.back();
+      if (_ISARR(f.value->type)) {
+        const ARRAY& a = *f.value->data.array;
+        if (f.next == a.size()) {
+          s << ']';
+          open.erase(&a);
+          stack.pop_back();
+          continue;
+        }
+        if (f.next != 0) s << ", ";
+        size_t i = f.next++;
+        if (a.isPacked) s << a.packed[i];
+        else v = &a.item(i);
+      } else {
+        if (f.next == f.entries.size()) {
+          s << '}';
+          open.erase(f.value->data.map);
+          stack.pop_back();
+          continue;
+        }
+        size_t i = f.next++;
+        if (i % 2 == 1) s << " = ";
+        else if (i != 0) s << ", ";
+        v = f.entries[i];
+      }
+    }
+  }
+
+#ifndef USE_NOSTD_MAP
+  template <class F>
+  void forEachElement(const F& fn) const {
+    if (_ISARR(type)) {
+      const ARRAY& a = *data.array;
+      if (!a.isPacked) for (size_t i = 0; i < a.size(); i++) fn(a.item(i));
+    } else {
+      data.map->forEach([&fn] (const Value& k, const Value& v) {
+        fn(k);
+        fn(v);
+        return true;
+      });
+    }
+  }
+
+  // a text or big number whose payload something else holds too, that can change it in place without
+  // this value getting modified (symbols and frozen payloads get copied first, map keys never change)
+  bool aliasedLeaf() const {
+    if (_ISARR(type) || _ISMAP(type) || type == Types::Symbol) return false;
+    return useCount != 0 && useCount != frozenCount() && *useCount != 0;
+  }
+
+  // the text of this array or map as write() makes it, but with the arrays and maps in it left out (the
+  // offsets where they go are in splits, and they get appended to children). It is kept in the payload
+  // and written again only when the payload or one of its elements got modified since, or when it holds
+  // an aliasedLeaf(). Persistent payloads, views and frozen payloads (that other threads could be
+  // reading) get theirs in scratch
+  const ValueTextCache::Text& ownText(std::vector<const Value*>& children, ValueTextCache::Text& scratch) const {
+    bool isArray = _ISARR(type);
+    ValueTextCache& cache = isArray ? data.array->textCache : data.map->textCache;
+    bool keep = !isFrozen() && !(isArray ? data.array->isPersistent || data.array->isView : data.map->isPersistent);
+    size_t elements = isArray ? data.array->size() : data.map->size();
+    bool stale = !keep || cache.text == 0 || !cache.text->valid || cache.text->elements != elements;
+    size_t first = children.size();
+    size_t at = 0;
+    forEachElement([&children, &stale, &at, isArray] (const Value& v) {
+      if (v.modified || ((isArray || at % 2 == 1) && v.aliasedLeaf())) stale = true;
+      at++;
+      if (_ISARR(v.type) || _ISMAP(v.type)) children.push_back(&v);
+    });
+    if (!stale && cache.text->splits.size() == children.size() - first) return *cache.text;
+    ValueTextCache::Text& t = keep ? cache.get() : scratch;
+    std::ostringstream s;
+    s << std::setprecision(16) << (isArray ? '[' : '{');
+    t.splits.clear();
+    if (isArray && data.array->isPacked) {
+      const std::vector<double>& packed = data.array->packed;
+      for (size_t i = 0; i < packed.size(); i++) {
+        if (i != 0) s << ", ";
+        s << packed[i];
+      }
+    }
+    size_t i = 0;
+    forEachElement([&] (const Value& v) {
+      if (isArray ? i != 0 : i % 2 == 0 && i != 0) s << ", ";
+      else if (!isArray && i % 2 == 1) s << " = ";
+      i++;
+      if (_ISARR(v.type) || _ISMAP(v.type)) t.splits.push_back((size_t) s.tellp());
+#ifdef USE_DOUBLE
+      else if (_ISNUMBER(v.type)) s << v.data.number;
+#else
+      else if (_ISNUMBER(v.type)) s << v.data.smallNumber;
+#endif
+      else s << v.toString();
+      if (keep) const_cast<Value&>(v).modified = false;
+    });
+    s << (isArray ? ']' : '}');
+    t.text = s.str();
+    t.elements = elements;
+    t.valid = true;
+    return t;
+  }
+#endif
+#endif
+
+public:
+  TEXT toString() const {
+    if (_ISNUMBER(type)) {
+#ifdef USE_DOUBLE
+#ifdef USE_ARDUINO_STRING
+      unsigned char decimalPlaces = 0;
+      double x = data.number;
+      while (int(x) != x) {
+        x *= 10;
+        decimalPlaces++;
+      }
+      String s(data.number, decimalPlaces);
+      s.trim();
+      return s;
+#else
+      // TEXT t = std::to_string(data.number);
+      // t.erase(t.find_last_not_of('0') + 1, std::string::npos);
+      // t.pop_back();
+      // return t;
+      std::ostringstream s;
+      s << std::setprecision(16) << data.number;
+      return s.str();
+#endif
+#else
+#ifdef USE_ARDUINO_STRING
+      unsigned char decimalPlaces = 0;
+      double x = data.smallNumber;
+      while (int(x) != x) {
+        x *= 10;
+        decimalPlaces++;
+      }
+      String s(data.smallNumber, decimalPlaces);
+      s.trim();
+      return s;
+#else
+      // TEXT t = std::to_string(data.smallNumber);
+      // t.erase(t.find_last_not_of('0') + 1, std::string::npos);
+      // if (t[t.size() - 1] == '.') t.pop_back();
+      // return t;
+      std::ostringstream s;
+      s << std::setprecision(16) << data.smallNumber;
+      return s.str();
+#endif
+#endif
+#ifndef USE_DOUBLE
+    } else if (_ISBIGNUMBER(type)) {
+#ifdef USE_BIG_NUMBER
+      return data.number->toString();
+#else
+      std::ostringstream s;
+      s << std::setprecision(256) << *data.number;
+      return s.str();
+#endif
+#endif
+    } else if (_ISTEXT(type)) {
+      return *data.text;
+    } else if (_ISTRUE(type)) {
+      return "True";
+    } else if (_ISFALSE(type)) {
+      return "False";
+    } else if (_ISNULL(type)) {
+      return "null";
+    } else if (_ISARR(type)) {
+#ifdef USE_ARDUINO_ARRAY
+      String s = "[";
+      for (int i = 0; i < data.array->size(); i++) {
+        if ((*data.array)[i] == this) s += "[...]";
+        else s += (*data.array)[i]->toString();
+        if (i != data.array->size() - 1) s += ", ";
+      }
+      s += "]";
+      return s;
+#elif !defined(USE_ARDUINO_STRING)
+      _trace_scope("toString", type, length());
+      std::ostringstream s;
+      write(s);
+      return s.str();
+#else
+      data.array->unpack();
+      String s = "[";
+      for (int i = 0; i < data.array->size(); i++) {
+        if (&(*data.array)[i] == this) s += "[...]";
+        else s += (*data.array)[i].toString();
+        if (i != data.array->size() - 1) s += ", ";
+      }
+      return s + "]";
+#endif
+    } else if (_ISMAP(type)) {
+#if !defined(USE_NOSTD_MAP) && !defined(USE_ARDUINO_ARRAY) && !defined(USE_ARDUINO_STRING)
+      _trace_scope("toString", type, length());
+      std::ostringstream s;
+      write(s);
+      return s.str();
+#elif !defined(USE_NOSTD_MAP)
+      std::ostringstream s;
+      s << '{';
+      bool first = true;
+      data.map->forEach([&s, &first] (const Value& k, const Value& v) {
+        if (!first) s << ", ";
+        s << k.toString() << " = " << v.toString();
+        first = false;
+        return true;
+      });
+      s << '}';
+      return s.str();
+#else
+      String s = "{";
+      for (int i = 0; i < data.map->size(); i++) {
+        s += (*data.map)[i].key->toString() + " = " + (*data.map)[i].value->toString();
+        if (i != data.map->size() - 1) s += ", ";
+      }
+      return s + "}";
+#endif
+    }
+    return "";
+  }
+
+#if !defined(USE_ARDUINO_ARRAY) && !defined(USE_ARDUINO_STRING) && !defined(USE_NOSTD_MAP)
+  // the same text as toString(), but every array and map keeps what it writes itself in its payload
+  // (see ownText()) and only writes that again after it or one of its elements got modified, so after
+  // a few changes to a big value most of its text gets copied instead of written. The texts kept take
+  // about as much memory as the whole text and stay until the payloads get freed
+  TEXT toCachedString() const {
+    if (!_ISARR(type) && !_ISMAP(type)) return toString();
+    _trace_scope("toString", type, length());
+    struct Frame {
+      const ValueTextCache::Text* text; // 0 when it is in scratch
+      ValueTextCache::Text scratch;
+      const void* payload;
+      size_t first, next, end; // its arrays and maps in children
+      size_t at; // in the text
+    };
+    std::vector<Frame> stack;
+    std::vector<const Value*> children;
+    // payloads of the frames past the first ones (those are looked for on the stack), found again
+    // further down in cycles
+    std::unordered_set<const void*> open;
+    const size_t scanned = 32;
+    TEXT res;
+    const Value* v = this;
+    while (true) {
+      if (v != 0) {
+        stack.emplace_back();
+        Frame& f = stack.back();
+        f.payload = v->payload();
+        if (stack.size() > scanned) open.insert(f.payload);
+        f.first = f.next = children.size();
+        const ValueTextCache::Text& t = v->ownText(children, f.scratch);
+        f.text = &t == &f.scratch ? 0 : &t;
+        f.end = children.size();
+        f.at = 0;
+        v = 0;
+      }
+      if (stack.empty()) return res;
+      Frame& f = stack.back();
+      const ValueTextCache::Text& t = f.text ? *f.text : f.scratch;
+      if (f.next == f.end) {
+        res.append(t.text, f.at, TEXT::npos);
+        if (stack.size() > scanned) open.erase(f.payload);
+        children.resize(f.first);
+        stack.pop_back();
+        continue;
+      }
+      size_t split = t.splits[f.next - f.first];
+      res.append(t.text, f.at, split - f.at);
+      f.at = split;
+      const Value* c = children[f.next++];
+      const void* p = c->payload();
+      bool cycle = open.count(p) != 0;
+      for (size_t i = 0; i < stack.size() && i < scanned && !cycle; i++) cycle = stack[i].payload == p;
+      if (cycle) res += _ISARR(c->type) ? "[...]" : "{...}";
+      else v = c;
+    }
+  }
+#endif
+
+private:
+#ifndef USE_ARDUINO_ARRAY
+  typedef std::vector<std::pair<const Value*, const Value*> > Comparisons;
+#else
+  typedef void Comparisons;
+#endif
+
+  inline const void* payload() const {
+    return _ISARR(type) ? (const void*) data.array : (const void*) data.map;
+  }
+
+  // pairs of arrays or maps are left in pending instead of being compared right away
+  static bool equalElements(const Value& x, const Value& y, Comparisons* pending) {
+#ifndef USE_ARDUINO_ARRAY
+    if ((_ISARR(x.type) && _ISARR(y.type)) || (_ISMAP(x.type) && _ISMAP(y.type))) {
+      pending->push_back(std::make_pair(&x, &y));
+      return true;
+    }
+#endif
+    return x.equals(y, pending);
+  }
+
+  bool equals(const Value& other, Comparisons* pending) const {
+    if (_ISTEXT(type) && _ISTEXT(other.type)) {
+      // symbols are kept once so two different ones can't hold the same text
+      if (data.text == other.data.text) return true;
+      if (type == Types::Symbol && other.type == Types::Symbol) return false;
+      return *data.text == *other.data.text;
+    }
+#ifndef USE_DOUBLE
+    if (_ISNUMBER(type) && _ISBIGNUMBER(other.type)) {
+      return *other.data.number == data.smallNumber;
+    } else if (_ISBIGNUMBER(type) && _ISNUMBER(other.type)) {
+      return *data.number == other.data.smallNumber;
+    }
+#endif
+    if (other.type == type || (_ISNUMBER(other.type) && _ISNUMBER(type))) {
+      if (_ISNUMBER(type)) {
+#ifdef USE_DOUBLE
+        return data.number == other.data.number;
+#else
+        return data.smallNumber == other.data.smallNumber;
+      } else if (_ISBIGNUMBER(type)) {
+        return *data.number == *other.data.number;
+#endif
+      }
+      if (_ISTEXT(type)) {
+        return *data.text == *other.data.text;
+      } else if (_ISTRUE(type) || _ISFALSE(type) || _ISNULL(type)) {
+        return true;
+      } else if (_ISARR(type)) {
+#ifdef USE_ARDUINO_ARRAY
+        if (data.array->size() == other.data.array->size()) {
+          for (size_t i = 0; i < data.array->size(); i++) {
+            if (*(*data.array)[i] != *(*other.data.array)[i]) return false;
+          }
+          return true;
+        }
+#else
+        if (data.array->size() != other.data.array->size()) return false;
+        if (data.array->isPacked && other.data.array->isPacked) {
+          return data.array->packed == other.data.array->packed;
+        } else if (data.array->isPacked || other.data.array->isPacked) {
+          const ARRAY& p = data.array->isPacked ? *data.array : *other.data.array;
+          const ARRAY& values = data.array->isPacked ? *other.data.array : *data.array;
+          for (size_t i = 0; i < p.packed.size(); i++) {
+            if (values.item(i) != Value(p.packed[i])) return false;
+          }
+          return true;
+        } else if (data.array->isPersistent && other.data.array->isPersistent
+            && data.array->persistent.sameAs(other.data.array->persistent)) {
+          return true;
+        }
+        for (size_t i = 0; i < data.array->size(); i++) {
+          if (!equalElements(data.array->item(i), other.data.array->item(i), pending)) return false;
+        }
+        return true;
+#endif
+      } else if (_ISMAP(type)) {
+#ifdef USE_NOSTD_MAP
+        if (data.map->size() == other.data.map->size()) {
+          for (size_t i = 0; i < data.map->size(); i++) {
+            if (*(*data.map)[i].value != other.get((*data.map)[i].key)) return false;
+          }
+          return true;
+        }
+#else
+        const MAP& a = *data.map;
+        const MAP& b = *other.data.map;
+        if (a.size() != b.size()) return false;
+        if (a.shape && a.shape == b.shape && a.hashEntries().empty() && b.hashEntries().empty()) {
+          for (size_t i = 0; i < a.slots.size(); i++) {
+            if (!equalElements(a.slots[i], b.slots[i], pending)) return false;
+          }
+          return true;
+        }
+        if (a.isPersistent && b.isPersistent && a.persistent.sameAs(b.persistent)) return true;
+        bool equal = true;
+        a.forEach([&b, &equal, pending] (const Value& k, const Value& v) {
+          const Value* o = b.find(k);
+          equal = o != 0 && equalElements(v, *o, pending);
+          return equal;
+        });
+        return equal;
+#endif
+      }
+    }
+    return false;
+  }
+
+public:
+  bool operator== (const Value& other) const {
+#ifdef USE_ARDUINO_ARRAY
+    return equals(other, 0);
+#else
+    // nested arrays and maps are compared in a loop instead of recursively, a pair of payloads compared
+    // before (or being compared further up a cycle) is taken as equal
+    struct PayloadsHash {
+      size_t operator() (const std::pair<const void*, const void*>& p) const {
+        return std::hash<const void*>() (p.first) * 31 + std::hash<const void*>() (p.second);
+      }
+    };
+    std::unordered_set<std::pair<const void*, const void*>, PayloadsHash> compared;
+    Comparisons pending;
+    if (!equals(other, &pending)) return false;
+    while (!pending.empty()) {
+      std::pair<const Value*, const Value*> p = pending.back();
+      pending.pop_back();
+      if (!compared.insert(std::make_pair(p.first->payload(), p.second->payload())).second) continue;
+      if (!p.first->equals(*p.second, &pending)) return false;
+    }
+    return true;
+#endif
+  }
+
+  bool operator!= (const Value& other) const {
+    return !(*this == other);
+  }
+
+#if !defined(USE_ARDUINO_ARRAY) && !defined(USE_NOSTD_MAP)
+  // == and HashFunction()(*this) with the elements of an array or map split among the threads of
+  // ValueThreadPool, every element is compared or hashed by a single thread. Unless ordered, arrays are
+  // equal when they hold the same elements in any order (the elements themselves are compared with ==)
+  // and hash to the same value then. An array or map found inside itself can hash differently than
+  // with HashFunction
+  bool parallelEquals(const Value& other, bool ordered = true) const;
+  size_t parallelHash(bool ordered = true) const;
+#endif
+
+  bool operator> (const Value& other) const {
+    if (_ISNUMBER(other.type) && _ISNUMBER(type)) {
+#ifdef USE_DOUBLE
+      return data.number > other.data.number;
+#else
+      return data.smallNumber > other.data.smallNumber;
+#endif
+    }
+#ifndef USE_DOUBLE
+    else if (_ISBIGNUMBER(other.type) && _ISBIGNUMBER(type)) {
+      return *data.number > *other.data.number;
+    } else if (_ISBIGNUMBER(type) && _ISNUMBER(other.type)) {
+      return *data.number > other.data.smallNumber;
+    } else if (_ISNUMBER(type) && _ISBIGNUMBER(other.type)) {
+      return data.smallNumber > *other.data.number;
+    }
+#endif
+    return false;
+  }
+
+  bool operator< (const Value& other) const {
+    if (_ISNUMBER(other.type) && _ISNUMBER(type)) {
+#ifdef USE_DOUBLE
+      return data.number < other.data.number;
+#else
+      return data.smallNumber < other.data.smallNumber;
+#endif
+    }
+#ifndef USE_DOUBLE
+    else if (_ISBIGNUMBER(other.type) && _ISBIGNUMBER(type)) {
+      return *data.number < *other.data.number;
+    } else if (_ISBIGNUMBER(type) && _ISNUMBER(other.type)) {
+      return *data.number < other.data.smallNumber;
+    } else if (_ISNUMBER(type) && _ISBIGNUMBER(other.type)) {
+      return data.smallNumber < *other.data.number;
+    }
+#endif
+    return false;
+  }
+
+  bool operator<= (const Value& other) const {
+    if (_ISNUMBER(other.type) && _ISNUMBER(type)) {
+#ifdef USE_DOUBLE
+      return data.number <= other.data.number;
+#else
+      return data.smallNumber <= other.data.smallNumber;
+#endif
+    }
+#ifndef USE_DOUBLE
+    else if (_ISBIGNUMBER(other.type) && _ISBIGNUMBER(type)) {
+      return *data.number <= *other.data.number;
+    } else if (_ISBIGNUMBER(type) && _ISNUMBER(other.type)) {
+      return *data.number <= other.data.smallNumber;
+    } else if (_ISNUMBER(type) && _ISBIGNUMBER(other.type)) {
+      return data.smallNumber <= *other.data.number;
+    }
+#endif
+    return false;
+  }
+
+  bool operator>= (const Value& other) const {
+    if (_ISNUMBER(other.type) && _ISNUMBER(type)) {
+#ifdef USE_DOUBLE
+      return data.number >= other.data.number;
+#else
+      return data.smallNumber >= other.data.smallNumber;
+#endif
+    }
+#ifndef USE_DOUBLE
+    else if (_ISBIGNUMBER(other.type) && _ISBIGNUMBER(type)) {
+      return *data.number >= *other.data.number;
+    } else if (_ISBIGNUMBER(type) && _ISNUMBER(other.type)) {
+      return *data.number >= other.data.smallNumber;
+    } else if (_ISNUMBER(type) && _ISBIGNUMBER(other.type)) {
+      return data.smallNumber >= *other.data.number;
+    }
+#endif
+    return false;
+  }
+
+  bool operator! () const {
+    if ((_ISNUMBER(type) || _ISBIGNUMBER(type)) && toLong() == 0)
+      return true;
+    if (_ISFALSE(type)) {
+      return true;
+    }
+    return false;
+  }
+
+  double toDouble() const {
+    if (_ISNUMBER(type)) {
+#ifdef USE_DOUBLE
+      return data.number;
+#else
+      return data.smallNumber;
+#endif
+    }
+#ifndef USE_DOUBLE
+    else if (_ISBIGNUMBER(type)) {
+#ifdef USE_BIG_NUMBER
+      return data.number->toDouble();
+#else
+      return data.number->get_d();
+#endif
+    }
+#endif
+    return 0;
+  }
+
+  long toLong() const {
+    if (_ISNUMBER(type)) {
+#ifdef USE_DOUBLE
+      return data.number;
+#else
+      return data.smallNumber;
+#endif
+    }
+#ifndef USE_DOUBLE
+    else if (_ISBIGNUMBER(type)) {
+#ifdef USE_BIG_NUMBER
+      return data.number->toLong();
+#else
+      return data.number->get_si();
+#endif
+    }
+#endif
+    return 0;
+  }
+
+  long operator~ () const {
+    if (_ISNUMBER(type)) {
+      return ~toLong();
+    }
+    return 0;
+  }
+
+  Value operator- () const {
+    if (_ISNUMBER(type)
+#ifndef USE_DOUBLE
+    || _ISBIGNUMBER(type)
+#endif
+    ) {
+      return *this * Value(-1);
+    }
+    return 0;
+  }
+
+  inline operator bool() const {
+    if (_ISTRUE(type)) return true;
+    return false;
+  }
+
+  inline operator int() const {
+    return toLong();
+  }
+
+  inline operator long() const {
+    return toLong();
+  }
+
+  inline operator double() const {
+    return toDouble();
+  }
+
+  inline bool equals(const Value& v) const {
+    return *this == v;
+  }
+
+  bool looksEqual(const Value& v) const {
+    return toString() == v.toString();
+  }
+
+#ifndef USE_ARDUINO_ARRAY
+  // reductions over the numbers of an array (other elements are skipped), arrays of Types::Number
+  // are summed as doubles with the SIMD kernels while BigNumbers are added up exactly
+  Value sum() const {
+    if (!_ISARR(type)) return Types::Null;
+    const double* p;
+    std::vector<double> buffer;
+    if (data.array->numbers(p, buffer)) {
+      return packedSum(p, data.array->size());
+    }
+    Value res = 0;
+    for (size_t i = 0; i < data.array->size(); i++) {
+      const Value& e = data.array->item(i);
+      if (IS_NUM(e)) res += e;
+    }
+    return res;
+  }
+
+  Value mean() const {
+    if (!_ISARR(type)) return Types::Null;
+    long count = data.array->size();
+    if (!data.array->isPacked) {
+      count = 0;
+      for (size_t i = 0; i < data.array->size(); i++) {
+        if (IS_NUM(data.array->item(i))) count++;
+      }
+    }
+    if (count == 0) return Types::Null;
+    Value res = sum();
+    res /= Value(count);
+    return res;
+  }
+
+  Value (min)() const {
+    return extreme(true);
+  }
+
+  Value (max)() const {
+    return extreme(false);
+  }
+
+  Value extreme(bool smallest) const {
+    if (!_ISARR(type) || data.array->empty()) return Types::Null;
+    const double* p;
+    std::vector<double> buffer;
+    if (data.array->numbers(p, buffer)) {
+      return packedExtreme(p, data.array->size(), smallest);
+    }
+    const Value* res = 0;
+    for (size_t i = 0; i < data.array->size(); i++) {
+      const Value& e = data.array->item(i);
+      if ((IS_NUM(e)) && e == e && (res == 0 || (smallest ? e < *res : e > *res))) res = &e;
+    }
+    if (res == 0) return Types::Null;
+    return *res;
+  }
+
+  Value dot(const Value& other) const {
+    if (!_ISARR(type) || !_ISARR(other.type)) return Types::Null;
+    size_t n = data.array->size();
+    if (other.data.array->size() < n) n = other.data.array->size();
+    const double *a, *b;
+    std::vector<double> bufferA, bufferB;
+    if (data.array->numbers(a, bufferA) && other.data.array->numbers(b, bufferB)) {
+      return packedDot(a, b, n);
+    }
+    Value res = 0;
+    for (size_t i = 0; i < n; i++) {
+      Value x = data.array->element(i), y = other.data.array->element(i);
+      if ((IS_NUM(x)) && (IS_NUM(y))) res += x * y;
+    }
+    return res;
+  }
+#endif
+
+  void sort() {
+    modify_linked()
+    if (_ISARR(type)) {
+      _trace_scope("sort", type, length());
+#ifdef USE_ARDUINO_STRING
+      qsort(data.array->data(), data.array->size(), sizeof(Value*), compareValue);
+#else
+      // toString() once per element (texts are used in place) instead of twice per comparison,
+      // then a radix sort on the strings, equal strings keep their order
+      ARRAY& a = *data.array;
+      a.flatten();
+      size_t n = a.size();
+      std::vector<TEXT> keys(n);
+      std::vector<TextSortItem> items(n);
+      ValueThreadPool::instance().parallelFor(n, 1024, [&] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+          const TEXT* t = &keys[i];
+          if (!a.isPacked && _ISTEXT(a[i].type)) t = a[i].data.text;
+          else keys[i] = a.isPacked ? Value(a.packed[i]).toString() : a[i].toString();
+          items[i].text = (const unsigned char*) t->data();
+          items[i].length = t->size();
+          items[i].index = i;
+        }
+      });
+      textRadixSort(items.data(), n);
+      std::vector<size_t> order(n);
+      for (size_t i = 0; i < n; i++) order[i] = items[i].index;
+      a.permute(order);
+#endif
+    }
+  }
+
+  void numericSort() {
+    modify_linked()
+    if (_ISARR(type)) {
+      _trace_scope("numericSort", type, length());
+#ifdef USE_ARDUINO_STRING
+      qsort(data.array->data(), data.array->size(), sizeof(Value*), compareValueNumeric);
+#else
+      // numbers come first in ascending order (NaNs after the other numbers), then everything else
+      // in its original order
+      ARRAY& a = *data.array;
+      a.flatten();
+      size_t n = a.size();
+      if (a.isPacked) {
+        std::vector<unsigned long long> keys(n);
+        for (size_t i = 0; i < n; i++) keys[i] = numberSortKey(a.packed[i]);
+        radixSort(keys.data(), 0, n);
+        for (size_t i = 0; i < n; i++) a.packed[i] = numberFromSortKey(keys[i]);
+        return;
+      }
+      std::vector<size_t> order, rest;
+      bool big = false;
+      for (size_t i = 0; i < n; i++) {
+        if (_ISNUMBER(a[i].type)) order.push_back(i);
+        else if (_ISBIGNUMBER(a[i].type)) big = true, order.push_back(i);
+        else rest.push_back(i);
+      }
+      if (!big) {
+        std::vector<unsigned long long> keys(order.size());
+        for (size_t i = 0; i < order.size(); i++) keys[i] = numberSortKey(a[order[i]].toDouble());
+        radixSort(keys.data(), order.data(), order.size());
+      } else {
+        parallelStableSort(order.data(), order.size(), [&a] (size_t l, size_t r) {
+          if (!(a[r] == a[r])) return a[l] == a[l];
+          return a[l] < a[r];
+        });
+      }
+      order.insert(order.end(), rest.begin(), rest.end());
+      a.permute(order);
+#endif
+    }
+  }
+
+#ifndef USE_ARDUINO_ARRAY
+  // fn(element) for every element of an array (on the threads of ValueThreadPool with USE_THREADS),
+  // returns the array of the results. use counts aren't atomic, so the elements sharing a payload with
+  // something else get to fn afterwards on the calling thread, the threads only see the ones owning
+  // theirs (fn can copy those, but not values nested in them that may be shared). the same goes for
+  // parallelFilter() and parallelReduce()
+  template <class F>
+  Value parallelMap(const F& fn) const {
+    if (!_ISARR(type)) return Value();
+    const ARRAY& a = parallelSource();
+    size_t n = a.size();
+    Value res = Types::Array;
+    ARRAY& out = *res.data.array;
+    out.unpack();
+    out.resize(n); // every thread writes its own elements
+    std::vector<char> shared(n);
+    ValueThreadPool::instance().parallelFor(n, 1024, [&] (size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++) {
+        if (a.isPacked) out[i] = fn(Value(a.packed[i]));
+        else if (ownsPayload(a.item(i))) out[i] = fn(a.item(i));
+        else shared[i] = 1;
+      }
+    });
+    if (!a.isPacked) {
+      for (size_t i = 0; i < n; i++) if (shared[i]) out[i] = fn(a.item(i));
+    }
+    out.pack();
+    return res;
+  }
+
+  // the elements of an array for which pred(element) is true, in their order
+  template <class F>
+  Value parallelFilter(const F& pred) const {
+    if (!_ISARR(type)) return Value();
+    const ARRAY& a = parallelSource();
+    size_t n = a.size(), chunks = parallelChunks(n);
+    std::vector<char> keep(n);
+    std::vector<size_t> offsets(chunks + 1);
+    ValueThreadPool& pool = ValueThreadPool::instance();
+    pool.parallelFor(chunks, 1, [&] (size_t begin, size_t end) {
+      for (size_t c = begin; c < end; c++) {
+        size_t kept = 0;
+        for (size_t i = n * c / chunks; i < n * (c + 1) / chunks; i++) {
+          keep[i] = (a.isPacked ? pred(Value(a.packed[i])) : pred(a.item(i))) ? 1 : 0;
+          kept += keep[i];
+        }
+        offsets[c + 1] = kept;
+      }
+    });
+    for (size_t c = 0; c < chunks; c++) offsets[c + 1] += offsets[c];
+    Value res = Types::Array;
+    ARRAY& out = *res.data.array;
+    if (a.isPacked) out.packed.resize(offsets[chunks]);
+    else {
+      out.unpack();
+      out.resize(offsets[chunks]);
+    }
+    // an element with a payload of its own is copied by the thread of its chunk (nothing else reads
+    // its use count), the ones sharing a payload afterwards by this one
+    pool.parallelFor(chunks, 1, [&] (size_t begin, size_t end) {
+      for (size_t c = begin; c < end; c++) {
+        size_t k = offsets[c];
+        for (size_t i = n * c / chunks; i < n * (c + 1) / chunks; i++) {
+          if (!keep[i]) continue;
+          if (a.isPacked) out.packed[k] = a.packed[i];
+          else if (ownsPayload(a.item(i))) out[k] = a.item(i);
+          else keep[i] = 2;
+          k++;
+        }
+      }
+    });
+    if (!a.isPacked) {
+      for (size_t i = 0, k = 0; i < n; i++) {
+        if (keep[i] == 2) out[k] = a.item(i);
+        if (keep[i]) k++;
+      }
+    }
+    return res;
+  }
+
+  // fn(fn(fn(identity, e0), e1), ...) over the elements of an array, the chunks of it get reduced on
+  // their own and then fn(chunk0, chunk1)... so fn has to be associative and identity its identity
+  // (like 0 for + or 1 for *)
+  template <class F>
+  Value parallelReduce(const Value& identity, const F& fn) const {
+    if (!_ISARR(type)) return identity;
+    const ARRAY& a = parallelSource();
+    size_t n = a.size(), chunks = parallelChunks(n);
+    // every chunk starts from a copy of identity of its own (fn may copy it) and writes its own partial.
+    // a chunk stops at its first element sharing a payload, this thread goes on from there in order
+    std::vector<Value> partials(chunks, identity);
+    std::vector<size_t> stops(chunks);
+    for (size_t c = 0; c < chunks; c++) partials[c].clone();
+    ValueThreadPool::instance().parallelFor(chunks, 1, [&] (size_t begin, size_t end) {
+      for (size_t c = begin; c < end; c++) {
+        size_t i = n * c / chunks, last = n * (c + 1) / chunks;
+        for (; i < last; i++) {
+          if (a.isPacked) partials[c] = fn(partials[c], Value(a.packed[i]));
+          else if (ownsPayload(a.item(i))) partials[c] = fn(partials[c], a.item(i));
+          else break;
+        }
+        stops[c] = i;
+      }
+    });
+    if (chunks == 0) return identity;
+    for (size_t c = 0; c < chunks; c++) {
+      for (size_t i = stops[c]; i < n * (c + 1) / chunks; i++) partials[c] = fn(partials[c], a.item(i));
+    }
+    Value res = static_cast<Value&&>(partials[0]);
+    for (size_t c = 1; c < chunks; c++) res = fn(res, partials[c]);
+    return res;
+  }
+
+private:
+  // a view reading an array that got packed since gets its own elements first, the threads can't
+  const ARRAY& parallelSource() const {
+    const ARRAY& a = *data.array;
+    if (a.isView && a.viewOf.getData().array->isPacked) const_cast<ARRAY&>(a).materialize();
+    return a;
+  }
+
+  // nothing but the element itself reads the use count of its payload, so a thread can copy it
+  static bool ownsPayload(const Value& v) { return v.useCount == 0 || *v.useCount == 0; }
+
+  // chunks for parallelFilter() and parallelReduce(), a few per thread so the ones that finish
+  // first steal the rest
+  static size_t parallelChunks(size_t n) {
+    size_t chunks = (n + 1023) / 1024, limit = ValueThreadPool::instance().size() * 4;
+    return chunks < limit ? chunks : limit;
+  }
+
+public:
+#endif
+
+  void reverse() {
+    modify_linked()
+    if (_ISARR(type)) {
+#ifdef USE_ARDUINO_ARRAY
+      size_t s = data.array->size();
+      if (s > 1) {
+        Value* tmp;
+        for (int i = 0; i < s / 2; i++) {
+          tmp = (*data.array)[i];
+          (*data.array)[i] = (*data.array)[s - (i + 1)];
+          (*data.array)[s - (i + 1)] = tmp;
+        }
+      }
+#else
+      data.array->flatten();
+      if (data.array->isPacked) std::reverse(data.array->packed.begin(), data.array->packed.end());
+      else std::reverse(data.array->begin(), data.array->end());
+#endif
+    } else if (_ISTEXT(type)) {
+#ifdef USE_ARDUINO_ARRAY
+      size_t s = data.text->length();
+      if (s > 1) {
+        char tmp;
+        for (int i = 0; i < s / 2; i++) {
+          tmp = (*data.text)[i];
+          (*data.text)[i] = (*data.text)[s - (i + 1)];
+          (*data.text)[s - (i + 1)] = tmp;
+        }
+      }
+#else
+      std::reverse(data.text->begin(), data.text->end());
+#endif
+    }
+  }
+
+  void replace(Value a, Value b) {
+    modify_linked()
+    if (_ISTEXT(type)) {
+#ifndef USE_ARDUINO_STRING
+      TEXT t = a.toString();
+      int i = data.text->find(t);
+      if (i != -1) data.text->replace(i, t.length(), b.toString());
+#else
+      data.text->replace(a.toString(), b.toString());
+#endif
+    }
+  }
+
+  int indexOf(Value v, int index = 0) const {
+    if (_ISTEXT(type)) {
+#ifdef USE_ARDUINO_STRING
+      return data.text->indexOf(v.toString(), index);
+#else
+      return data.text->find(v.toString(), index);
+#endif
+    } else if (_ISARR(type)) {
+#ifdef USE_ARDUINO_ARRAY
+      for (int i = index; i < data.array->size(); i++) {
+        if (*(*data.array)[i] == v) {
+          return i;
+        }
+      }
+#else
+      if (index < 0 || (size_t) index >= data.array->size()) return -1;
+      // views and persistent arrays are searched where they are, without copying their elements
+      if (data.array->isView || data.array->isPersistent) {
+        for (size_t i = index; i < data.array->size(); i++) {
+          if (data.array->item(i) == v) return i;
+        }
+        return -1;
+      }
+      data.array->flatten();
+      if (data.array->isPacked) {
+        if (_ISNUMBER(v.type)) {
+          auto it = std::find(data.array->packed.begin() + index, data.array->packed.end(), v.toDouble());
+          if (it != data.array->packed.end()) {
+            return it - data.array->packed.begin();
+          }
+        } else if (_ISBIGNUMBER(v.type)) {
+          for (size_t i = index; i < data.array->packed.size(); i++) {
+            if (Value(data.array->packed[i]) == v) return i;
+          }
+        }
+        return -1;
+      }
+      auto it = std::find(data.array->begin() + index, data.array->end(), v);
+      if (it != data.array->end()) {
+        return it - data.array->begin();
+      }
+#endif
+    }
+    return -1;
+  }
+
+  int lastIndexOf(Value v, int index) const {
+    if (_ISTEXT(type)) {
+#ifdef USE_ARDUINO_STRING
+      return data.text->lastIndexOf(v.toString(), index);
+#else
+      return data.text->find_last_of(v.toString(), index);
+#endif
+    } else if (_ISARR(type)) {
+      for (int i = index; i >= 0; i--) {
+#ifdef USE_ARDUINO_ARRAY
+        if (*(*data.array)[i] == v) {
+#else
+        if (data.array->isPacked ? Value(data.array->packed[i]) == v : data.array->item(i) == v) {
+#endif
+          return i;
+        }
+      }
+    }
+    return -1;
+  }
+
+  int lastIndexOf(Value v) const {
+    if (_ISTEXT(type)) {
+#ifdef USE_ARDUINO_STRING
+      return data.text->lastIndexOf(v.toString());
+#else
+      return data.text->find_last_of(v.toString());
+#endif
+    } else if (_ISARR(type)) {
+      for (int i = data.array->size() - 1; i >= 0; i--) {
+#ifdef USE_ARDUINO_ARRAY
+        if (*(*data.array)[i] == v) {
+#else
+        if (data.array->isPacked ? Value(data.array->packed[i]) == v : data.array->item(i) == v) {
+#endif
+          return i;
+        }
+      }
+    }
+    return -1;
+  }
+
+  Value substring(const Value& other) const {
+#ifdef USE_ARDUINO_STRING
+    return data.text->substring((long) other);
+#else
+    return data.text->substr((long) other);
+#endif
+  }
+
+#ifndef USE_ARDUINO_ARRAY
+  // the elements from begin up to end (every step-th one) of an array, negative indexes count from the
+  // end. The slice shares the elements of this array (changes made to it in place show through) until
+  // it gets modified itself, slices of packed arrays just copy the numbers
+  Value slice(long begin, long end, long step = 1) const {
+    if (!_ISARR(type) || step < 1) return Types::Null;
+    long n = data.array->size();
+    if (begin < 0) begin = begin + n < 0 ? 0 : begin + n;
+    if (end < 0) end = end + n < 0 ? 0 : end + n;
+    if (begin > n) begin = n;
+    if (end > n) end = n;
+    size_t count = end > begin ? (end - begin + step - 1) / step : 0;
+    Value res = Types::Array;
+    ARRAY& a = *res.data.array;
+    const ARRAY& source = *data.array;
+    if (source.isPacked) {
+      a.packed.reserve(count);
+      for (size_t i = 0; i < count; i++) a.packed.push_back(source.packed[begin + i * step]);
+    } else if (count != 0) {
+      a.isPacked = false;
+      a.isView = true;
+      a.viewCount = count;
+      if (source.isView) {
+        // a slice of a slice reads straight from the first one's array
+        a.viewOf = source.viewOf;
+        a.viewStart = source.viewStart + begin * source.viewStep;
+        a.viewStep = step * source.viewStep;
+      } else {
+        a.viewOf = Value(data, type, useCount);
+        a.viewStart = begin;
+        a.viewStep = step;
+      }
+    }
+    return res;
+  }
+
+  Value slice(long begin) const {
+    return slice(begin, length());
+  }
+#endif
+
+  Value substring(Value v1, Value v2) const {
+#ifdef USE_ARDUINO_STRING
+    return data.text->substring((long) v1, (long) v2);
+#else
+    return data.text->substr((long) v1, (long) v2 - (long) v1);
+#endif
+  }
+
+  inline int length() const {
+    if (_ISTEXT(type)) {
+#ifdef USE_ARDUINO_STRING
+      return data.text->length();
+#else
+      return data.text->size();
+#endif
+    } else if (_ISARR(type)) {
+      return data.array->size();
+    } else if (_ISMAP(type)) {
+      return data.map->size();
+    }
+    return 0;
+  }
+
+  const Value& getKeyAt(size_t index) const;
+
+  const Value& getValueAt(size_t index) const;
+
+#ifndef USE_ARDUINO_ARRAY
+  // reads the elements of an array by value (like operator[] on a const Value), so a packed or
+  // persistent array stays the way it is and a payload shared with other values isn't written to
+  class ElementIterator {
+    const ARRAY* array = 0;
+    size_t i = 0;
+  public:
+    typedef std::random_access_iterator_tag iterator_category;
+    typedef Value value_type;
+    typedef Value reference;
+    typedef std::ptrdiff_t difference_type;
+    typedef void pointer;
+
+    ElementIterator() {}
+    ElementIterator(const ARRAY* array, size_t i) : array(array), i(i) {}
+
+    Value operator* () const { return array->element(i); }
+    Value operator[] (difference_type n) const { return array->element(i + n); }
+    ElementIterator& operator++ () { i++; return *this; }
+    ElementIterator& operator-- () { i--; return *this; }
+    ElementIterator operator++ (int) { ElementIterator res = *this; i++; return res; }
+    ElementIterator operator-- (int) { ElementIterator res = *this; i--; return res; }
+    ElementIterator& operator+= (difference_type n) { i += n; return *this; }
+    ElementIterator& operator-= (difference_type n) { i -= n; return *this; }
+    ElementIterator operator+ (difference_type n) const { return ElementIterator(array, i + n); }
+    ElementIterator operator- (difference_type n) const { return ElementIterator(array, i - n); }
+    difference_type operator- (const ElementIterator& other) const { return (difference_type) i - (difference_type) other.i; }
+    bool operator== (const ElementIterator& other) const { return i == other.i; }
+    bool operator!= (const ElementIterator& other) const { return i != other.i; }
+    bool operator< (const ElementIterator& other) const { return i < other.i; }
+    bool operator> (const ElementIterator& other) const { return i > other.i; }
+    bool operator<= (const ElementIterator& other) const { return i <= other.i; }
+    bool operator>= (const ElementIterator& other) const { return i >= other.i; }
+  };
+
+  ElementIterator begin() const {
+    return ElementIterator(_ISARR(type) ? data.array : 0, 0);
+  }
+
+  ElementIterator end() const {
+    return ElementIterator(_ISARR(type) ? data.array : 0, _ISARR(type) ? data.array->size() : 0);
+  }
+
+  // the elements of an array as a random access range of plain pointers, so range-for and the standard
+  // algorithms run straight over the vector (which, like for operator[], the array goes back to first).
+  // A payload shared with copies of this value gets copied first
+  Value* begin() {
+    if (!_ISARR(type)) return 0;
+    modify_linked()
+    data.array->unpack();
+    return data.array->data();
+  }
+
+  Value* end() {
+    if (!_ISARR(type)) return 0;
+    modify_linked()
+    data.array->unpack();
+    return data.array->data() + data.array->size();
+  }
+#endif
+
+#ifndef USE_NOSTD_MAP
+  template <class M, class I>
+  class EntryRange {
+    M* map;
+  public:
+    explicit EntryRange(M* map) : map(map) {}
+    I begin() const { return map ? map->begin() : I(); }
+    I end() const { return map ? map->end() : I(); }
+  };
+
+  // the entries of a map for range-for (for (auto e : v.entries()) with e.key and e.value), unlike
+  // getKeyAt() and getValueAt() every step is O(1). On a const Value e.value can only be read, otherwise
+  // a payload shared with copies of this value gets copied first so writing to e.value only changes this
+  EntryRange<const MAP, MAP::const_iterator> entries() const {
+    return EntryRange<const MAP, MAP::const_iterator>(_ISMAP(type) ? data.map : 0);
+  }
+
+  EntryRange<MAP, MAP::iterator> entries() {
+    if (!_ISMAP(type)) return EntryRange<MAP, MAP::iterator>(0);
+    modify_linked()
+    return EntryRange<MAP, MAP::iterator>(data.map);
+  }
+#endif
+
+  Value split(Value d) const {
+    Value res = Types::Array;
+    if (_ISTEXT(type)) {
+      int start = 0;
+      int end = indexOf(d);
+      while (end != -1) {
+        res.append(substring(start, end));
+        start = end + d.length();
+        end = indexOf(d, start);
+      }
+      res.append(substring(start, end));
+    }
+    return res;
+  }
+
+  Value trimRight() const {
+    if (_ISTEXT(type)) {
+      int i = length() - 1;
+      while ((*data.text)[i] == '\n' || (*data.text)[i] == '\t' || (*data.text)[i] == ' ') i--;
+      return substring(0, i + 1);
+    }
+    return "";
+  }
+
+  Value trimLeft() const {
+    if (_ISTEXT(type)) {
+      int i = 0;
+      while ((*data.text)[i] == '\n' || (*data.text)[i] == '\t' || (*data.text)[i] == ' ') i++;
+      return substring(i);
+    }
+    return "";
+  }
+
+  Value trim() const {
+    if (_ISTEXT(type)) {
+      return trimLeft().trimRight();
+    }
+    return "";
+  }
+
+  Value toUpper() const {
+    TEXT t = *data.text;
+    for (size_t c = 0; c < length(); c++) {
+      if (t[c] > 96 && t[c] < 123) {
+        t[c] -= 32;
+      }
+    }
+    return t;
+  }
+
+  Value toLower() {
+    TEXT t = *data.text;
+    for (size_t c = 0; c < length(); c++) {
+      if (t[c] < 91 && t[c] > 64) {
+        t[c] += 32;
+      }
+    }
+    return t;
+  }
+
+  bool startsWith(const Value& v) const {
+#ifdef USE_ARDUINO_STRING
+    return data.text->startsWith(v.toString());
+#else
+    return data.text->find(v.toString()) == 0;
+#endif
+  }
+
+  bool endsWith(const Value& v) const {
+#ifdef USE_ARDUINO_STRING
+    return data.text->endsWith(v.toString());
+#else
+    TEXT t = v.toString();
+    int i = lastIndexOf(t);
+    return i == data.text->size() - t.size() || i == -1;
+#endif
+  }
+
+  int codePointAt(const Value& at) const {
+    if (_ISTEXT(type))
+      return (int) (*data.text)[(long) at];
+    return -1;
+  }
+
+  char charAt(const Value& at) const {
+    if (_ISTEXT(type))
+      return (*data.text)[(long) at];
+    return 0;
+  }
+
+  // the element (or the value of a map), which can be written to (that unpacks a packed array)
+  Value& operator[] (const Value& i);
+
+  Value& operator[] (int i);
+
+  // reading an element doesn't change how the array keeps them, so it comes out as a copy
+  Value operator[] (const Value& i) const;
+
+  Value operator[] (int i) const;
+
+  void toNumber() {
+    modify_linked()
+    if (_ISTEXT(type)) {
+      TEXT t = *data.text;
+      int floatDigits = 0;
+      int intDigits = indexOf(".");
+      if (intDigits == -1) {
+        intDigits = t.length();
+      } else {
+        floatDigits = t.length() - intDigits - 1;
+      }
+      if (t[0] == '-') intDigits--;
+      // bool isSmall = (floatDigits == 0 && intDigits <= 15) || (floatDigits != 0 && intDigits <= 10);
+      bool isSmall = floatDigits <= 4 && intDigits < 9;
+      freeUnusedMemory();
+#ifndef USE_DOUBLE
+      if (isSmall) {
+        type = Types::Number;
+        data.smallNumber = atof(t.c_str());
+      } else {
+        type = Types::BigNumber;
+        data.number = new NUMBER(t.c_str());
+        _count_stat(allocations[(int) Types::BigNumber], 1);
+        useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+      }
+#else
+      data.number = NUMBER_FROM_STRING(t.c_str());
+      type = Types::Number;
+#endif
+    } else if (_ISTRUE(type)) {
+#ifndef USE_DOUBLE
+    data.smallNumber = 1;
+#else
+    data.number = 1;
+#endif
+      type = Types::Number;
+    } else if (_ISFALSE(type) || _ISNULL(type)) {
+#ifndef USE_DOUBLE
+      data.smallNumber = 0;
+#else
+      data.number = 0;
+#endif
+      type = Types::Number;
+    }
+  }
+
+  Value operator&=(const Value& other) {
+    modify_linked()
+    if ((_ISTRUE(type) || _ISFALSE(type)) &&
+            (_ISTRUE(other.type) || _ISFALSE(other.type))) {
+      *this = *this && other;
+    } else {
+      long a, b;
+      if (_ISTRUE(type) || _ISFALSE(type)) {
+        a = (int) ((bool) *this);
+      } else a = toLong();
+      if (_ISTRUE(other.type) || _ISFALSE(other.type)) {
+        b = (int) ((bool) other);
+      } else b = other.toLong();
+      *this = a & b;
+    }
+    return this;
+  }
+
+  Value operator&(const Value& other) const {
+    Value v = *this;
+    v &= other;
+    return v;
+  }
+
+  Value operator|=(const Value& other) {
+    modify_linked()
+    if ((_ISTRUE(type) || _ISFALSE(type)) &&
+            (_ISTRUE(other.type) || _ISFALSE(other.type))) {
+      *this = *this || other;
+    } else {
+      long a, b;
+      if (_ISTRUE(type) || _ISFALSE(type)) {
+        a = (int) ((bool) *this);
+      } else a = toLong();
+      if (_ISTRUE(other.type) || _ISFALSE(other.type)) {
+        b = (int) ((bool) other);
+      } else b = other.toLong();
+      *this = a | b;
+    }
+    return this;
+  }
+
+  Value operator|(const Value& other) const {
+    Value v = *this;
+    v |= other;
+    return v;
+  }
+
+  Value operator<<=(const Value& other) {
+    modify_linked()
+    if (IS_NUM(other) && (_ISNUMBER(type) || _ISBIGNUMBER(type))) {
+      *this = toLong() << other.toLong();
+    }
+    return this;
+  }
+
+  Value operator<<(const Value& other) const {
+    Value v = *this;
+    v <<= other;
+    return v;
+  }
+
+  Value operator>>=(const Value& other) {
+    modify_linked()
+    if (IS_NUM(other) && (_ISNUMBER(type) || _ISBIGNUMBER(type))) {
+      *this = toLong() >> other.toLong();
+    }
+    return this;
+  }
+
+  Value operator>>(const Value& other) const {
+    Value v = *this;
+    v >>= other;
+    return v;
+  }
+
+  Value operator^=(const Value& other) {
+    modify_linked()
+    if (IS_NUM(other) && (_ISNUMBER(type) || _ISBIGNUMBER(type))) {
+      *this = toLong() ^ other.toLong();
+    }
+    return this;
+  }
+
+  Value operator^(const Value& other) const {
+    Value v = *this;
+    v ^= other;
+    return v;
+  }
+
+#ifndef USE_ARDUINO_ARRAY
+  // applies an arithmetic operator between the elements of this array and the ones of another array
+  // (up to the shorter length) or a single number, packed arrays go through the SIMD kernels as long
+  // as none of the results would have to become a BigNumber
+  template <class Op>
+  void elementWise(const Value& other, Value& (Value::*generic)(const Value&)) {
+    ARRAY& a = *data.array;
+    size_t n = a.size();
+    if (_ISARR(other.type)) {
+      if (other.data.array->size() < n) n = other.data.array->size();
+      const double* b;
+      std::vector<double> buffer;
+      if (other.data.array->numbers(b, buffer) && a.pack()
+#ifndef USE_DOUBLE
+          && packedInRange(a.packed.data(), n, Op::limit(), Op::wholeThousandths())
+          && packedInRange(b, n, Op::limit(), Op::wholeThousandths())
+#endif
+          ) {
+        packedApply(a.packed.data(), b, n, Op());
+        return;
+      }
+      a.unpack();
+      for (size_t i = 0; i < n; i++) {
+        (a[i].*generic)(other.data.array->element(i));
+      }
+    } else {
+      if (_ISNUMBER(other.type) && a.pack()) {
+        double b = other.toDouble();
+#ifndef USE_DOUBLE
+        if (other.type == Types::Number && packedInRange(a.packed.data(), n, Op::limit(), Op::wholeThousandths())
+            && packedInRange(&b, 1, Op::limit(), Op::wholeThousandths()))
+#endif
+        {
+          packedApply(a.packed.data(), b, n, Op());
+          return;
+        }
+      }
+      a.unpack();
+      for (size_t i = 0; i < n; i++) {
+        (a[i].*generic)(other);
+      }
+    }
+  }
+#endif
+
+  Value& operator+=(const Value& other) {
+    modify_linked()
+#ifndef USE_ARDUINO_ARRAY
+    if (_ISARR(type) && (_ISARR(other.type) || IS_NUM(other))) {
+      elementWise<PackedAdd>(other, &Value::operator+=);
+      return *this;
+    }
+#endif
+#ifndef USE_DOUBLE
+    if (_ISBIGNUMBER(type) && _ISBIGNUMBER(other.type)) {
+      *data.number += *other.data.number;
+    } else if (_ISNUMBER(type) && _ISNUMBER(other.type)) {
+      if (type != Types::SmallNumber) {
+        unsigned char digitCount = countDigits(data.smallNumber);
+        unsigned char otherDigitCount = countDigits(other.data.smallNumber);
+        bool limitExceed = digitCount + otherDigitCount > 14;
+        if ((data.smallNumber < 0) ^ (other.data.smallNumber < 0)) limitExceed = false; // one of the numbers is negative
+        if (limitExceed || digitCount > 8 || otherDigitCount > 8) {
+  #ifndef USE_BIG_NUMBER
+          NUMBER n = NUMBER(std::to_string(other.data.smallNumber));
+          data.number = new NUMBER(std::to_string(data.smallNumber));
+          _count_stat(allocations[(int) Types::BigNumber], 1);
+  #else
+          NUMBER n = NUMBER(other.toString().c_str());
+          data.number = new NUMBER(toString().c_str());
+          _count_stat(allocations[(int) Types::BigNumber], 1);
+  #endif
+          type = Types::BigNumber;
+          _count_stat(promotions[ValueStats::Add], 1);
+          _trace_event("promote +=", Types::BigNumber, 0);
+          useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+          *data.number += n;
+        } else {
+          goto addDoubles;
+        }
+      } else {
+        addDoubles:
+        data.smallNumber += other.toDouble();
+      }
+    } else if (_ISBIGNUMBER(type) && _ISNUMBER(other.type)) {
+#ifndef USE_BIG_NUMBER
+      NUMBER n = NUMBER(std::to_string(other.data.smallNumber));
+#else
+      NUMBER n = NUMBER(other.toString().c_str());
+#endif
+      *data.number += n;
+    } else if (_ISNUMBER(type) && _ISBIGNUMBER(other.type)) {
+#ifndef USE_BIG_NUMBER
+      data.number = new NUMBER(std::to_string(data.smallNumber));
+      _count_stat(allocations[(int) Types::BigNumber], 1);
+#else
+      data.number = new NUMBER(toString().c_str());
+      _count_stat(allocations[(int) Types::BigNumber], 1);
+#endif
+      type = Types::BigNumber;
+      _count_stat(promotions[ValueStats::Add], 1);
+      _trace_event("promote +=", Types::BigNumber, 0);
+      useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+      *data.number += *other.data.number;
+#else
+    if (_ISNUMBER(type) && _ISNUMBER(other.type)) {
+      data.number += other.data.number;
+#endif
+    } else if (_ISTEXT(type) || _ISTEXT(other.type)) { // If either a or b is text
+      if (_ISTEXT(type)) {
+        *data.text += other.toString();
+      } else {
+        _release_value()
+        useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+        auto temp = data;
+        data.text = new TEXT(toString() + other.toString());
+        _count_stat(allocations[(int) Types::Text], 1);
+#ifndef USE_DOUBLE
+        if (_ISBIGNUMBER(type)) delete temp.number;
+#endif
+        if (_ISARR(type) || _ISMAP(type)) freeContainer(type, temp);
+        type = Types::Text;
+      }
+    }
+    return *this;
+  }
+
+  Value operator+(const Value& other) const & {
+    Value v = *this;
+    v += other;
+    return v;
+  }
+
+  // the left side is a temporary (like a * b in a * b + c), so its storage (and BigNumber) can be reused
+  Value operator+(const Value& other) && {
+    *this += other;
+    return static_cast<Value&&>(*this);
+  }
+
+  Value& operator-=(const Value& other) {
+    modify_linked()
+#ifndef USE_ARDUINO_ARRAY
+    if (_ISARR(type) && (_ISARR(other.type) || IS_NUM(other))) {
+      elementWise<PackedSub>(other, &Value::operator-=);
+      return *this;
+    }
+#endif
+#ifndef USE_DOUBLE
+    if (_ISBIGNUMBER(type) && _ISBIGNUMBER(other.type)) {
+      *data.number -= *other.data.number;
+    } else if (_ISNUMBER(type) && _ISNUMBER(other.type)) {
+      if (type != Types::SmallNumber) {
+        unsigned char digitCount = countDigits(data.smallNumber);
+        unsigned char otherDigitCount = countDigits(other.data.smallNumber);
+        bool limitExceed = digitCount + otherDigitCount > 14;
+        if ((data.smallNumber > 0) == (other.data.smallNumber > 0)) limitExceed = false; // both of the numbers have the same sign
+        if (limitExceed || digitCount > 8 || otherDigitCount > 8) {
+  #ifndef USE_BIG_NUMBER
+          NUMBER n = NUMBER(std::to_string(other.data.smallNumber));
+          data.number = new NUMBER(std::to_string(data.smallNumber));
+          _count_stat(allocations[(int) Types::BigNumber], 1);
+  #else
+          NUMBER n = NUMBER(other.toString().c_str());
+          data.number = new NUMBER(toString().c_str());
+          _count_stat(allocations[(int) Types::BigNumber], 1);
+  #endif
+          type = Types::BigNumber;
+          _count_stat(promotions[ValueStats::Subtract], 1);
+          _trace_event("promote -=", Types::BigNumber, 0);
+          useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+          *data.number -= n;
+        } else {
+          goto subDoubles;
+        }
+      } else {
+        subDoubles:
+        data.smallNumber -= other.toDouble();
+      }
+    } else if (_ISBIGNUMBER(type) && _ISNUMBER(other.type)) {
+#ifndef USE_BIG_NUMBER
+      NUMBER n = NUMBER(std::to_string(other.data.smallNumber));
+#else
+      NUMBER n = NUMBER(other.toString().c_str());
+#endif
+      *data.number -= n;
+    } else if (_ISNUMBER(type) && _ISBIGNUMBER(other.type)) {
+#ifndef USE_BIG_NUMBER
+      data.number = new NUMBER(std::to_string(data.smallNumber));
+      _count_stat(allocations[(int) Types::BigNumber], 1);
+#else
+      data.number = new NUMBER(toString().c_str());
+      _count_stat(allocations[(int) Types::BigNumber], 1);
+#endif
+      type = Types::BigNumber;
+      _count_stat(promotions[ValueStats::Subtract], 1);
+      _trace_event("promote -=", Types::BigNumber, 0);
+      useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+      *data.number -= *other.data.number;
+#else
+    if (_ISNUMBER(type) && _ISNUMBER(other.type)) {
+      data.number -= other.data.number;
+#endif
+    } else if (_ISTEXT(type) || _ISTEXT(other.type)) { // If either a or b is text
+      if (_ISTEXT(type)) {
+        *data.text = toString();
+      } else {
+        TEXT* t = new TEXT(toString());
+        _count_stat(allocations[(int) Types::Text], 1);
+        freeUnusedMemory();
+        data.text = t;
+      }
+#ifndef USE_ARDUINO_STRING
+      TEXT t = other.toString();
+      int i = data.text->find(t);
+      if (i != -1) data.text->replace(i, t.length(), "");
+#else
+      data.text->replace(other.toString(), "");
+#endif
+      type = Types::Text;
+    }
+    return *this;
+  }
+
+  Value operator-(const Value& other) const & {
+    Value v = *this;
+    v -= other;
+    return v;
+  }
+
+  Value operator-(const Value& other) && {
+    *this -= other;
+    return static_cast<Value&&>(*this);
+  }
+
+  Value& operator*=(const Value& other) {
+    modify_linked()
+#ifndef USE_ARDUINO_ARRAY
+    if (_ISARR(type) && (_ISARR(other.type) || IS_NUM(other))) {
+      elementWise<PackedMul>(other, &Value::operator*=);
+      return *this;
+    }
+#endif
+#ifndef USE_DOUBLE
+    if (_ISBIGNUMBER(type) && _ISBIGNUMBER(other.type)) {
+      *data.number *= *other.data.number;
+    } else if (_ISNUMBER(type) && _ISNUMBER(other.type)) {
+      if (type != Types::SmallNumber) {
+        unsigned char digitCount = countDigits(data.smallNumber);
+        unsigned char otherDigitCount = countDigits(other.data.smallNumber);
+        bool limitExceed = digitCount + otherDigitCount > 8;
+        double t = data.smallNumber, t2 = other.data.smallNumber;
+        t *= 1000; t2 *= 1000;
+        if (fmod(t, 1) != 0 || fmod(t2, 1) != 0) {
+          limitExceed = true;
+        } else if (::floor(data.smallNumber) == 0 || ::floor(other.data.smallNumber) == 0) {
+          limitExceed = false;
+        }
+        if (limitExceed || digitCount > 8 || otherDigitCount > 8) {
+  #ifndef USE_BIG_NUMBER
+          NUMBER n = NUMBER(std::to_string(other.data.smallNumber));
+          data.number = new NUMBER(std::to_string(data.smallNumber));
+          _count_stat(allocations[(int) Types::BigNumber], 1);
+  #else
+          NUMBER n = NUMBER(other.toString().c_str());
+          data.number = new NUMBER(toString().c_str());
+          _count_stat(allocations[(int) Types::BigNumber], 1);
+  #endif
+          type = Types::BigNumber;
+          _count_stat(promotions[ValueStats::Multiply], 1);
+          _trace_event("promote *=", Types::BigNumber, 0);
+          useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+          *data.number *= n;
+        } else {
+          goto multiplyDoubles;
+        }
+      } else {
+        multiplyDoubles:
+        data.smallNumber *= other.toDouble();
+      }
+    } else if (_ISBIGNUMBER(type) && _ISNUMBER(other.type)) {
+#ifndef USE_BIG_NUMBER
+      NUMBER n = NUMBER(std::to_string(other.data.smallNumber));
+#else
+      NUMBER n = NUMBER(other.toString().c_str());
+#endif
+      *data.number *= n;
+    } else if (_ISNUMBER(type) && _ISBIGNUMBER(other.type)) {
+#ifndef USE_BIG_NUMBER
+      data.number = new NUMBER(std::to_string(data.smallNumber));
+      _count_stat(allocations[(int) Types::BigNumber], 1);
+#else
+      data.number = new NUMBER(toString().c_str());
+      _count_stat(allocations[(int) Types::BigNumber], 1);
+#endif
+      type = Types::BigNumber;
+      _count_stat(promotions[ValueStats::Multiply], 1);
+      _trace_event("promote *=", Types::BigNumber, 0);
+      useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+      *data.number *= *other.data.number;
+#else
+    if (_ISNUMBER(type) && _ISNUMBER(other.type)) {
+      data.number *= other.data.number;
+#endif
+    } else if (_ISTEXT(type) && _ISBIGNUMBER(other.type)) {
+#ifndef USE_ARDUINO_STRING
+      std::ostringstream os;
+      for (NUMBER i = 0; i < 
+#ifndef USE_DOUBLE
+      *other.data.number
+#else
+      other.data.number
+#endif
+      ; i++) {
+        os << toString();
+      }
+      *data.text = os.str();
+#else
+      String s;
+      for (NUMBER i = 0; i < 
+#ifndef USE_DOUBLE
+      *other.data.number
+#else
+      other.data.number
+#endif
+      ; i++) {
+        s += toString();
+      }
+      *data.text = s;
+#endif
+    } else if (_ISBIGNUMBER(type) && _ISTEXT(other.type)) {
+#ifndef USE_ARDUINO_STRING
+      std::ostringstream os;
+      for (NUMBER i = 0; i < 
+#ifndef USE_DOUBLE
+      *data.number
+#else
+      data.number
+#endif
+      ; i++) {
+        os << other.toString();
+      }
+      freeUnusedMemory();
+      type = Types::Text;
+      data.text = new TEXT(os.str());
+      _count_stat(allocations[(int) Types::Text], 1);
+#else
+      String s;
+      for (NUMBER i = 0; i < 
+#ifndef USE_DOUBLE
+      *data.number
+#else
+      data.number
+#endif
+      ; i++) {
+        s += other.toString();
+      }
+      freeUnusedMemory();
+      type = Types::Text;
+      data.text = new TEXT(s);
+      _count_stat(allocations[(int) Types::Text], 1);
+#endif
+    } else if (_ISTEXT(type) && _ISNUMBER(other.type)) {
+#ifndef USE_ARDUINO_STRING
+      std::ostringstream os;
+      for (long i = 0; i < 
+#ifndef USE_DOUBLE
+      other.data.smallNumber
+#else
+      other.data.number
+#endif
+      ; i++) {
+        os << toString();
+      }
+      *data.text = os.str();
+#else
+      String s;
+      for (long i = 0; i < 
+#ifndef USE_DOUBLE
+      other.data.smallNumber
+#else
+      other.data.number
+#endif
+      ; i++) {
+        s += toString();
+      }
+      *data.text = s;
+#endif
+    } else if (_ISBIGNUMBER(type) && _ISTEXT(other.type)) {
+#ifndef USE_ARDUINO_STRING
+      std::ostringstream os;
+      for (NUMBER i = 0; i < 
+#ifndef USE_DOUBLE
+      *data.number
+#else
+      data.number
+#endif
+      ; i++) {
+        os << other.toString();
+      }
+      freeUnusedMemory();
+      type = Types::Text;
+      data.text = new TEXT(os.str());
+      _count_stat(allocations[(int) Types::Text], 1);
+#else
+      String s;
+      for (NUMBER i = 0; i < 
+#ifndef USE_DOUBLE
+      *data.number
+#else
+      data.number
+#endif
+      ; i++) {
+        s += other.toString();
+      }
+      freeUnusedMemory();
+      type = Types::Text;
+      data.text = new TEXT(s);
+      _count_stat(allocations[(int) Types::Text], 1);
+#endif
+    }
+    return *this;
+  }
+
+  Value operator*(const Value& other) const & {
+    Value v = *this;
+    v *= other;
+    return v;
+  }
+
+  Value operator*(const Value& other) && {
+    *this *= other;
+    return static_cast<Value&&>(*this);
+  }
+
+  Value& operator/=(const Value& other) {
+    modify_linked()
+#ifndef USE_ARDUINO_ARRAY
+    if (_ISARR(type) && (_ISARR(other.type) || IS_NUM(other))) {
+      elementWise<PackedDiv>(other, &Value::operator/=);
+      return *this;
+    }
+#endif
+#ifndef USE_DOUBLE
+    if (_ISBIGNUMBER(type) && _ISBIGNUMBER(other.type)) {
+      *data.number /= *other.data.number;
+    } else if (_ISNUMBER(type) && _ISNUMBER(other.type)) {
+      if (type != Types::SmallNumber) {
+        bool limitExceed = false;
+        unsigned char otherDigitCount = countDigits(other.data.smallNumber);
+        unsigned char digitCount = countDigits(data.smallNumber);
+        if (digitCount > 8 || otherDigitCount > 8) {
+          limitExceed = true;
+        } else {
+          double t = data.smallNumber, t2 = other.data.smallNumber;
+          t *= 1000; t2 *= 1000;
+          if (fmod(t, 1) != 0 || fmod(t2, 1) != 0) {
+            limitExceed = true;
+          } else if (fmod(data.smallNumber, 1) != 0) {
+            if (otherDigitCount + 3 > 9) {
+              limitExceed = true;
             }
           } else if (fmod(other.data.smallNumber, 1) != 0) {
             if (digitCount + 3 > 9) {
@@ -1818,247 +5217,1501 @@ public:
   #ifndef USE_BIG_NUMBER
           NUMBER n = NUMBER(std::to_string(other.data.smallNumber));
           data.number = new NUMBER(std::to_string(data.smallNumber));
+          _count_stat(allocations[(int) Types::BigNumber], 1);
   #else
           NUMBER n = NUMBER(other.toString().c_str());
           data.number = new NUMBER(toString().c_str());
+          _count_stat(allocations[(int) Types::BigNumber], 1);
   #endif
           type = Types::BigNumber;
-          useCount = new USE_COUNT_TYPE; *useCount = 0;
-          *data.number /= n;
+          _count_stat(promotions[ValueStats::Divide], 1);
+          _trace_event("promote /=", Types::BigNumber, 0);
+          useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+          *data.number /= n;
+        } else {
+          goto divDoubles;
+        }
+      } else {
+        divDoubles:
+        data.smallNumber /= other.toDouble();
+      }
+    } else if (_ISBIGNUMBER(type) && _ISNUMBER(other.type)) {
+#ifndef USE_BIG_NUMBER
+      NUMBER n = NUMBER(std::to_string(other.data.smallNumber));
+#else
+      NUMBER n = NUMBER(other.toString().c_str());
+#endif
+      *data.number /= n;
+    } else if (_ISNUMBER(type) && _ISBIGNUMBER(other.type)) {
+#ifndef USE_BIG_NUMBER
+      data.number = new NUMBER(std::to_string(data.smallNumber));
+      _count_stat(allocations[(int) Types::BigNumber], 1);
+#else
+      data.number = new NUMBER(toString().c_str());
+      _count_stat(allocations[(int) Types::BigNumber], 1);
+#endif
+      type = Types::BigNumber;
+      _count_stat(promotions[ValueStats::Divide], 1);
+      _trace_event("promote /=", Types::BigNumber, 0);
+      useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+      *data.number /= *other.data.number;
+#else
+    if (_ISNUMBER(type) && _ISNUMBER(other.type)) {
+      data.number /= other.data.number;
+#endif
+    } else {
+      *this = 0;
+    }
+    return *this;
+  }
+
+  Value operator/(const Value& other) const & {
+    Value v = *this;
+    v /= other;
+    return v;
+  }
+
+  Value operator/(const Value& other) && {
+    *this /= other;
+    return static_cast<Value&&>(*this);
+  }
+
+  Value& operator%=(const Value& other) {
+    modify_linked()
+    if (_ISNUMBER(type) && _ISNUMBER(other.type)) {
+#ifdef USE_DOUBLE
+      data.number = (long) data.number % (long) other.data.number;
+#else
+      data.smallNumber = (long) data.smallNumber % (long) other.data.smallNumber;
+    } else if (_ISBIGNUMBER(type) && _ISBIGNUMBER(other.type)) {
+#ifndef USE_BIG_NUMBER
+      *data.number = floor(*data.number);
+      mpz_class t(toString().c_str());
+      t %= *other.data.number;
+      *data.number = t;
+#else
+      *data.number = *data.number % *other.data.number;
+#endif
+    } else if (_ISBIGNUMBER(type) && _ISNUMBER(other.type)) {
+#ifndef USE_BIG_NUMBER
+      *data.number = floor(*data.number);
+      mpz_class t(toString().c_str());
+      t %= other.data.smallNumber;
+      *data.number = t;
+#else
+      *data.number = *data.number % other.data.smallNumber;
+#endif
+    } else if (_ISNUMBER(type) && _ISBIGNUMBER(other.type)) {
+      data.smallNumber = (long) data.smallNumber % (long) other;
+#endif
+    } else {
+      *this = 0;
+    }
+    return *this;
+  }
+
+  Value operator%(const Value& other) const & {
+    Value v = *this;
+    v %= other;
+    return v;
+  }
+
+  Value operator%(const Value& other) && {
+    *this %= other;
+    return static_cast<Value&&>(*this);
+  }
+
+  Value operator++(int) {
+    Value tmp = this;
+    if (_ISNUMBER(type)) {
+#ifdef USE_DOUBLE
+      data.number ++;
+#else
+      data.smallNumber ++;
+    } else if (_ISBIGNUMBER(type)) {
+      *data.number += 1;
+#endif
+    }
+    return tmp;
+  }
+
+  Value& operator++() {
+    if (_ISNUMBER(type)) {
+#ifdef USE_DOUBLE
+      data.number ++;
+#else
+      data.smallNumber ++;
+    } else if (_ISBIGNUMBER(type)) {
+      *data.number += 1;
+#endif
+    }
+    return *this;
+  }
+
+  Value operator--(int) {
+    Value tmp = this;
+    if (_ISNUMBER(type)) {
+#ifdef USE_DOUBLE
+      data.number --;
+#else
+      data.smallNumber --;
+    } else if (_ISBIGNUMBER(type)) {
+      *data.number -= 1;
+#endif
+    }
+    return tmp;
+  }
+
+  Value& operator--() {
+    if (_ISNUMBER(type)) {
+#ifdef USE_DOUBLE
+      data.number --;
+#else
+      data.smallNumber --;
+    } else if (_ISBIGNUMBER(type)) {
+      *data.number -= 1;
+#endif
+    }
+    return *this;
+  }
+
+  inline TEXT& getString() const {
+    return *data.text;
+  }
+
+  void pow(const Value& other) {
+    modify_linked()
+    if (_ISNUMBER(type) && _ISNUMBER(other.type)) {
+#ifdef USE_DOUBLE
+      double e = other.data.number, r;
+      if (e >= 0 && e == ::floor(e) && e <= 0xFFFFFFFFUL && data.number == ::floor(data.number)
+          && powBySquaring(data.number, (unsigned long) e, 9007199254740992.0, r)) {
+        data.number = r;
+      } else {
+        data.number = ::pow(data.number, e);
+      }
+#else
+      double e = other.data.smallNumber, r;
+      bool integerPower = e >= 0 && e == ::floor(e) && e <= 0xFFFFFFFFUL && data.smallNumber == ::floor(data.smallNumber);
+      if (type == Types::SmallNumber || e < 0 || e != ::floor(e)) {
+        // negative and fractional exponents never make long integers, so they don't need a BigNumber
+        if (integerPower && powBySquaring(data.smallNumber, (unsigned long) e, 9007199254740992.0, r)) {
+          data.smallNumber = r;
+        } else {
+          data.smallNumber = ::pow(data.smallNumber, e);
+        }
+      } else if (integerPower) {
+        if (powBySquaring(data.smallNumber, (unsigned long) e, 10000000, r)) {
+          data.smallNumber = r;
+        } else {
+#ifndef USE_BIG_NUMBER
+          mpz_class z;
+          mpz_pow_ui(z.get_mpz_t(), mpz_class(data.smallNumber).get_mpz_t(), (unsigned long) e);
+          data.number = new NUMBER(z, mpz_sizeinbase(z.get_mpz_t(), 2) + 64);
+          _count_stat(allocations[(int) Types::BigNumber], 1);
+#else
+          data.number = new NUMBER(toString().c_str());
+          _count_stat(allocations[(int) Types::BigNumber], 1);
+          *data.number = data.number->pow((long) e);
+#endif
+          type = Types::BigNumber;
+          _count_stat(promotions[ValueStats::Pow], 1);
+          _trace_event("promote pow", Types::BigNumber, 0);
+          useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+        }
+      } else if (e <= 0xFFFFFFFFUL && e * log10(fabs(data.smallNumber)) + 1 >= 8) {
+        // a bigger exponent leaves ::pow an inf, a 0 or a 1 (and doesn't fit mpf_pow_ui)
+#ifndef USE_BIG_NUMBER
+        data.number = new NUMBER(std::to_string(data.smallNumber));
+        _count_stat(allocations[(int) Types::BigNumber], 1);
+#else
+        data.number = new NUMBER(toString().c_str());
+        _count_stat(allocations[(int) Types::BigNumber], 1);
+#endif
+        type = Types::BigNumber;
+        _count_stat(promotions[ValueStats::Pow], 1);
+        _trace_event("promote pow", Types::BigNumber, 0);
+        useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+#ifndef USE_BIG_NUMBER
+        mpf_pow_ui(data.number->get_mpf_t(), data.number->get_mpf_t(), (unsigned long) e);
+#else
+        *data.number = data.number->pow((long) e);
+#endif
+      } else {
+        data.smallNumber = ::pow(data.smallNumber, e);
+      }
+    } else if (_ISBIGNUMBER(type) && IS_NUM(other)) {
+      double e = other.toDouble();
+      // exponents past 32 bits get a double too, the power is an inf or a 0 then
+      if (e != ::floor(e) || fabs(e) > 0xFFFFFFFFUL) {
+        double r = ::pow(toDouble(), e);
+        if (isfinite(r)) {
+#ifndef USE_BIG_NUMBER
+          *data.number = r;
+#else
+          *data.number = NUMBER(Value(r).toString().c_str());
+#endif
+        } else {
+          freeUnusedMemory();
+          data.smallNumber = r;
+          type = Types::Number;
+        }
+        return;
+      }
+      unsigned long n = (unsigned long) fabs(e);
+#ifndef USE_BIG_NUMBER
+      if (mpf_integer_p(data.number->get_mpf_t())) {
+        mpz_class z(*data.number);
+        mpz_pow_ui(z.get_mpz_t(), z.get_mpz_t(), n);
+        size_t bits = mpz_sizeinbase(z.get_mpz_t(), 2) + 64;
+        if (bits > data.number->get_prec()) data.number->set_prec(bits);
+        *data.number = z;
+      } else {
+        mpf_pow_ui(data.number->get_mpf_t(), data.number->get_mpf_t(), n);
+      }
+      if (e < 0) *data.number = 1 / *data.number;
+#else
+      *data.number = data.number->pow((long) n);
+      if (e < 0) *data.number = NUMBER(1) / *data.number;
+#endif
+#endif
+    }
+  }
+
+  // this = (this ^ exp) % mod without building the whole power, all three have to be integers
+  void powMod(const Value& exp, const Value& mod) {
+    if (!(IS_NUM((*this))) || !(IS_NUM(exp)) || !(IS_NUM(mod))) return;
+    modify_linked()
+    double b = toDouble(), e = exp.toDouble(), m = mod.toDouble();
+#ifndef USE_DOUBLE
+    if (_ISBIGNUMBER(type) || _ISBIGNUMBER(exp.type) || _ISBIGNUMBER(mod.type) || m > 9007199254740992.0) {
+#ifndef USE_BIG_NUMBER
+      NUMBER bn = getNumber(), en = exp.getNumber(), mn = mod.getNumber();
+      if (mpf_integer_p(bn.get_mpf_t()) && mpf_integer_p(en.get_mpf_t()) && mpf_integer_p(mn.get_mpf_t()) && e >= 0 && m > 0) {
+        mpz_class z(bn), mz(mn);
+        mpz_powm(z.get_mpz_t(), z.get_mpz_t(), mpz_class(en).get_mpz_t(), mz.get_mpz_t());
+        size_t bits = mpz_sizeinbase(mz.get_mpz_t(), 2) + 64;
+        if (!_ISBIGNUMBER(type)) {
+          data.number = new NUMBER(z, bits);
+          _count_stat(allocations[(int) Types::BigNumber], 1);
+          type = Types::BigNumber;
+          _count_stat(promotions[ValueStats::PowMod], 1);
+          _trace_event("promote powMod", Types::BigNumber, 0);
+          useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
         } else {
-          goto divDoubles;
+          if (bits > data.number->get_prec()) data.number->set_prec(bits);
+          *data.number = z;
+        }
+        return;
+      }
+#else
+      if (e >= 0 && m > 0) {
+        NUMBER base = getNumber(), en = exp.getNumber(), mn = mod.getNumber(), r = 1, two = 2;
+        base = base % mn;
+        while (en > 0) {
+          NUMBER bit = en % two;
+          if (bit > 0) r = r * base % mn;
+          en = (en - bit) / two;
+          if (en > 0) base = base * base % mn;
+        }
+        if (!_ISBIGNUMBER(type)) {
+          data.number = new NUMBER(r);
+          _count_stat(allocations[(int) Types::BigNumber], 1);
+          type = Types::BigNumber;
+          _count_stat(promotions[ValueStats::PowMod], 1);
+          _trace_event("promote powMod", Types::BigNumber, 0);
+          useCount = new USE_COUNT_TYPE; *useCount = 0; _count_stat(useCounts, 1);
+        } else {
+          *data.number = r;
+        }
+        return;
+      }
+#endif
+    } else
+#endif
+    if (b == ::floor(b) && e == ::floor(e) && m == ::floor(m) && e >= 0 && e < 18446744073709551616.0
+        && m >= 1 && m <= 9007199254740992.0) {
+      double r = fmod(b, m);
+      if (r < 0) r += m;
+#ifdef USE_DOUBLE
+      data.number = ::powMod((unsigned long long) r, (unsigned long long) e, (unsigned long long) m);
+#else
+      data.smallNumber = ::powMod((unsigned long long) r, (unsigned long long) e, (unsigned long long) m);
+#endif
+      return;
+    }
+    pow(exp);
+    *this %= mod;
+  }
+};
+
+#ifndef USE_NOSTD_MAP
+inline size_t HashFunction::operator() (const Value& v) const {
+// #ifdef USE_ARDUINO_STRING
+//   return (std::hash<char*>() ((char*) v.toString().c_str())) ^
+// #else
+//   return (std::hash<std::string>() (v.toString())) ^
+// #endif
+//           (std::hash<int>()((int) v.getType()));
+
+  Types t = v.getType();
+  if (v.isSymbol()) {
+    return static_cast<const SymbolText*>(v.getData().text)->hash;
+  } else if (_ISTEXT(t)) {
+#ifdef USE_ARDUINO_STRING
+    return (std::hash<const char*>() (v.getString().c_str())) ^
+#else
+    return (std::hash<std::string>() (v.getString())) ^
+#endif
+            (std::hash<char>()((char) t));
+  } else if (_ISNULL(t) || _ISFALSE(t) || _ISTRUE(t)) {
+    return (std::hash<char>() (0) ^ (std::hash<char>() ((char) t)));
+  } else if (_ISNUMBER(t)) {
+#ifdef USE_DOUBLE
+    return (std::hash<double>() (v.getData().number) ^ (std::hash<char>() ((char) Types::Number)));
+#else
+    return (std::hash<double>() (v.getData().smallNumber) ^ (std::hash<char>() ((char) Types::Number)));
+#endif
+#ifndef USE_ARDUINO_ARRAY
+  } else if (_ISARR(t) || _ISMAP(t)) {
+    return hashNested(v);
+#else
+  } else if (_ISARR(t)) {
+    size_t hash = (std::hash<char>() ((char) Types::Array)), s = v.length();
+    while (s > 0) {
+      s--;
+      hash ^= s + this->operator() (v[s]);
+    }
+    return hash;
+  } else if (_ISMAP(t)) {
+    size_t hash = (std::hash<char>() ((char) Types::Map)), s = v.length();
+    if (v.getData().map->isPersistent) {
+      v.getData().map->forEach([this, &hash] (const Value& k, const Value& v) {
+        hash ^= this->operator() (k) ^ this->operator() (v);
+        return true;
+      });
+      return hash;
+    }
+    while (s > 0) {
+      s--;
+      hash ^= this->operator() (v.getKeyAt(s)) ^ this->operator() (v.getValueAt(s));
+    }
+    return hash;
+#endif
+  } else {
+#ifdef USE_ARDUINO_STRING
+    return (std::hash<char*>() ((char*) v.toString().c_str())) ^
+#else
+    return (std::hash<std::string>() (v.toString())) ^
+#endif
+            (std::hash<char>()((char) t));
+  }
+}
+
+#ifndef USE_ARDUINO_ARRAY
+// hashes nested arrays and maps with an explicit stack, an array adds the index of each item to its hash
+// and a map the hash of each key, map keys themselves are still hashed recursively. An array or map found
+// again inside itself (a cycle) counts as an empty one
+inline size_t HashFunction::hashNested(const Value& v) const {
+  struct Frame {
+    const Value* value;
+    size_t hash, next, offset;
+    std::vector<std::pair<const Value*, const Value*> > entries;
+  };
+  std::vector<Frame> stack;
+  std::unordered_set<const void*> payloads;
+  const Value* open = &v;
+  size_t result = 0;
+  while (true) {
+    if (open != 0) {
+      payloads.insert(_ISARR(open->getType()) ? (const void*) open->getData().array : (const void*) open->getData().map);
+      Frame f { open, 0, 0, 0, {} };
+      if (_ISARR(open->getType())) {
+        f.hash = std::hash<char>() ((char) Types::Array);
+        if (open->getData().array->isPacked) {
+          const std::vector<double>& packed = open->getData().array->packed;
+          size_t numberHash = std::hash<char>() ((char) Types::Number);
+          for (size_t i = 0; i < packed.size(); i++) {
+            f.hash ^= i + (std::hash<double>() (packed[i]) ^ numberHash);
+          }
+          f.next = packed.size();
         }
       } else {
-        divDoubles:
-        data.smallNumber /= other.toDouble();
+        f.hash = std::hash<char>() ((char) Types::Map);
+        f.entries.reserve(open->getData().map->size());
+        open->getData().map->forEach([&f] (const Value& k, const Value& v) {
+          f.entries.push_back(std::make_pair(&k, &v));
+          return true;
+        });
       }
-    } else if (_ISBIGNUMBER(type) && _ISNUMBER(other.type)) {
-#ifndef USE_BIG_NUMBER
-      NUMBER n = NUMBER(std::to_string(other.data.smallNumber));
+      stack.push_back(static_cast<Frame&&>(f));
+      open = 0;
+    }
+    Frame& f = stack.back();
+    bool isArray = _ISARR(f.value->getType());
+    size_t count = isArray ? f.value->length() : f.entries.size();
+    while (f.next < count) {
+      const Value& item = isArray ? f.value->getData().array->item(f.next) : *f.entries[f.next].second;
+      f.offset = isArray ? f.next : this->operator() (*f.entries[f.next].first);
+      f.next++;
+      Types t = item.getType();
+      size_t h;
+      if (_ISARR(t) && payloads.count(item.getData().array)) {
+        h = std::hash<char>() ((char) Types::Array);
+      } else if (_ISMAP(t) && payloads.count(item.getData().map)) {
+        h = std::hash<char>() ((char) Types::Map);
+      } else if (_ISARR(t) || _ISMAP(t)) {
+        open = &item;
+        break;
+      } else {
+        h = this->operator() (item);
+      }
+      f.hash ^= isArray ? f.offset + h : f.offset ^ h;
+    }
+    if (open != 0) continue;
+    result = f.hash;
+    payloads.erase(_ISARR(f.value->getType()) ? (const void*) f.value->getData().array : (const void*) f.value->getData().map);
+    stack.pop_back();
+    if (stack.empty()) return result;
+    Frame& parent = stack.back();
+    parent.hash ^= _ISARR(parent.value->getType()) ? parent.offset + result : parent.offset ^ result;
+  }
+}
+
+// the hash of the i-th element of an array (its payload found again inside it hashes as an empty array)
+inline size_t hashElement(const ARRAY& a, size_t i) {
+  if (a.isPacked) return std::hash<double>() (a.packed[i]) ^ std::hash<char>() ((char) Types::Number);
+  const Value& item = a.item(i);
+  if (_ISARR(item.getType()) && item.getData().array == &a) return std::hash<char>() ((char) Types::Array);
+  return HashFunction()(item);
+}
+
+inline bool Value::parallelEquals(const Value& other, bool ordered) const {
+  if (!(_ISARR(type) && _ISARR(other.type)) && !(_ISMAP(type) && _ISMAP(other.type))) return *this == other;
+  if (length() != other.length()) return false;
+  ValueThreadPool& pool = ValueThreadPool::instance();
+  std::atomic<bool> equal(true);
+  if (_ISMAP(type)) {
+    const MAP& b = *other.data.map;
+    data.map->parallelForEach<char>([&b, &equal] (const Value& k, const Value& v, char&) {
+      if (!equal.load(std::memory_order_relaxed)) return;
+      const Value* o = b.find(k);
+      if (o == 0 || !(v == *o)) equal.store(false, std::memory_order_relaxed);
+    }, [] (char&) {});
+    return equal;
+  }
+  const ARRAY& a = parallelSource();
+  const ARRAY& b = other.parallelSource();
+  size_t n = a.size();
+  if (ordered) {
+    pool.parallelFor(n, 1024, [&] (size_t begin, size_t end) {
+      for (size_t i = begin; i < end && equal.load(std::memory_order_relaxed); i++) {
+        bool same;
+        if (a.isPacked && b.isPacked) same = a.packed[i] == b.packed[i];
+        else if (a.isPacked) same = b.item(i) == Value(a.packed[i]);
+        else if (b.isPacked) same = a.item(i) == Value(b.packed[i]);
+        else same = a.item(i) == b.item(i);
+        if (!same) equal.store(false, std::memory_order_relaxed);
+      }
+    });
+    return equal;
+  }
+  // the elements of both sorted by their hashes, then the ones with the same hash get matched
+  typedef std::pair<size_t, size_t> Hashed; // hash and index
+  std::vector<Hashed> ha(n), hb(n);
+  pool.parallelFor(n, 1024, [&] (size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      ha[i] = Hashed(hashElement(a, i), i);
+      hb[i] = Hashed(hashElement(b, i), i);
+    }
+  });
+  auto byHash = [] (const Hashed& x, const Hashed& y) { return x.first < y.first; };
+  parallelStableSort(ha.data(), n, byHash);
+  parallelStableSort(hb.data(), n, byHash);
+  pool.parallelFor(n, 1024, [&] (size_t begin, size_t end) {
+    for (size_t i = begin; i < end && equal.load(std::memory_order_relaxed); i++) {
+      if (ha[i].first != hb[i].first) equal.store(false, std::memory_order_relaxed);
+    }
+  });
+  if (!equal) return false;
+  pool.parallelFor(n, 1024, [&] (size_t begin, size_t end) {
+    std::vector<char> matched;
+    for (size_t i = begin; i < end && equal.load(std::memory_order_relaxed); i++) {
+      if (i > 0 && ha[i - 1].first == ha[i].first) continue; // in the run of the one before
+      size_t last = i + 1;
+      while (last < n && ha[last].first == ha[i].first) last++;
+      matched.assign(last - i, 0);
+      for (size_t x = i; x < last; x++) {
+        Value ex = a.isPacked ? Value(a.packed[ha[x].second]) : Value(); // packed elements are made on the spot
+        const Value& vx = a.isPacked ? ex : a.item(ha[x].second);
+        size_t y = i;
+        for (; y < last; y++) {
+          if (matched[y - i]) continue;
+          if (b.isPacked ? vx == Value(b.packed[hb[y].second]) : vx == b.item(hb[y].second)) break;
+        }
+        if (y == last) {
+          equal.store(false, std::memory_order_relaxed);
+          break;
+        }
+        matched[y - i] = 1;
+      }
+    }
+  });
+  return equal;
+}
+
+inline size_t Value::parallelHash(bool ordered) const {
+  if (!_ISARR(type) && !_ISMAP(type)) return HashFunction()(*this);
+  ValueThreadPool& pool = ValueThreadPool::instance();
+  std::mutex lock;
+  if (_ISMAP(type)) {
+    size_t hash = std::hash<char>() ((char) Types::Map);
+    const void* self = data.map;
+    data.map->parallelForEach<size_t>([self] (const Value& k, const Value& v, size_t& part) {
+      size_t h = _ISMAP(v.type) && v.data.map == self ? std::hash<char>() ((char) Types::Map) : HashFunction()(v);
+      part ^= HashFunction()(k) ^ h;
+    }, [&hash, &lock] (size_t& part) {
+      std::lock_guard<std::mutex> guard(lock);
+      hash ^= part;
+    });
+    return hash;
+  }
+  // xor of every index + element hash like HashFunction, or the sum of the mixed element hashes
+  const ARRAY& a = parallelSource();
+  size_t n = a.size(), hash = std::hash<char>() ((char) Types::Array);
+  pool.parallelFor(n, 1024, [&] (size_t begin, size_t end) {
+    size_t part = 0;
+    for (size_t i = begin; i < end; i++) {
+      size_t h = hashElement(a, i);
+      if (ordered) part ^= i + h;
+      else {
+        h ^= h >> 31;
+        h *= (size_t) 0x9E3779B97F4A7C15ULL;
+        part += h ^ (h >> 29);
+      }
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    if (ordered) hash ^= part;
+    else hash += part;
+  });
+  return hash;
+}
+#endif
 #else
-      NUMBER n = NUMBER(other.toString().c_str());
+inline Pair& Pair::operator= (const Pair& p) {
+  this->key = p.key;
+  this->value = p.value;
+  return *this;
+}
 #endif
-      *data.number /= n;
-    } else if (_ISNUMBER(type) && _ISBIGNUMBER(other.type)) {
+
+  static Value __NULL__;
+
+#ifndef USE_NOSTD_MAP
+#include <unordered_set>
+// payloads shared by Value::intern(), the values in here are never modified since every other value
+// pointing at their payloads copies it before modifying it
+class ValueInternTable {
+public:
+  std::unordered_set<Value, HashFunction> values;
+  size_t shared = 0; // payloads replaced by the one of an equal value
+  size_t bytesSaved = 0; // roughly what the replaced payloads that got freed took
+
+  static ValueInternTable& instance() {
+    static ValueInternTable table;
+    return table;
+  }
+
+  void clear() {
+    values.clear();
+    shared = 0;
+    bytesSaved = 0;
+  }
+
+  // memory held by a payload itself (not counting what its elements point to)
+  static size_t payloadSize(const Value& v) {
+    return v.payloadMemory();
+  }
+};
+
+inline size_t Value::payloadMemory() const {
+  size_t size = useCount && useCount != frozenCount() ? sizeof(USE_COUNT_TYPE) : 0;
+  if (_ISTEXT(type)) {
+    size += type == Types::Symbol ? sizeof(SymbolText) : sizeof(TEXT);
+#ifdef USE_ARDUINO_STRING
+    size += data.text->length() + 1;
+#else
+    if (data.text->capacity() > 15) size += data.text->capacity() + 1; // shorter ones fit inside the TEXT
+#endif
+  }
+#ifndef USE_DOUBLE
+  else if (_ISBIGNUMBER(type)) {
+    size += sizeof(NUMBER);
 #ifndef USE_BIG_NUMBER
-      data.number = new NUMBER(std::to_string(data.smallNumber));
+    size += (data.number->get_mpf_t()->_mp_prec + 1) * sizeof(mp_limb_t);
+#endif
+  }
+#endif
+  else if (_ISARR(type)) {
+#ifdef USE_ARDUINO_ARRAY
+    size += sizeof(ARRAY) + data.array->size() * sizeof(Value);
 #else
-      data.number = new NUMBER(toString().c_str());
+    const ARRAY& a = *data.array;
+    size += sizeof(ARRAY) + a.packed.capacity() * sizeof(double) + a.capacity() * sizeof(Value) + a.persistent.size() * sizeof(Value);
+#endif
+  } else if (_ISMAP(type)) {
+    const MAP& m = *data.map;
+    size += sizeof(MAP);
+    const size_t hashed = m.hashEntries().size();
+    if (m.shape) size += m.slots.capacity() * sizeof(Value);
+    if (m.isPersistent) size += m.size() * 2 * sizeof(Value);
+    else if (!m.shape || hashed) size += m.hashEntries().bucket_count() * sizeof(void*) + hashed * (sizeof(void*) + 2 * sizeof(Value) + sizeof(size_t)); // nodes with their hash
+  }
+  return size;
+}
+
+#ifndef USE_ARDUINO_ARRAY
+inline size_t Value::memoryUsage(bool sharedOnce) const {
+  MemoryWalk& walk = memoryWalk();
+  walk.reset();
+  size_t total = 0;
+  bool found;
+  walk.stack.push_back(MemoryWalk::Item { this, 0, 0 });
+  while (!walk.stack.empty()) {
+    MemoryWalk::Item item = walk.stack.back();
+    walk.stack.pop_back();
+    if (item.payload) {
+      walk.get(item.payload, found).second = total - item.start;
+      continue;
+    }
+    const Value& v = *item.value;
+    const void* payload;
+    if (_ISTEXT(v.type)) payload = v.data.text;
+#ifndef USE_DOUBLE
+    else if (_ISBIGNUMBER(v.type)) payload = v.data.number;
+#endif
+    else if (_ISARR(v.type)) payload = v.data.array;
+    else if (_ISMAP(v.type)) payload = v.data.map;
+    else continue; // held inside the value
+    bool container = _ISARR(v.type) || _ISMAP(v.type);
+    // a shared container found again counts what it did the first time (nothing if it is still
+    // being counted, it is inside itself) so the walk takes linear time either way
+    if ((v.type == Types::Symbol || (v.useCount && *v.useCount > 0)) && (sharedOnce || container)) {
+      std::pair<const void*, size_t>& e = walk.get(payload, found);
+      if (found) {
+        if (!sharedOnce && e.second != (size_t) -1) total += e.second;
+        continue;
+      }
+      if (container) walk.stack.push_back(MemoryWalk::Item { 0, payload, total });
+    }
+    total += v.payloadMemory();
+    if (_ISARR(v.type)) {
+      const ARRAY& a = *v.data.array;
+      if (a.isView) walk.stack.push_back(MemoryWalk::Item { &a.viewOf, 0, 0 });
+      else if (a.isPersistent) a.persistent.forEach([&walk] (const Value& e) { walk.stack.push_back(MemoryWalk::Item { &e, 0, 0 }); });
+      else if (!a.isPacked) {
+        for (size_t i = 0; i < a.size(); i++) walk.stack.push_back(MemoryWalk::Item { &a.item(i), 0, 0 });
+      }
+    } else if (_ISMAP(v.type)) {
+      const MAP& m = *v.data.map;
+      if (m.shape) { // the keys belong to the shape, but not the ones of the hash map next to it
+        for (size_t i = 0; i < m.slots.size(); i++) walk.stack.push_back(MemoryWalk::Item { &m.slots[i], 0, 0 });
+        for (auto it = m.hashEntries().begin(); it != m.hashEntries().end(); it++) {
+          walk.stack.push_back(MemoryWalk::Item { &it->first, 0, 0 });
+          walk.stack.push_back(MemoryWalk::Item { &it->second, 0, 0 });
+        }
+      } else {
+        m.forEach([&walk] (const Value& k, const Value& e) {
+          walk.stack.push_back(MemoryWalk::Item { &k, 0, 0 });
+          walk.stack.push_back(MemoryWalk::Item { &e, 0, 0 });
+          return true;
+        });
+      }
+    }
+  }
+  return total;
+}
 #endif
-      type = Types::BigNumber;
-      useCount = new USE_COUNT_TYPE; *useCount = 0;
-      *data.number /= *other.data.number;
+
+inline void Value::intern() {
+  intern(ValueInternTable::instance());
+}
+
+inline void Value::intern(ValueInternTable& table) {
+  if (useCount == 0 || type == Types::Symbol || isFrozen()) return;
+  // the elements first, so equal arrays and maps end up with the same element payloads too. They are
+  // modified, so like for any other modification this value gets a payload of its own before
+  if (*useCount != 0) clone();
+  if (_ISARR(type)) {
+#ifdef USE_ARDUINO_ARRAY
+    for (size_t i = 0; i < data.array->size(); i++) (*data.array)[i]->intern(table);
 #else
-    if (_ISNUMBER(type) && _ISNUMBER(other.type)) {
-      data.number /= other.data.number;
+    data.array->materialize();
+    if (data.array->isPersistent) {
+      // ref() copies the nodes the trie still shares with other arrays
+      for (size_t i = 0; i < data.array->size(); i++) data.array->persistent.ref(i).intern(table);
+    } else if (!data.array->isPacked) {
+      for (size_t i = 0; i < data.array->size(); i++) (*data.array)[i].intern(table);
+    }
 #endif
+  } else if (_ISMAP(type)) {
+    MAP& m = *data.map;
+    if (m.isPersistent) {
+      // same for the nodes of a persistent map, whose keys are left as they are
+      std::vector<Value> keys;
+      m.forEach([&keys] (const Value& k, const Value&) {
+        keys.push_back(k);
+        return true;
+      });
+      for (size_t i = 0; i < keys.size(); i++) m.persistent[keys[i]].intern(table);
     } else {
-      *this = 0;
+      // the keys of a shape are shared by every map with that shape, only the keys of a hash map are
+      // interned (an equal payload doesn't change their hashes)
+      m.forEach([&table, &m] (const Value& k, const Value& v) {
+        if (!m.shape) const_cast<Value&>(k).intern(table);
+        const_cast<Value&>(v).intern(table);
+        return true;
+      });
+    }
+  }
+  auto it = table.values.find(*this);
+  if (it == table.values.end()) {
+    // values sharing this payload without copyBeforeModification could still modify it
+    if (*useCount != 0) clone();
+    copyBeforeModification = true;
+    table.values.insert(*this);
+    return;
+  }
+  if (it->useCount == useCount) return;
+  if (*useCount == 0) table.bytesSaved += ValueInternTable::payloadSize(*this);
+  table.shared++;
+  *this = *it;
+}
+
+// texts turned into symbols, kept until the end of the program (it is never destroyed so that no
+// symbol gets freed before the values using it), symbols have no use count so values in different
+// threads can share them
+class ValueSymbolTable {
+public:
+  std::unordered_set<Value, HashFunction> symbols;
+#ifdef USE_THREADS
+  std::mutex lock;
+#endif
+
+  static ValueSymbolTable& instance() {
+    static ValueSymbolTable* table = new ValueSymbolTable();
+    return *table;
+  }
+};
+
+inline Value Value::symbol(const Value& text) {
+  if (!_ISTEXT(text.type) || text.type == Types::Symbol) return text;
+  ValueSymbolTable& table = ValueSymbolTable::instance();
+#ifdef USE_THREADS
+  std::lock_guard<std::mutex> guard(table.lock);
+#endif
+  auto it = table.symbols.find(text);
+  if (it != table.symbols.end()) return *it;
+  SymbolText* t = new SymbolText(*text.data.text);
+  _count_stat(allocations[(int) Types::Text], 1);
+  t->hash = HashFunction()(text);
+  Value res;
+  res.data.text = t;
+  res.type = Types::Symbol;
+  table.symbols.insert(res);
+  return res;
+}
+
+#ifndef USE_ARDUINO_ARRAY
+inline Value Value::deepCopy() const {
+  Value res;
+  std::vector<std::pair<const Value*, Value*> > work(1, std::make_pair(this, &res));
+  while (!work.empty()) {
+    const Value& from = *work.back().first;
+    Value& to = *work.back().second;
+    work.pop_back();
+    if (from.useCount == 0) { // held inside the value, or a symbol
+      to = Value(from.data, from.type, 0);
+    } else if (_ISTEXT(from.type)) {
+      to = Value(*from.data.text);
+    }
+#ifndef USE_DOUBLE
+    else if (_ISBIGNUMBER(from.type)) {
+      to = Value(*from.data.number);
+    }
+#endif
+    else if (_ISARR(from.type)) {
+      const ARRAY& a = *from.data.array;
+      to = Value(Types::Array);
+      ARRAY& b = *to.data.array;
+      if (a.isPacked && !a.isView) {
+        b.packed = a.packed;
+      } else {
+        b.unpack();
+        b.resize(a.size());
+        for (size_t i = 0; i < b.size(); i++) work.push_back(std::make_pair(&a.item(i), &b[i]));
+      }
+    } else if (_ISMAP(from.type)) {
+      const MAP& a = *from.data.map;
+      to = Value(Types::Map);
+      MAP& b = *to.data.map;
+      // every key first, adding one can move the values of the others
+      b.reserve(a.size());
+      a.forEach([&b] (const Value& k, const Value&) {
+        b[k.useCount == 0 ? k : k.deepCopy()];
+        return true;
+      });
+      a.forEach([&b, &work] (const Value& k, const Value& v) {
+        work.push_back(std::make_pair(&v, const_cast<Value*>(b.find(k))));
+        return true;
+      });
+    }
+  }
+  return res;
+}
+
+template <class F>
+inline void Value::forEachOwned(Value& v, F fn) {
+  std::vector<Value*> stack(1, &v);
+  while (!stack.empty()) {
+    Value& c = *stack.back();
+    stack.pop_back();
+    if (c.useCount == 0) continue; // held inside the value, or a symbol
+    fn(c);
+    if (_ISARR(c.type)) {
+      ARRAY& a = *c.data.array;
+      if (!a.isPacked) for (size_t i = 0; i < a.size(); i++) stack.push_back(&a[i]);
+    } else if (_ISMAP(c.type)) {
+      c.data.map->forEach([&stack] (const Value& k, const Value& v) {
+        stack.push_back(const_cast<Value*>(&k));
+        stack.push_back(const_cast<Value*>(&v));
+        return true;
+      });
+    }
+  }
+}
+
+inline Value Value::freeze() const {
+  Value res = deepCopy(); // plain arrays and maps, no payload shared with anything else
+  forEachOwned(res, [] (Value& v) {
+    if (_ISARR(v.type)) v.data.array->unpack(); // operator[] on a copy that isn't const would unpack it
+    delete v.useCount;
+    v.useCount = frozenCount();
+    v.copyBeforeModification = true;
+  });
+  return res;
+}
+
+inline void Value::thaw(Value& v) {
+  forEachOwned(v, [] (Value& c) {
+    c.useCount = 0; // it owns its payload again
+    c.copyBeforeModification = false;
+  });
+}
+
+inline Value Value::diff(const Value& from, const Value& to) {
+  struct Step {
+    const Value* from;
+    const Value* to;
+    size_t depth; // of its path
+    Value key; // the last one of its path
+  };
+  Value patch = Types::Array;
+  std::vector<Value> path;
+  std::vector<Step> work(1, Step { &from, &to, 0, Value() });
+  auto operation = [&path] (const char* op, const Value* key) {
+    Value res = Types::Map, p = Types::Array;
+    p.extend(path.begin(), path.end());
+    if (key) p.append(*key);
+    res.put("op", op);
+    res.put("path", p);
+    return res;
+  };
+  auto sameElement = [] (const ARRAY& x, size_t i, const ARRAY& y, size_t j) {
+    if (x.isPacked && y.isPacked) return x.packed[i] == y.packed[j];
+    if (x.isPacked || y.isPacked) return x.element(i) == y.element(j);
+    return samePayload(x.item(i), y.item(j)) || x.item(i) == y.item(j);
+  };
+  while (!work.empty()) {
+    Step s = static_cast<Step&&>(work.back());
+    work.pop_back();
+    path.resize(s.depth);
+    if (s.depth) path.back() = s.key;
+    const Value& a = *s.from;
+    const Value& b = *s.to;
+    if (samePayload(a, b)) continue;
+    Types t = a.getType();
+    if (t != b.getType() || !(_ISTEXT(t) || _ISARR(t) || _ISMAP(t))) {
+      if (t == b.getType() && a == b) continue;
+      Value o = operation("replace", 0);
+      o.put("value", b);
+      patch.append(o);
+    } else if (_ISTEXT(t)) {
+      if (a == b) continue;
+      const TEXT& x = *a.data.text;
+      const TEXT& y = *b.data.text;
+      size_t nx = a.length(), ny = b.length(), p = 0, e = 0;
+      while (p < nx && p < ny && x[p] == y[p]) p++;
+      while (e < nx - p && e < ny - p && x[nx - 1 - e] == y[ny - 1 - e]) e++;
+      Value o = operation("splice", 0);
+      o.put("at", (long) p);
+      o.put("count", (long) (nx - p - e));
+      o.put("text", b.substring((long) p, (long) (ny - e)));
+      patch.append(o);
+    } else if (_ISARR(t)) {
+      const ARRAY& x = *a.data.array;
+      const ARRAY& y = *b.data.array;
+      size_t nx = x.size(), ny = y.size(), p = 0, e = 0;
+      while (p < nx && p < ny && sameElement(x, p, y, p)) p++;
+      while (e < nx - p && e < ny - p && sameElement(x, nx - 1 - e, y, ny - 1 - e)) e++;
+      // the elements left in between are paired up by index, the ones over go or come at the end
+      size_t mx = nx - p - e, my = ny - p - e, m = mx < my ? mx : my;
+      Value end = (long) (p + m);
+      if (mx > my) {
+        Value o = operation("remove", &end);
+        o.put("count", (long) (mx - my));
+        patch.append(o);
+      } else if (my > mx) {
+        Value o = operation("insert", &end), values = Types::Array;
+        values.reserve(my - mx);
+        for (size_t i = p + m; i < p + my; i++) values.append(y.element(i));
+        o.put("values", values);
+        patch.append(o);
+      }
+      if (x.isPacked || y.isPacked) {
+        for (size_t i = p; i < p + m; i++) {
+          if (sameElement(x, i, y, i)) continue;
+          Value index = (long) i, o = operation("replace", &index);
+          o.put("value", y.element(i));
+          patch.append(o);
+        }
+      } else {
+        for (size_t i = p + m; i-- > p;) work.push_back(Step { &x.item(i), &y.item(i), s.depth + 1, Value((long) i) });
+      }
+    } else {
+      const MAP& x = *a.data.map;
+      const MAP& y = *b.data.map;
+      x.forEach([&] (const Value& k, const Value& v) {
+        const Value* w = y.find(k);
+        if (w == 0) patch.append(operation("remove", &k));
+        else if (!samePayload(v, *w)) work.push_back(Step { &v, w, s.depth + 1, k });
+        return true;
+      });
+      y.forEach([&] (const Value& k, const Value& v) {
+        if (x.find(k) != 0) return true;
+        Value o = operation("insert", &k);
+        o.put("value", v);
+        patch.append(o);
+        return true;
+      });
+    }
+  }
+  return patch;
+}
+
+inline void Value::apply(const Value& patch) {
+  for (int i = 0; i < patch.length(); i++) {
+    const Value& o = patch[i];
+    const Value& path = o.get("path");
+    TEXT op = o.get("op").toString();
+    int n = path.length();
+    Value* parent = this;
+    for (int j = 0; j + 1 < n; j++) parent = &parent->child(path[j]);
+    if (op == "splice") {
+      Value& v = n == 0 ? *this : parent->child(path[n - 1]);
+      v.splice((long) o.get("at"), (long) o.get("count"), o.get("text"));
+    } else if (n == 0) {
+      if (op == "replace") *this = o.get("value");
+    } else if (op == "replace") {
+      parent->set(path[n - 1], o.get("value"));
+    } else if (op == "insert") {
+      if (_ISARR(parent->type)) parent->insertAll((long) path[n - 1], o.get("values"));
+      else parent->put(path[n - 1], o.get("value"));
+    } else if (op == "remove") {
+      if (_ISARR(parent->type)) {
+        size_t at = (long) path[n - 1];
+        parent->remove(at, at + (long) o.get("count"));
+      } else {
+        parent->remove(path[n - 1]);
+      }
+    }
+  }
+}
+
+#include <shared_mutex>
+#include <memory>
+#include <thread>
+// a map that threads can share (with USE_THREADS), its entries are spread over shards with a lock each
+// (picked by the hash of the key) so threads working on different shards don't wait for each other and
+// readers of a shard don't wait for each other either. Use counts aren't atomic, so keys and values are
+// copied in and out with deepCopy() and no payload in here is shared with the values of any thread.
+// snapshot() copies the whole map into a Types::Map at once, to iterate over it. It has only been
+// measured on a single core (up to 4 threads), where the shards buy nothing over a single mutex; how
+// it scales with threads running at the same time is still untested
+class ValueConcurrentMap {
+  struct Shard {
+    mutable std::shared_timed_mutex lock;
+    std::unordered_map<Value, Value, HashFunction> entries;
+    char padding[64]; // keeps the locks of two shards off the same cache line
+  };
+  std::unique_ptr<Shard[]> shards;
+  size_t mask;
+
+  Shard& shard(const Value& k) const {
+    size_t h = HashFunction()(k);
+    h ^= h >> 31;
+    h *= (size_t) 0x9E3779B97F4A7C15ULL;
+    return shards[(h ^ (h >> 29)) & mask];
+  }
+
+public:
+  // the number of shards gets rounded up to a power of 2
+  explicit ValueConcurrentMap(size_t shardCount = 64) {
+    size_t n = 1;
+    while (n < shardCount) n *= 2;
+    shards.reset(new Shard[n]);
+    mask = n - 1;
+  }
+
+  ValueConcurrentMap(const ValueConcurrentMap&) = delete;
+  ValueConcurrentMap& operator= (const ValueConcurrentMap&) = delete;
+
+  void put(const Value& k, const Value& v) {
+    Value key = k.deepCopy(), value = v.deepCopy();
+    Shard& s = shard(key);
+    std::unique_lock<std::shared_timed_mutex> guard(s.lock);
+    auto it = s.entries.find(key);
+    if (it == s.entries.end()) s.entries.emplace(static_cast<Value&&>(key), static_cast<Value&&>(value));
+    else std::swap(it->second, value); // the old value gets freed once the lock is released
+  }
+
+  // a copy of the value of k, null if there is none
+  Value get(const Value& k) const {
+    Shard& s = shard(k);
+    std::shared_lock<std::shared_timed_mutex> guard(s.lock);
+    auto it = s.entries.find(k);
+    return it == s.entries.end() ? Value() : it->second.deepCopy();
+  }
+
+  bool containsKey(const Value& k) const {
+    Shard& s = shard(k);
+    std::shared_lock<std::shared_timed_mutex> guard(s.lock);
+    return s.entries.count(k) != 0;
+  }
+
+  // false if there was no k
+  bool remove(const Value& k) {
+    Shard& s = shard(k);
+    std::unique_lock<std::shared_timed_mutex> guard(s.lock);
+    return s.entries.erase(k) != 0;
+  }
+
+  size_t size() const {
+    size_t n = 0;
+    for (size_t i = 0; i <= mask; i++) {
+      std::shared_lock<std::shared_timed_mutex> guard(shards[i].lock);
+      n += shards[i].entries.size();
+    }
+    return n;
+  }
+
+  // every entry as it was at one point in time (all the shards are locked while it gets copied)
+  Value snapshot() const {
+    std::vector<std::shared_lock<std::shared_timed_mutex> > guards;
+    guards.reserve(mask + 1);
+    size_t n = 0;
+    for (size_t i = 0; i <= mask; i++) {
+      guards.emplace_back(shards[i].lock);
+      n += shards[i].entries.size();
+    }
+    Value res = Types::Map;
+    res.reserve(n);
+    for (size_t i = 0; i <= mask; i++) {
+      for (auto it = shards[i].entries.begin(); it != shards[i].entries.end(); it++) {
+        res.put(it->first.deepCopy(), it->second.deepCopy());
+      }
+    }
+    return res;
+  }
+};
+
+// quiescent state based reclamation for ValueSnapshot. A thread reading snapshots calls quiescent()
+// whenever it holds nothing it read from one anymore (between two requests, say), and a version that
+// got replaced is freed once every thread reading has called it since. Reading takes no lock and no
+// atomic read-modify-write, a thread that stops reading for a while calls offline() so that versions
+// don't wait for it (and online() before reading again). Threads start reading online
+class ValueRcu {
+  struct Reader {
+    std::atomic<size_t> seen; // the epoch at its last quiescent state, 0 while offline
+    char padding[64]; // keeps the readers of two threads off the same cache line
+    Reader() {
+      ValueRcu& rcu = instance();
+      std::lock_guard<std::mutex> guard(rcu.lock);
+      seen.store(rcu.epoch.load(std::memory_order_acquire), std::memory_order_relaxed);
+      rcu.readers.push_back(this);
     }
-    return *this;
+    ~Reader() {
+      ValueRcu& rcu = instance();
+      std::lock_guard<std::mutex> guard(rcu.lock);
+      rcu.readers.erase(std::find(rcu.readers.begin(), rcu.readers.end(), this));
+    }
+  };
+
+  std::mutex lock; // taken when a thread starts or stops reading and by oldest()
+  std::vector<const Reader*> readers;
+  std::atomic<size_t> epoch;
+
+  ValueRcu() : epoch(1) {}
+
+public:
+  static ValueRcu& instance() {
+    static ValueRcu* rcu = new ValueRcu(); // outlives the threads
+    return *rcu;
   }
 
-  Value operator/(const Value& other) const {
-    Value v = *this;
-    v /= other;
-    return v;
+  // the reader of the calling thread, registered the first time
+  static Reader& reader() {
+    static thread_local Reader r;
+    return r;
   }
 
-  Value& operator%=(const Value& other) {
-    modify_linked()
-    if (_ISNUMBER(type) && _ISNUMBER(other.type)) {
-#ifdef USE_DOUBLE
-      data.number = (long) data.number % (long) other.data.number;
-#else
-      data.smallNumber = (long) data.smallNumber % (long) other.data.smallNumber;
-    } else if (_ISBIGNUMBER(type) && _ISBIGNUMBER(other.type)) {
-#ifndef USE_BIG_NUMBER
-      *data.number = floor(*data.number);
-      mpz_class t(toString().c_str());
-      t %= *other.data.number;
-      *data.number = t;
-#else
-      *data.number = *data.number % *other.data.number;
-#endif
-    } else if (_ISBIGNUMBER(type) && _ISNUMBER(other.type)) {
-#ifndef USE_BIG_NUMBER
-      *data.number = floor(*data.number);
-      mpz_class t(toString().c_str());
-      t %= other.data.smallNumber;
-      *data.number = t;
-#else
-      *data.number = *data.number % other.data.smallNumber;
-#endif
-    } else if (_ISNUMBER(type) && _ISBIGNUMBER(other.type)) {
-      data.smallNumber = (long) data.smallNumber % (long) other;
-#endif
-    } else {
-      *this = 0;
-    }
-    return *this;
+  // does nothing for a thread that is offline
+  static void quiescent() {
+    Reader& r = reader();
+    if (r.seen.load(std::memory_order_relaxed) == 0) return;
+    r.seen.store(instance().epoch.load(std::memory_order_acquire), std::memory_order_release);
   }
 
-  Value operator%(const Value& other) const {
-    Value v = *this;
-    v %= other;
-    return v;
+  static void offline() {
+    reader().seen.store(0, std::memory_order_release);
   }
 
-  Value operator++(int) {
-    Value tmp = this;
-    if (_ISNUMBER(type)) {
-#ifdef USE_DOUBLE
-      data.number ++;
-#else
-      data.smallNumber ++;
-    } else if (_ISBIGNUMBER(type)) {
-      *data.number += 1;
-#endif
-    }
-    return tmp;
+  static void online() {
+    reader().seen.store(instance().epoch.load(std::memory_order_acquire), std::memory_order_release);
+    // a publisher either sees this thread online or this thread sees what it published
+    std::atomic_thread_fence(std::memory_order_seq_cst);
   }
 
-  Value& operator++() {
-    if (_ISNUMBER(type)) {
-#ifdef USE_DOUBLE
-      data.number ++;
-#else
-      data.smallNumber ++;
-    } else if (_ISBIGNUMBER(type)) {
-      *data.number += 1;
-#endif
-    }
-    return *this;
+  // starts a new epoch, versions replaced before it can be freed once oldest() gets to it
+  size_t advance() {
+    size_t e = epoch.fetch_add(1, std::memory_order_acq_rel) + 1;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return e;
   }
 
-  Value operator--(int) {
-    Value tmp = this;
-    if (_ISNUMBER(type)) {
-#ifdef USE_DOUBLE
-      data.number --;
-#else
-      data.smallNumber --;
-    } else if (_ISBIGNUMBER(type)) {
-      *data.number -= 1;
-#endif
+  // the epoch that every thread online has gone through a quiescent state in
+  size_t oldest() {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t res = (size_t) -1;
+    for (size_t i = 0; i < readers.size(); i++) {
+      size_t e = readers[i]->seen.load(std::memory_order_acquire);
+      if (e != 0 && e < res) res = e;
     }
-    return tmp;
+    return res;
   }
+};
 
-  Value& operator--() {
-    if (_ISNUMBER(type)) {
-#ifdef USE_DOUBLE
-      data.number --;
-#else
-      data.smallNumber --;
-    } else if (_ISBIGNUMBER(type)) {
-      *data.number -= 1;
-#endif
+// holds the current version of a T that any number of threads read while one at a time publishes the
+// next, read-copy-update style: read() is a plain load, publish() swaps the pointer and the version it
+// replaces gets freed after a grace period (see ValueRcu). A Value gets frozen when it is published so
+// readers can copy parts of it without touching use counts, those copies mustn't outlive the reader's
+// next quiescent state (deepCopy() what has to be kept). Only destroy a snapshot nothing reads anymore
+template <class T = Value>
+class ValueSnapshot {
+  std::atomic<const T*> current;
+  std::mutex lock; // taken by publish() and reclaim()
+  std::vector<std::pair<const T*, size_t> > retired; // replaced versions and the epoch they got replaced in
+
+  static const Value* make(const Value& v) {
+    return new Value(v.freeze());
+  }
+  template <class U>
+  static const U* make(const U& v) {
+    return new U(v);
+  }
+  static void destroy(const Value* v) {
+    Value::thaw(*const_cast<Value*>(v));
+    delete v;
+  }
+  template <class U>
+  static void destroy(const U* v) {
+    delete v;
+  }
+
+  size_t reclaimLocked() {
+    size_t oldest = ValueRcu::instance().oldest(), n = 0;
+    for (size_t i = 0; i < retired.size(); i++) {
+      if (retired[i].second <= oldest) destroy(retired[i].first);
+      else retired[n++] = retired[i];
     }
-    return *this;
+    retired.resize(n);
+    return n;
   }
 
-  inline TEXT& getString() const {
-    return *data.text;
+public:
+  explicit ValueSnapshot(const T& v = T()) : current(make(v)) {}
+
+  ValueSnapshot(const ValueSnapshot&) = delete;
+  ValueSnapshot& operator= (const ValueSnapshot&) = delete;
+
+  ~ValueSnapshot() {
+    destroy(current.load(std::memory_order_relaxed));
+    for (size_t i = 0; i < retired.size(); i++) destroy(retired[i].first);
   }
 
-  void pow(const Value& other) {
-    modify_linked()
-    if (_ISNUMBER(type) && _ISNUMBER(other.type)) {
-#ifdef USE_DOUBLE
-      data.number = ::pow(data.number, other.data.number);
-#else
-      if (type != Types::SmallNumber && other.data.smallNumber * log10(data.smallNumber) + 1 >= 8) {
-#ifndef USE_BIG_NUMBER
-        NUMBER n = NUMBER(std::to_string(other.data.smallNumber));
-        data.number = new NUMBER(std::to_string(data.smallNumber));
-#else
-        NUMBER n = NUMBER(other.toString().c_str());
-        data.number = new NUMBER(toString().c_str());
+  // valid until the calling thread's next quiescent state
+  const T& read() const {
+    ValueRcu::reader();
+    return *current.load(std::memory_order_acquire);
+  }
+
+  // makes v the current version (a frozen deep copy of it for a Value) and frees the replaced ones
+  // no thread can be reading anymore
+  void publish(const T& v) {
+    const T* next = make(v);
+    std::lock_guard<std::mutex> guard(lock);
+    const T* replaced = current.exchange(next, std::memory_order_acq_rel);
+    retired.push_back(std::make_pair(replaced, ValueRcu::instance().advance()));
+    reclaimLocked();
+  }
+
+  // frees the replaced versions no thread can be reading anymore, returns how many are left
+  size_t reclaim() {
+    std::lock_guard<std::mutex> guard(lock);
+    return reclaimLocked();
+  }
+
+  // waits until every version replaced so far is freed, the calling thread mustn't be holding
+  // anything it read (it goes through a quiescent state)
+  void synchronize() {
+    ValueRcu::quiescent();
+    while (reclaim() != 0) std::this_thread::yield();
+  }
+};
+
+// frees reference cycles with trial deletion (the synchronous collector of Bacon and Rajan): arrays and
+// maps whose use count dropped without getting to zero are kept as possible roots, collect() takes the
+// references among the payloads reachable from them out of their counts and frees the ones that nothing
+// else holds. Persistent arrays and maps share their nodes with other payloads so they are taken as
+// holding nothing, cycles going through them are never freed. Nothing else may be using values while it runs
+class ValueCycleCollector {
+public:
+  struct Root {
+    Types type;
+    Value::Data data;
+    USE_COUNT_TYPE* useCount;
+  };
+  std::unordered_map<const void*, Root> roots;
+  size_t collections = 0;
+  size_t freed = 0;
+  bool detecting = CYCLE_COLLECT_THRESHOLD > 0;
+#ifdef USE_THREADS
+  std::mutex lock;
 #endif
-        type = Types::BigNumber;
-        useCount = new USE_COUNT_TYPE; *useCount = 0;
-#ifndef USE_BIG_NUMBER
-        mpf_pow_ui(data.number->get_mpf_t(), data.number->get_mpf_t(), (long) other);
-#else
-        *data.number = data.number->pow((long) other);
+
+  static ValueCycleCollector& instance() {
+    static ValueCycleCollector* collector = new ValueCycleCollector(); // outlives every static value
+    return *collector;
+  }
+
+  // buffered is checked and set with the lock held, threads can hold copies of the same payload
+  void add(Types type, Value::Data data, USE_COUNT_TYPE* useCount) {
+#ifdef USE_THREADS
+    std::lock_guard<std::mutex> guard(lock);
 #endif
-      } else {
-        data.smallNumber = ::pow(data.smallNumber, other.data.smallNumber);
-      }
-    } else if (_ISBIGNUMBER(type) && IS_NUM(other)) {
-#ifndef USE_BIG_NUMBER
-      mpf_pow_ui(data.number->get_mpf_t(), data.number->get_mpf_t(), (long) other);
-#else
-      *data.number = data.number->pow((long) other);
+    bool& buffered = _ISARR(type) ? data.array->buffered : data.map->buffered;
+    if (buffered) return;
+    buffered = true;
+    roots[payload(type, data)] = Root { type, data, useCount };
+  }
+
+  size_t pending() {
+#ifdef USE_THREADS
+    std::lock_guard<std::mutex> guard(lock);
 #endif
+    return roots.size();
+  }
+
+  void remove(Types type, Value::Data data) {
+#ifdef USE_THREADS
+    std::lock_guard<std::mutex> guard(lock);
 #endif
+    roots.erase(payload(type, data));
+  }
+
+  size_t collect() {
+    std::vector<Root> candidates;
+    {
+#ifdef USE_THREADS
+      std::lock_guard<std::mutex> guard(lock);
+#endif
+      candidates.reserve(roots.size());
+      for (auto it = roots.begin(); it != roots.end(); it++) {
+        if (_ISARR(it->second.type)) it->second.data.array->buffered = false;
+        else it->second.data.map->buffered = false;
+        candidates.push_back(it->second);
+      }
+      roots.clear();
+    }
+    _trace_scope("collectCycles", Types::Null, candidates.size());
+    std::unordered_map<const void*, Node> nodes;
+    std::vector<Node*> stack;
+    // gray: every reference from a payload reachable from the roots is taken out of the count of the one
+    // it points to
+    for (size_t i = 0; i < candidates.size(); i++) {
+      stack.push_back(&node(nodes, candidates[i].type, candidates[i].data, candidates[i].useCount));
+      while (!stack.empty()) {
+        Node* n = stack.back();
+        stack.pop_back();
+        if (n->color == Gray) continue;
+        n->color = Gray;
+        forEachChild(*n, [&nodes, &stack] (const Value& child) {
+          Node& c = node(nodes, child.type, child.data, child.useCount);
+          c.count--;
+          if (c.color != Gray) stack.push_back(&c);
+        });
+      }
+    }
+    // white: the ones left with no count, unless something still referenced from outside reaches them
+    for (size_t i = 0; i < candidates.size(); i++) {
+      stack.push_back(&nodes[payload(candidates[i].type, candidates[i].data)]);
+      while (!stack.empty()) {
+        Node* n = stack.back();
+        stack.pop_back();
+        if (n->color != Gray) continue;
+        if (n->count > 0) {
+          restore(nodes, n);
+          continue;
+        }
+        n->color = White;
+        forEachChild(*n, [&nodes, &stack] (const Value& child) {
+          stack.push_back(&nodes[payload(child.type, child.data)]);
+        });
+      }
+    }
+    // the white payloads are held while their elements are dropped, so none of them gets freed while
+    // another one is still being emptied
+    std::vector<Value> garbage;
+    for (auto it = nodes.begin(); it != nodes.end(); it++) {
+      if (it->second.color == White) garbage.push_back(Value(it->second.data, it->second.type, it->second.useCount));
+    }
+    for (size_t i = 0; i < garbage.size(); i++) {
+      if (_ISARR(garbage[i].type)) garbage[i].data.array->clear();
+      else garbage[i].data.map->clear();
     }
+    size_t count = garbage.size();
+    garbage.clear();
+    collections++;
+    freed += count;
+    return count;
   }
-};
 
-#ifndef USE_NOSTD_MAP
-inline size_t HashFunction::operator() (const Value& v) const {
-// #ifdef USE_ARDUINO_STRING
-//   return (std::hash<char*>() ((char*) v.toString().c_str())) ^
-// #else
-//   return (std::hash<std::string>() (v.toString())) ^
-// #endif
-//           (std::hash<int>()((int) v.getType()));
+private:
+  enum Color : char { Black, Gray, White };
+  struct Node {
+    Types type;
+    Value::Data data;
+    USE_COUNT_TYPE* useCount;
+    size_t count;
+    Color color;
+  };
 
-  Types t = v.getType();
-  if (_ISTEXT(t)) {
-#ifdef USE_ARDUINO_STRING
-    return (std::hash<const char*>() (v.getString().c_str())) ^
-#else
-    return (std::hash<std::string>() (v.getString())) ^
-#endif
-            (std::hash<char>()((char) t));
-  } else if (_ISNULL(t) || _ISFALSE(t) || _ISTRUE(t)) {
-    return (std::hash<char>() (0) ^ (std::hash<char>() ((char) t)));
-  } else if (_ISNUMBER(t)) {
-#ifdef USE_DOUBLE
-    return (std::hash<double>() (v.getData().number) ^ (std::hash<char>() ((char) Types::Number)));
-#else
-    return (std::hash<double>() (v.getData().smallNumber) ^ (std::hash<char>() ((char) Types::Number)));
-#endif
-  } else if (_ISARR(t)) {
-    size_t hash = (std::hash<char>() ((char) Types::Array)), s = v.length();
-    while (s > 0) {
-      s--;
-      hash ^= s + this->operator() (v[s]);
+  static inline const void* payload(Types type, Value::Data data) {
+    return _ISARR(type) ? (const void*) data.array : (const void*) data.map;
+  }
+
+  static Node& node(std::unordered_map<const void*, Node>& nodes, Types type, Value::Data data, USE_COUNT_TYPE* useCount) {
+    auto it = nodes.find(payload(type, data));
+    if (it != nodes.end()) return it->second;
+    return nodes.emplace(payload(type, data), Node { type, data, useCount, (size_t) *useCount + 1, Black }).first->second;
+  }
+
+  // the arrays and maps held by the elements (and keys) of a payload
+  template <class F>
+  static void forEachChild(const Node& n, const F& fn) {
+    if (_ISARR(n.type)) {
+      const ARRAY& a = *n.data.array;
+      if (a.isView) {
+        fn(a.viewOf);
+        return;
+      }
+      if (a.isPacked || a.isPersistent) return;
+      for (size_t i = 0; i < a.size(); i++) {
+        if (isContainer(a.item(i))) fn(a.item(i));
+      }
+    } else if (!n.data.map->isPersistent) {
+      n.data.map->forEach([&fn] (const Value& k, const Value& v) {
+        if (isContainer(k)) fn(k);
+        if (isContainer(v)) fn(v);
+        return true;
+      });
     }
-    return hash;
-  } else if (_ISMAP(t)) {
-    size_t hash = (std::hash<char>() ((char) Types::Map)), s = v.length();
-    while (s > 0) {
-      s--;
-      hash ^= this->operator() (v.getKeyAt(s)) ^ this->operator() (v.getValueAt(s));
+  }
+
+  static inline bool isContainer(const Value& v) {
+    return (_ISARR(v.type) || _ISMAP(v.type)) && v.useCount != 0 && !v.isFrozen();
+  }
+
+  // n is still used from outside, so is everything reachable from it
+  static void restore(std::unordered_map<const void*, Node>& nodes, Node* n) {
+    std::vector<Node*> stack;
+    n->color = Black;
+    stack.push_back(n);
+    while (!stack.empty()) {
+      Node* b = stack.back();
+      stack.pop_back();
+      forEachChild(*b, [&nodes, &stack] (const Value& child) {
+        Node& c = nodes[payload(child.type, child.data)];
+        c.count++;
+        if (c.color != Black) {
+          c.color = Black;
+          stack.push_back(&c);
+        }
+      });
     }
-    return hash;
-  } else {
-#ifdef USE_ARDUINO_STRING
-    return (std::hash<char*>() ((char*) v.toString().c_str())) ^
-#else
-    return (std::hash<std::string>() (v.toString())) ^
-#endif
-            (std::hash<char>()((char) t));
   }
+};
+
+inline void Value::bufferPossibleCycle() {
+  ValueCycleCollector& collector = ValueCycleCollector::instance();
+  if (!collector.detecting || (_ISARR(type) ? data.array->isPacked : !_ISMAP(type))) return;
+  collector.add(type, data, useCount);
 }
-#else
-inline Pair& Pair::operator= (const Pair& p) {
-  this->key = p.key;
-  this->value = p.value;
-  return *this;
+
+inline void Value::forgetPossibleCycle(Types type, Data data) {
+  ValueCycleCollector::instance().remove(type, data);
 }
-#endif
 
-  static Value __NULL__;
+inline size_t Value::collectCycles() {
+  return ValueCycleCollector::instance().collect();
+}
+
+inline void Value::detectCycles(bool on) {
+  ValueCycleCollector::instance().detecting = on;
+}
+
+#if CYCLE_COLLECT_THRESHOLD > 0
+inline void Value::collectCyclesIfNeeded() {
+  if (ValueCycleCollector::instance().pending() >= CYCLE_COLLECT_THRESHOLD) collectCycles();
+}
+#endif
+#endif
+#endif
 
   inline const Value& Value::getValueAt(size_t index) const {
     if (_ISMAP(type)) {
 #ifndef USE_NOSTD_MAP
-      std::unordered_map<Value, Value>::iterator it = data.map->begin();
+      if (data.map->shape && index < data.map->slots.size()) return data.map->slots[index];
+      if (data.map->shape) index -= data.map->slots.size();
+      if (data.map->isPersistent) {
+        const Value* res = &__NULL__;
+        data.map->forEach([&index, &res] (const Value&, const Value& v) {
+          if (index-- == 0) res = &v;
+          return res == &__NULL__;
+        });
+        return *res;
+      }
+      auto it = data.map->hashEntries().begin();
       std::advance(it, index);
       return it->second;
 #else
@@ -2071,7 +6724,17 @@ inline Pair& Pair::operator= (const Pair& p) {
   inline const Value& Value::getKeyAt(size_t index) const {
     if (_ISMAP(type)) {
 #ifndef USE_NOSTD_MAP
-      std::unordered_map<Value, Value>::iterator it = data.map->begin();
+      if (data.map->shape && index < data.map->slots.size()) return data.map->shape->keys[index];
+      if (data.map->shape) index -= data.map->slots.size();
+      if (data.map->isPersistent) {
+        const Value* res = &__NULL__;
+        data.map->forEach([&index, &res] (const Value& k, const Value&) {
+          if (index-- == 0) res = &k;
+          return res == &__NULL__;
+        });
+        return *res;
+      }
+      auto it = data.map->hashEntries().begin();
       std::advance(it, index);
       return it->first;
 #else
@@ -2090,17 +6753,38 @@ inline Pair& Pair::operator= (const Pair& p) {
         }
       }
 #else
+      if (isFrozen()) { // read only, a missing key doesn't get added
+        const Value* v = data.map->find(k);
+        return v ? const_cast<Value&>(*v) : __NULL__;
+      }
       return (*data.map)[k];
 #endif
     }
     return __NULL__;
   }
 
-  inline Value& Value::operator[] (const Value& i) const {
+#ifndef USE_NOSTD_MAP
+  inline Value& Value::get(const Value& k, ValueKeyCache& cache) const {
+    if (_ISMAP(type) && data.map->shape) {
+      if (data.map->shape == cache.shape) return data.map->slots[cache.index];
+      size_t i = data.map->shape->indexOf(k);
+      if (i != (size_t) -1) {
+        cache.shape = data.map->shape;
+        cache.index = i;
+        return data.map->slots[i];
+      }
+    }
+    return get(k);
+  }
+#endif
+
+  inline Value& Value::operator[] (const Value& i) {
     if (_ISARR(type)) {
 #ifdef USE_ARDUINO_ARRAY
       return *(*data.array)[(long) i];
 #else
+      if (data.array->isPersistent) return data.array->persistent.ref((long) i);
+      data.array->unpack();
       return (*data.array)[(long) i];
 #endif
     } else if (_ISMAP(type)) {
@@ -2109,11 +6793,13 @@ inline Pair& Pair::operator= (const Pair& p) {
     return __NULL__;
   }
 
-  inline Value& Value::operator[] (int i) const {
+  inline Value& Value::operator[] (int i) {
     if (_ISARR(type)) {
 #ifdef USE_ARDUINO_ARRAY
       return *(*data.array)[i];
 #else
+      if (data.array->isPersistent) return data.array->persistent.ref(i);
+      data.array->unpack();
       return (*data.array)[i];
 #endif
     } else if (_ISMAP(type)) {
@@ -2122,6 +6808,32 @@ inline Pair& Pair::operator= (const Pair& p) {
     return __NULL__;
   }
 
+  inline Value Value::operator[] (const Value& i) const {
+    if (_ISARR(type)) {
+#ifdef USE_ARDUINO_ARRAY
+      return *(*data.array)[(long) i];
+#else
+      return data.array->element((long) i);
+#endif
+    } else if (_ISMAP(type)) {
+      return get(i);
+    }
+    return __NULL__;
+  }
+
+  inline Value Value::operator[] (int i) const {
+    if (_ISARR(type)) {
+#ifdef USE_ARDUINO_ARRAY
+      return *(*data.array)[i];
+#else
+      return data.array->element(i);
+#endif
+    } else if (_ISMAP(type)) {
+      return get(i);
+    }
+    return __NULL__;
+  }
+
 #ifdef USE_ARDUINO_STRING
 inline int compareValue(const void *cmp1, const void *cmp2) {
   Value* a = *((Value **) cmp1);